@@ -0,0 +1,553 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <linux/bitops.h>
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/blkdev.h>
+#include <linux/mutex.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "logging.h"
+#include "mod.h"
+
+#define FNM "alloc"
+
+/*
+ * Blocks are handed out from the allocation bitmap (see mod.h), which
+ * can be searched for runs of free blocks far quicker than reading the
+ * header of every block on the device. All allocations on a mount are
+ * serialised by s_alloc_lock.
+ */
+
+// The first block that can ever be allocated (the journal comes last)
+static sector_t
+dummyfs_first_free (struct dummyfs_sb_info *sbi)
+{
+  return sbi->s_journal + sbi->s_journal_blocks;
+}
+
+/*
+ * Find the run freed but not yet committed that holds block (with the
+ * allocation lock held). Such blocks are still in use on disk until the
+ * transaction that frees them commits, so they mustn't be handed out or
+ * discarded before then, even though they're clear in the bitmap.
+ *
+ * Returns the run, or NULL (lowering *next to the start of the first
+ * such run after block, if that's before *next).
+ */
+static struct dummyfs_freed_run *
+dummyfs_freed_find (struct dummyfs_sb_info *sbi, sector_t block,
+                    sector_t *next)
+{
+  struct list_head *lists[] = { &sbi->s_freed, &sbi->s_committing };
+  struct dummyfs_freed_run *run;
+  int k;
+
+  for (k = 0; k < ARRAY_SIZE (lists); k++)
+    list_for_each_entry (run, lists[k], f_list)
+      {
+        if (run->f_start <= block && block < run->f_start + run->f_count)
+          return run;
+        if (run->f_start > block && run->f_start < *next)
+          *next = run->f_start;
+      }
+
+  return NULL;
+}
+
+/*
+ * Weigh up the free blocks from from to to as a run for dummyfs_find_run,
+ * split around any that are waiting on a commit.
+ */
+static void
+dummyfs_fit_run (struct dummyfs_sb_info *sbi, sector_t from, sector_t to,
+                 unsigned long want, unsigned long *best, sector_t *start)
+{
+  struct dummyfs_freed_run *busy;
+  sector_t piece;
+
+  while (from < to && *best < want)
+    {
+      piece = to;
+      busy = dummyfs_freed_find (sbi, from, &piece);
+      if (busy)
+        {
+          from = MIN (to, busy->f_start + busy->f_count);
+          continue;
+        }
+      if (piece - from > *best)
+        {
+          *best = MIN (piece - from, want);
+          *start = from;
+        }
+      from = piece;
+    }
+}
+
+/*
+ * Search the bitmap between from and to for a run of want free blocks,
+ * settling for the longest run there is if none are that long (with the
+ * allocation lock held).
+ *
+ * Returns the length of the run found (at most want), or 0 if every
+ * block in the range is in use.
+ */
+static unsigned long
+dummyfs_find_run (struct super_block *sb, sector_t from, sector_t to,
+                  unsigned long want, sector_t *start)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *map;
+  struct buffer_head *bh;
+  unsigned long bits = sbi->s_bitmap_bits;
+  unsigned long limit;
+  unsigned long off;
+  unsigned long best = 0;
+  sector_t base;
+  sector_t run_start = 0;
+  int in_run = false;
+
+  while (from < to && best < want)
+    {
+      base = from - from % bits;
+      off = from % bits;
+      limit = MIN (bits, to - base);
+      map = dummyfs_get_block (sb, sbi->s_bitmap + base / bits, &bh);
+      if (!map)
+        break;
+
+      /*
+       * Hop from the start of each free run to its end. A run that
+       * reaches the end of this bitmap block carries on into the next.
+       */
+      while (off < limit && best < want)
+        {
+          if (!in_run)
+            {
+              off = find_next_zero_bit_le (map->b_data, limit, off);
+              if (off >= limit)
+                break;
+              run_start = base + off;
+              in_run = true;
+            }
+          off = find_next_bit_le (map->b_data, limit, off);
+          if (base + off - run_start > best)
+            dummyfs_fit_run (sbi, run_start, base + off, want, &best, start);
+          if (off < limit)
+            in_run = false;
+        }
+      dummyfs_put_block (bh);
+      from = base + limit;
+    }
+
+  return best;
+}
+
+/*
+ * Set (or clear) the bits of a run of blocks in the bitmap, writing out
+ * each bitmap block touched and keeping count of the free blocks (with
+ * the allocation lock held).
+ */
+static void
+dummyfs_mark_blocks (struct super_block *sb, sector_t start,
+                     unsigned long count, int used)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *map;
+  struct buffer_head *bh;
+  unsigned long bits = sbi->s_bitmap_bits;
+  unsigned long off;
+
+  while (count)
+    {
+      map = dummyfs_get_block (sb, sbi->s_bitmap + start / bits, &bh);
+      if (!map)
+        {
+          log_info (FNM, "couldn't read the bitmap for block %llu", start);
+          return;
+        }
+      for (off = start % bits; off < bits && count; off++, count--, start++)
+        {
+          if (used == !!test_bit_le (off, map->b_data))
+            continue;
+          if (used)
+            {
+              __set_bit_le (off, map->b_data);
+              sbi->s_free_blocks--;
+            }
+          else
+            {
+              __clear_bit_le (off, map->b_data);
+              sbi->s_free_blocks++;
+            }
+        }
+      dummyfs_dirty_block (sb, bh);
+      dummyfs_put_block (bh);
+    }
+}
+
+/*
+ * Count the free blocks in the bitmap, for statfs to report from then on
+ * (when mounting, once the journal has been replayed).
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_count_free (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *map;
+  struct buffer_head *bh;
+  unsigned long bits = sbi->s_bitmap_bits;
+  unsigned long limit;
+  unsigned long k;
+  sector_t used = 0;
+  sector_t base;
+
+  for (base = 0; base < sbi->s_numblocks; base += bits)
+    {
+      map = dummyfs_get_block (sb, sbi->s_bitmap + base / bits, &bh);
+      if (!map)
+        return -EIO;
+      limit = MIN (bits, sbi->s_numblocks - base);
+      used += memweight (map->b_data, limit / 8);
+      for (k = limit - limit % 8; k < limit; k++)
+        used += !!test_bit_le (k, map->b_data);
+      dummyfs_put_block (bh);
+    }
+
+  sbi->s_free_blocks = sbi->s_numblocks - used;
+  log_info (FNM, "%llu free blocks", sbi->s_free_blocks);
+
+  return 0;
+}
+
+/*
+ * Claim a run of up to want free blocks, as close after goal as there is
+ * one (or after where the last allocation left off, if goal is 0). The
+ * search wraps around to the start of the device, and takes the longest
+ * run it can find if there's no run of want blocks.
+ *
+ * Returns the first block of the run (with its length in *got), or 0 if
+ * the device is full.
+ */
+sector_t
+dummyfs_alloc_blocks (struct super_block *sb, sector_t goal,
+                      unsigned long want, unsigned long *got)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  sector_t first = dummyfs_first_free (sbi);
+  sector_t start = 0;
+  sector_t wrapped;
+  unsigned long len;
+  unsigned long wrapped_len;
+
+  *got = 0;
+  if (!want)
+    return 0;
+
+  mutex_lock (&sbi->s_alloc_lock);
+
+  if (goal < first || goal >= sbi->s_numblocks)
+    goal = sbi->s_alloc_hint;
+  if (goal < first || goal >= sbi->s_numblocks)
+    goal = first;
+
+  len = dummyfs_find_run (sb, goal, sbi->s_numblocks, want, &start);
+  if (len < want && goal > first)
+    {
+      wrapped_len = dummyfs_find_run (sb, first, goal, want, &wrapped);
+      if (wrapped_len > len)
+        {
+          len = wrapped_len;
+          start = wrapped;
+        }
+    }
+
+  if (len)
+    {
+      dummyfs_mark_blocks (sb, start, len, true);
+      sbi->s_alloc_hint = start + len;
+    }
+
+  mutex_unlock (&sbi->s_alloc_lock);
+
+  if (!len)
+    {
+      log_info (FNM, "no free blocks left");
+      return 0;
+    }
+
+  log_info (FNM, "allocated %llu+%lu (wanted %lu after %llu)", start, len,
+            want, goal);
+
+  *got = len;
+  return start;
+}
+
+/*
+ * Tell the device a run of blocks is no longer in use, so thin-provisioned
+ * or flash storage can reclaim the space.
+ */
+static void
+dummyfs_discard (struct super_block *sb, sector_t start, unsigned long count)
+{
+  int err;
+
+  err = sb_issue_discard (sb, start, count, GFP_NOFS, 0);
+  if (err)
+    log_info (FNM, "discard of %llu+%lu failed (%d)", start, count, err);
+}
+
+/*
+ * Give a run of blocks back to the free pool. Nothing is written to the
+ * blocks themselves: the bitmap alone says which blocks are free.
+ *
+ * With a journal, the run is also remembered until the transaction that
+ * frees it commits (see dummyfs_freed_take), since until then the blocks
+ * are still in use on disk and mustn't be handed out again or discarded.
+ * Without one, the run is discarded right away on a mount with the
+ * discard option, before it's marked free and can be handed out again.
+ */
+void
+dummyfs_free_blocks (struct super_block *sb, sector_t start,
+                     unsigned long count)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_freed_run *run = NULL;
+  struct dummyfs_freed_run *last;
+
+  if (start < dummyfs_first_free (sbi) || start + count > sbi->s_numblocks)
+    {
+      log_info (FNM, "refusing to free %llu+%lu", start, count);
+      return;
+    }
+  if (!count)
+    return;
+
+  log_info (FNM, "freeing %llu+%lu", start, count);
+
+  if (sbi->s_log)
+    run = kmalloc (sizeof (struct dummyfs_freed_run),
+                   GFP_NOFS | __GFP_NOFAIL);
+  else if (sbi->s_discard)
+    dummyfs_discard (sb, start, count);
+
+  mutex_lock (&sbi->s_alloc_lock);
+  dummyfs_mark_blocks (sb, start, count, false);
+  if (run)
+    {
+      // Runs freed one after the other are usually next to each other
+      last = list_empty (&sbi->s_freed)
+                 ? NULL
+                 : list_last_entry (&sbi->s_freed, struct dummyfs_freed_run,
+                                    f_list);
+      if (last && last->f_start + last->f_count == start)
+        {
+          last->f_count += count;
+          kfree (run);
+        }
+      else
+        {
+          run->f_start = start;
+          run->f_count = count;
+          list_add_tail (&run->f_list, &sbi->s_freed);
+        }
+    }
+  mutex_unlock (&sbi->s_alloc_lock);
+}
+
+/*
+ * Find the first block from from on (but before to) that's in use, or
+ * free (with the allocation lock held).
+ *
+ * Returns the block, or to if there's none.
+ */
+static sector_t
+dummyfs_next_block (struct super_block *sb, sector_t from, sector_t to,
+                    int used)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *map;
+  struct buffer_head *bh;
+  unsigned long bits = sbi->s_bitmap_bits;
+  unsigned long limit;
+  unsigned long off;
+  sector_t base;
+
+  while (from < to)
+    {
+      base = from - from % bits;
+      limit = MIN (bits, to - base);
+      map = dummyfs_get_block (sb, sbi->s_bitmap + base / bits, &bh);
+      if (!map)
+        break;
+      if (used)
+        off = find_next_bit_le (map->b_data, limit, from % bits);
+      else
+        off = find_next_zero_bit_le (map->b_data, limit, from % bits);
+      dummyfs_put_block (bh);
+      if (off < limit)
+        return base + off;
+      from = base + limit;
+    }
+
+  return to;
+}
+
+/*
+ * Discard every run of at least minlen free blocks between from and to,
+ * leaving out any blocks freed since the last commit (with the allocation
+ * lock held).
+ *
+ * Returns the number of blocks discarded.
+ */
+static unsigned long
+dummyfs_trim_range (struct super_block *sb, sector_t from, sector_t to,
+                    unsigned long minlen)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_freed_run *busy;
+  unsigned long trimmed = 0;
+  sector_t start;
+  sector_t end;
+  sector_t piece;
+
+  while (from < to)
+    {
+      start = dummyfs_next_block (sb, from, to, false);
+      end = dummyfs_next_block (sb, start, to, true);
+      from = end;
+
+      // Split the free run around the ones still waiting to commit
+      while (start < end)
+        {
+          piece = end;
+          busy = dummyfs_freed_find (sbi, start, &piece);
+          if (busy)
+            {
+              start = MIN (end, busy->f_start + busy->f_count);
+              continue;
+            }
+          if (piece - start >= minlen)
+            {
+              dummyfs_discard (sb, start, piece - start);
+              trimmed += piece - start;
+            }
+          start = piece;
+        }
+    }
+
+  return trimmed;
+}
+
+/*
+ * Set aside the runs freed in a transaction that's being closed (with the
+ * journal's j_sem held exclusively, so no more can be added to it). They
+ * stay out of reach of allocations until dummyfs_freed_done.
+ */
+void
+dummyfs_freed_take (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+
+  mutex_lock (&sbi->s_alloc_lock);
+  list_splice_tail_init (&sbi->s_freed, &sbi->s_committing);
+  mutex_unlock (&sbi->s_alloc_lock);
+}
+
+/*
+ * Let go of the runs set aside by dummyfs_freed_take once their
+ * transaction has committed, discarding them on a mount with the discard
+ * option. If the commit failed, they're held back until a later commit
+ * gets the transaction to the disk.
+ */
+void
+dummyfs_freed_done (struct super_block *sb, int committed)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_freed_run *run;
+  struct dummyfs_freed_run *next;
+  LIST_HEAD (freed);
+
+  mutex_lock (&sbi->s_alloc_lock);
+  if (committed)
+    list_splice_init (&sbi->s_committing, &freed);
+  else
+    list_splice_init (&sbi->s_committing, &sbi->s_freed);
+  mutex_unlock (&sbi->s_alloc_lock);
+
+  list_for_each_entry_safe (run, next, &freed, f_list)
+    {
+      if (sbi->s_discard)
+        {
+          mutex_lock (&sbi->s_alloc_lock);
+          dummyfs_trim_range (sb, run->f_start, run->f_start + run->f_count,
+                              1);
+          mutex_unlock (&sbi->s_alloc_lock);
+        }
+      list_del (&run->f_list);
+      kfree (run);
+    }
+}
+
+/*
+ * Forget the runs still waiting on a commit, when the journal is torn
+ * down (after everything it held has been written back in place).
+ */
+void
+dummyfs_freed_destroy (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_freed_run *run;
+  struct dummyfs_freed_run *next;
+
+  list_splice_init (&sbi->s_committing, &sbi->s_freed);
+  list_for_each_entry_safe (run, next, &sbi->s_freed, f_list)
+    {
+      list_del (&run->f_list);
+      kfree (run);
+    }
+}
+
+/*
+ * Discard the runs of at least minlen free blocks between start and end
+ * (FITRIM). The bitmap is gone through a bitmap block at a time, so that
+ * allocations aren't held up for long.
+ *
+ * Returns the number of blocks discarded.
+ */
+unsigned long
+dummyfs_trim_blocks (struct super_block *sb, sector_t start, sector_t end,
+                     unsigned long minlen)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  unsigned long trimmed = 0;
+  sector_t stop;
+
+  start = MAX (start, dummyfs_first_free (sbi));
+  end = MIN (end, sbi->s_numblocks);
+
+  log_info (FNM, "trimming %llu to %llu, runs of %lu or more", start, end,
+            minlen);
+
+  while (start < end && !fatal_signal_pending (current))
+    {
+      stop = MIN (end, start - start % sbi->s_bitmap_bits
+                           + sbi->s_bitmap_bits);
+      mutex_lock (&sbi->s_alloc_lock);
+      trimmed += dummyfs_trim_range (sb, start, stop, minlen);
+      mutex_unlock (&sbi->s_alloc_lock);
+      start = stop;
+      cond_resched ();
+    }
+
+  log_info (FNM, "trimmed %lu blocks", trimmed);
+
+  return trimmed;
+}
@@ -0,0 +1,30 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#ifndef ALLOC
+#define ALLOC
+
+#include <linux/list.h>
+
+#include "mod.h"
+
+// A run of blocks freed in the running transaction (see alloc.c)
+struct dummyfs_freed_run
+{
+  struct list_head f_list;
+  sector_t f_start;
+  unsigned long f_count;
+};
+
+int dummyfs_count_free (struct super_block *);
+sector_t dummyfs_alloc_blocks (struct super_block *, sector_t, unsigned long,
+                               unsigned long *);
+void dummyfs_free_blocks (struct super_block *, sector_t, unsigned long);
+void dummyfs_freed_take (struct super_block *);
+void dummyfs_freed_done (struct super_block *, int);
+void dummyfs_freed_destroy (struct super_block *);
+unsigned long dummyfs_trim_blocks (struct super_block *, sector_t, sector_t,
+                                   unsigned long);
+
+#endif
@@ -6,76 +6,339 @@
 
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/fiemap.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 
+#include "alloc.h"
 #include "block.h"
+#include "cache.h"
+#include "compress.h"
+#include "journal.h"
 #include "logging.h"
 #include "mod.h"
+#include "pack.h"
 
 #define FNM "block"
 
 /*
- * Read a block from the superblock/block device.
+ * Get a block from the device to look at (or change) in place, straight
+ * out of the buffer cache rather than copying it anywhere. Changes are
+ * written out with dummyfs_dirty_block, and the block has to be released
+ * with dummyfs_put_block once the caller is done with it.
  *
- * Returns size of block read.
+ * Returns the block's data, or NULL if it couldn't be read.
  */
-int
-dummyfs_readblock (struct super_block *sb, unsigned long block_index,
-                   struct dummyfs_block *block)
+void *
+dummyfs_get_block (struct super_block *sb, sector_t block_index,
+                   struct buffer_head **bhp)
+{
+  log_info (FNM, "get block : %llu", block_index);
+
+  *bhp = sb_bread (sb, block_index);
+  if (!*bhp)
+    {
+      log_info (FNM, "couldn't read block %llu", block_index);
+      return NULL;
+    }
+
+  return (*bhp)->b_data;
+}
+
+/*
+ * Get a block that's about to be filled in from scratch (e.g.: one that
+ * was just allocated) without reading its old contents off the device.
+ * The block comes back zeroed, and is released like any other.
+ *
+ * Returns the block's data, or NULL if there was no memory for it.
+ */
+void *
+dummyfs_get_new_block (struct super_block *sb, sector_t block_index,
+                       struct buffer_head **bhp)
 {
   struct buffer_head *bh;
 
-  log_info (FNM, "readblock : %lu", block_index);
+  log_info (FNM, "get new block : %llu", block_index);
+
+  bh = sb_getblk (sb, block_index);
+  if (!bh)
+    return NULL;
+  lock_buffer (bh);
+  memset (bh->b_data, 0, sb->s_blocksize);
+  set_buffer_uptodate (bh);
+  unlock_buffer (bh);
+  *bhp = bh;
+
+  return bh->b_data;
+}
+
+/*
+ * Write out the changes made to a block in place, or on a mount with a
+ * journal, add the block to the running transaction instead. Any decoded
+ * copy of the block in the metadata cache is dropped, since it's now out
+ * of date.
+ */
+void
+dummyfs_dirty_block (struct super_block *sb, struct buffer_head *bh)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block = (struct dummyfs_block *)bh->b_data;
+  struct dummyfs_inode *inode;
+  unsigned long k;
+
+  log_info (FNM, "dirty block : %llu", bh->b_blocknr);
+
+  if (BM_IS_TABLE (block->b_mode))
+    dummyfs_meta_forget (sb, META_TABLE, bh->b_blocknr);
+  else if (BM_IS_INODE (block->b_mode) && !sbi->s_inode_size)
+    dummyfs_meta_forget (sb, META_INODE,
+                         ((struct dummyfs_inode *)block)->i_ino);
+  else if (BM_IS_INODE (block->b_mode))
+    { // Any inode in a group may have changed
+      for (k = 0; k < INODES_PER_GROUP (sb->s_blocksize, sbi->s_inode_size);
+           k++)
+        {
+          inode = GROUP_INODE (block, sbi->s_inode_size, k);
+          if (BM_IS_INODE (inode->b_mode))
+            dummyfs_meta_forget (sb, META_INODE, inode->i_ino);
+        }
+    }
+
+  if (sbi->s_log)
+    {
+      dummyfs_journal_dirty (sb, bh);
+      return;
+    }
+
+  mark_buffer_dirty (bh);
+  sync_dirty_buffer (bh); // Initiate write to actual device
+}
 
-  bh = sb_bread (sb,
-                 block_index); // Move to the correct position on the device
-  memcpy ((void *)block, (void *)bh->b_data,
-          BLOCKSIZE); // Read bytes from position
+/*
+ * Release a block got with dummyfs_get_block or dummyfs_get_new_block.
+ */
+void
+dummyfs_put_block (struct buffer_head *bh)
+{
   brelse (bh);
+}
+
+/*
+ * Read a run of consecutive blocks into the buffer cache. All the reads
+ * are submitted under one plug, so the block layer can merge them into a
+ * few large requests, and then waited on together. Blocks that are
+ * already cached aren't read again.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_read_blocks (struct super_block *sb, sector_t start,
+                     unsigned long count)
+{
+  struct buffer_head **bhs;
+  struct blk_plug plug;
+  unsigned long k;
+  int err = 0;
+
+  if (start >= DUMMYFS_SB (sb)->s_numblocks)
+    return -EINVAL;
+  count = MIN (count, DUMMYFS_SB (sb)->s_numblocks - start);
+
+  log_info (FNM, "read blocks : %llu+%lu", start, count);
+
+  bhs = kmalloc_array (count, sizeof (struct buffer_head *), GFP_NOFS);
+  if (!bhs)
+    return -ENOMEM;
+  for (k = 0; k < count; k++)
+    {
+      bhs[k] = sb_getblk (sb, start + k);
+      if (!bhs[k])
+        {
+          err = -ENOMEM;
+          break;
+        }
+    }
+  count = k;
+
+  blk_start_plug (&plug);
+  ll_rw_block (REQ_OP_READ, REQ_META, count, bhs);
+  blk_finish_plug (&plug);
+
+  for (k = 0; k < count; k++)
+    {
+      wait_on_buffer (bhs[k]);
+      if (!buffer_uptodate (bhs[k]))
+        err = -EIO;
+      brelse (bhs[k]);
+    }
+  kfree (bhs);
 
-  log_info (FNM, "readblock done : %lu", block_index);
+  log_info (FNM, "read blocks done : %llu+%lu", start, count);
 
-  return BLOCKSIZE;
+  return err;
 }
 
 /*
- * Write a block to the block device.
+ * Write out a batch of dirty buffers (which needn't be consecutive on the
+ * device). The writes are submitted under one plug, so runs of consecutive
+ * blocks get merged into large requests, and then waited on together. The
+ * caller still holds (and has to release) the buffers.
+ *
+ * Blocks the journal is holding on to go into the running transaction
+ * instead, so what's in place never gets ahead of what's been committed
+ * for them (or behind it, once the log is written back).
  *
- * Returns size of block written.
+ * Returns 0 on success.
  */
 int
-dummyfs_writeblock (struct super_block *sb, unsigned long block_index,
-                    struct dummyfs_block *block)
+dummyfs_write_blocks (struct super_block *sb, struct buffer_head **bhs,
+                      unsigned long count)
+{
+  struct blk_plug plug;
+  unsigned long k;
+  int err = 0;
+
+  log_info (FNM, "write blocks : %lu", count);
+
+  for (k = 0; k < count; k++)
+    if (buffer_journaled (bhs[k]))
+      dummyfs_journal_dirty (sb, bhs[k]); // Leaves it clean for ll_rw_block
+
+  blk_start_plug (&plug);
+  ll_rw_block (REQ_OP_WRITE, REQ_SYNC, count, bhs);
+  blk_finish_plug (&plug);
+
+  for (k = 0; k < count; k++)
+    {
+      wait_on_buffer (bhs[k]);
+
+      // Buffers that were busy when we submitted get written on their own
+      if (buffer_dirty (bhs[k]))
+        sync_dirty_buffer (bhs[k]);
+      if (!buffer_uptodate (bhs[k]))
+        err = -EIO;
+    }
+
+  log_info (FNM, "write blocks done : %lu", count);
+
+  return err;
+}
+
+/*
+ * Start reading a run of consecutive blocks into the buffer cache without
+ * waiting for the reads to finish, so the I/O overlaps with whatever the
+ * caller does next. The reads are submitted under one plug so the block
+ * layer can merge them into a few large requests. Blocks that are already
+ * cached (or already being read) are left alone.
+ */
+void
+dummyfs_readahead (struct super_block *sb, sector_t start, unsigned long count)
+{
+  struct blk_plug plug;
+  unsigned long k;
+
+  if (start >= DUMMYFS_SB (sb)->s_numblocks)
+    return;
+  count = MIN (count, DUMMYFS_SB (sb)->s_numblocks - start);
+
+  log_info (FNM, "readahead : %llu+%lu", start, count);
+
+  blk_start_plug (&plug);
+  for (k = 0; k < count; k++)
+    sb_breadahead (sb, start + k);
+  blk_finish_plug (&plug);
+}
+
+/*
+ * Read ahead a run of blocks following a block whose successor is the very
+ * next block on the device, on the guess that the linked list carries on
+ * contiguously (which it does for data written in one go). Nothing is
+ * read if the first block of the run is already cached.
+ */
+static void
+dummyfs_read_run (struct super_block *sb, sector_t start, unsigned long count)
 {
   struct buffer_head *bh;
+  int cached;
 
-  log_info (FNM, "writeblock : %lu", block_index);
+  if (count < 2)
+    return;
 
-  bh = sb_bread (sb,
-                 block_index); // Move to the correct position on the device
-  memcpy (bh->b_data, block, BLOCKSIZE); // Read block struct to position
-  mark_buffer_dirty (bh);
-  sync_dirty_buffer (bh); // Initiate write to actual device
+  bh = sb_find_get_block (sb, start);
+  cached = bh && buffer_uptodate (bh);
   brelse (bh);
 
-  log_info (FNM, "writeblock done: %lu", block_index);
+  if (!cached)
+    dummyfs_readahead (sb, start, MIN (count, MAX_BATCH_BLOCKS));
+}
+
+/*
+ * Get the decoded entries of an inode table, from the metadata cache if
+ * they're there, or from the device (caching them) otherwise.
+ *
+ * Returns the table (released by passing *mp to dummyfs_meta_put), or
+ * NULL if it couldn't be read.
+ */
+static struct dummyfs_table_meta *
+dummyfs_get_table (struct super_block *sb, sector_t table_index,
+                   struct dummyfs_meta **mp)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_inode_table *table;
+  struct dummyfs_table_meta *decoded;
+  struct buffer_head *bh;
+  size_t size;
+
+  *mp = dummyfs_meta_get (sb, META_TABLE, table_index);
+  if (*mp)
+    return (*mp)->m_data;
+
+  table = dummyfs_get_block (sb, table_index, &bh);
+  if (!table)
+    return NULL;
+  size = sizeof (struct dummyfs_table_meta)
+         + sbi->s_max_table_size * sizeof (__u64);
+  decoded = kvmalloc (size, GFP_NOFS);
+  if (!decoded)
+    {
+      dummyfs_put_block (bh);
+      return NULL;
+    }
+  decoded->t_next = table->b_next;
+  memcpy (decoded->t_table, table->t_table,
+          sbi->s_max_table_size * sizeof (__u64));
+  dummyfs_put_block (bh);
 
-  return BLOCKSIZE;
+  *mp = dummyfs_meta_insert (sb, META_TABLE, table_index, decoded, size);
+  if (!*mp)
+    {
+      kvfree (decoded);
+      return NULL;
+    }
+  return decoded;
 }
 
 /*
  * Get (or write) the block index of an inode (i.e.: the block
- * containing the inode metadata).
+ * containing the inode metadata). A non-zero value for writing is
+ * stored as the new block index of the inode.
  *
  * Returns the block index of the inode (including on writes).
  */
-unsigned long
+sector_t
 dummyfs_inode_block_index (struct super_block *sb, unsigned long ino,
-                           int writing)
+                           sector_t writing)
 {
-  struct dummyfs_inode_table table;
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_table_meta *table;
+  struct dummyfs_inode_table *raw;
+  struct dummyfs_meta *m;
+  struct buffer_head *bh;
   unsigned long table_num;
-  unsigned long table_index = TABLE_BLOCK_INDEX;
-  unsigned long inode_index;
+  sector_t table_index = TABLE_BLOCK_INDEX;
+  sector_t inode_index;
   long long entry;
 
   log_info (FNM, "%s inode %lu block index",
@@ -88,12 +351,12 @@ dummyfs_inode_block_index (struct super_block *sb, unsigned long ino,
    * inode table. To do that, we'll need to know how many tables away
    * the inode index is.
    */
-  if (ino >= MAX_TABLE_SIZE)
-    table_num = (unsigned long)(ino / MAX_TABLE_SIZE);
+  if (ino >= sbi->s_max_table_size)
+    table_num = (unsigned long)(ino / sbi->s_max_table_size);
   else
     table_num = 0;
   if (table_num != 0)
-    entry = ((signed long long)ino) - (table_num * MAX_TABLE_SIZE);
+    entry = ((signed long long)ino) - (table_num * sbi->s_max_table_size);
   else
     entry = ino;
 
@@ -101,20 +364,30 @@ dummyfs_inode_block_index (struct super_block *sb, unsigned long ino,
             entry);
 
   // Follow the linked list of inode tables
-  dummyfs_readblock (sb, TABLE_BLOCK_INDEX, (struct dummyfs_block *)&table);
-  while (table_num > 0)
+  table = dummyfs_get_table (sb, table_index, &m);
+  while (table && table_num > 0)
     {
-      table_index = table.b_next;
-      dummyfs_readblock (sb, table.b_next, (struct dummyfs_block *)&table);
+      table_index = table->t_next;
+      dummyfs_meta_put (sb, m);
+      if (BLOCK_IS_UNALLOCATED (table_index))
+        return 0; // The inode is past the last table
+      table = dummyfs_get_table (sb, table_index, &m);
       table_num--;
     }
-  inode_index = table.t_table[entry];
+  if (!table)
+    return 0;
+  inode_index = table->t_table[entry];
+  dummyfs_meta_put (sb, m);
 
   // Make any changes to the entry, if requested
   if (writing)
     {
-      table.t_table[entry] = writing;
-      dummyfs_writeblock (sb, table_index, (struct dummyfs_block *)&table);
+      raw = dummyfs_get_block (sb, table_index, &bh);
+      if (!raw)
+        return 0;
+      raw->t_table[entry] = writing;
+      dummyfs_dirty_block (sb, bh);
+      dummyfs_put_block (bh);
     }
 
   log_info (FNM, "done %s inode %lu index",
@@ -123,78 +396,168 @@ dummyfs_inode_block_index (struct super_block *sb, unsigned long ino,
   return inode_index;
 }
 
+/*
+ * Find an inode in an inode group.
+ *
+ * Returns the inode, or NULL if it isn't in the group.
+ */
+static struct dummyfs_inode *
+dummyfs_group_find (struct super_block *sb, struct dummyfs_inode_group *group,
+                    unsigned long inum)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_inode *inode;
+  unsigned long k;
+
+  for (k = 0; k < INODES_PER_GROUP (sb->s_blocksize, sbi->s_inode_size); k++)
+    {
+      inode = GROUP_INODE (group, sbi->s_inode_size, k);
+      if (BM_IS_INODE (inode->b_mode) && inode->i_ino == inum)
+        return inode;
+    }
+
+  return NULL;
+}
+
 /*
  * Get an inode block (i.e.: the block containing all the
- * inode metadata on disk) from the block device using only
- * the inode number.
+ * inode metadata on disk) using only the inode number. The
+ * inode is changed in place, like any other block. On a device
+ * with inode groups, the inode is wherever it is in its group
+ * (which is the block held in *bhp).
  *
- * Returns the size of the block read.
+ * Returns the inode, or NULL if it couldn't be read.
  */
-int
-dummyfs_read_inode (struct super_block *sb, unsigned long inum,
-                    struct dummyfs_inode *inode)
+struct dummyfs_inode *
+dummyfs_get_inode (struct super_block *sb, unsigned long inum,
+                   struct buffer_head **bhp)
 {
-  unsigned long inode_block_index;
+  struct dummyfs_inode *inode;
+  sector_t inode_block_index;
+  void *block;
 
-  log_info (FNM, "reading inode %lu", inum);
+  log_info (FNM, "getting inode %lu", inum);
 
   inode_block_index = dummyfs_inode_block_index (sb, inum, false);
-  dummyfs_readblock (sb, inode_block_index, (struct dummyfs_block *)inode);
+  if (!inode_block_index || BLOCK_IS_UNALLOCATED (inode_block_index))
+    {
+      log_info (FNM, "inode %lu isn't allocated", inum);
+      return NULL;
+    }
+
+  block = dummyfs_get_block (sb, inode_block_index, bhp);
+  if (!block || !DUMMYFS_SB (sb)->s_inode_size)
+    return block;
+
+  inode = dummyfs_group_find (sb, block, inum);
+  if (!inode)
+    {
+      log_info (FNM, "inode %lu isn't in group %llu", inum,
+                inode_block_index);
+      dummyfs_put_block (*bhp);
+    }
+  return inode;
+}
 
-  log_info (FNM, "done reading inode %lu", inum);
+// Add an inode's fields to the metadata cache
+static void
+dummyfs_cache_stat (struct super_block *sb, unsigned long inum,
+                    struct dummyfs_inode_meta *stat)
+{
+  struct dummyfs_inode_meta *decoded;
+  struct dummyfs_meta *m;
+
+  decoded = kvmalloc (sizeof (struct dummyfs_inode_meta), GFP_NOFS);
+  if (!decoded)
+    return;
+  *decoded = *stat;
+  m = dummyfs_meta_insert (sb, META_INODE, inum, decoded,
+                           sizeof (struct dummyfs_inode_meta));
+  if (!m)
+    {
+      kvfree (decoded);
+      return;
+    }
+  dummyfs_meta_put (sb, m);
+}
 
-  return BLOCKSIZE;
+static void
+dummyfs_fill_stat (struct dummyfs_inode *inode, sector_t index,
+                   struct dummyfs_inode_meta *stat)
+{
+  stat->i_index = index;
+  stat->i_size = inode->i_size;
+  stat->i_mode = inode->i_mode;
+  stat->i_kind = inode->i_kind;
+  stat->i_links = inode->i_links;
+  stat->i_flags = inode->i_flags;
 }
 
 /*
- * Write an inode block (i.e.: the block containing all the
- * inode metadata on disk) to the block device using only
- * the inode number.
+ * Get the fields of an inode that are needed without touching its data
+ * (e.g.: to instantiate a VFS inode), from the metadata cache if they're
+ * there, or from the inode block (caching them) otherwise. The rest of
+ * an inode group comes in with the inode, so the other inodes in it are
+ * cached too, ready for the stat of the next file in the directory.
  *
- * Returns the size of the block written.
+ * Returns 0 on success.
  */
 int
-dummyfs_write_inode (struct super_block *sb, unsigned long inum,
-                     struct dummyfs_inode *inode)
+dummyfs_stat_inode (struct super_block *sb, unsigned long inum,
+                    struct dummyfs_inode_meta *stat)
 {
-  unsigned long inode_block_index;
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_inode_meta other;
+  struct dummyfs_inode *inode;
+  struct dummyfs_inode *near;
+  struct dummyfs_meta *m;
+  struct buffer_head *bh;
+  unsigned long per = 0;
+  unsigned long k;
 
-  log_info (FNM, "writing inode %lu", inum);
+  m = dummyfs_meta_get (sb, META_INODE, inum);
+  if (m)
+    {
+      *stat = *(struct dummyfs_inode_meta *)m->m_data;
+      dummyfs_meta_put (sb, m);
+      return 0;
+    }
 
-  inode_block_index = dummyfs_inode_block_index (sb, inum, false);
-  dummyfs_writeblock (sb, inode_block_index, (struct dummyfs_block *)inode);
+  inode = dummyfs_get_inode (sb, inum, &bh);
+  if (!inode)
+    return -EIO;
+  dummyfs_fill_stat (inode, bh->b_blocknr, stat);
+  if (sbi->s_inode_size)
+    per = INODES_PER_GROUP (sb->s_blocksize, sbi->s_inode_size);
+  for (k = 0; k < per; k++)
+    {
+      near = GROUP_INODE (bh->b_data, sbi->s_inode_size, k);
+      if (near == inode || !BM_IS_INODE (near->b_mode))
+        continue;
+      dummyfs_fill_stat (near, bh->b_blocknr, &other);
+      dummyfs_cache_stat (sb, near->i_ino, &other);
+    }
+  dummyfs_put_block (bh);
 
-  log_info (FNM, "done writing inode %lu", inum);
+  dummyfs_cache_stat (sb, inum, stat);
 
-  return BLOCKSIZE;
+  return 0;
 }
 
 /*
- * Find the index of the first empty block on disk.
+ * Claim an empty block on disk (marking it as in use in the allocation
+ * bitmap), searching from where the last allocation left off. The block
+ * is given back with dummyfs_free_blocks if it ends up unused.
  *
  * Returns 0 if no empty blocks are found, or the index
  * of the block if found.
  */
-unsigned long
+sector_t
 dummyfs_empty_block (struct super_block *sb)
 {
-  struct dummyfs_inode_table table;
-  struct dummyfs_block block;
-  unsigned long k;
+  unsigned long got;
 
-  /*
-   * We'll need to read the first inode table to check how many blocks
-   * the device has. Once we have that, we have the maximum bound for a
-   * linear search through the blocks on the device.
-   */
-  dummyfs_readblock (sb, TABLE_BLOCK_INDEX, (struct dummyfs_block *)&table);
-  for (k = 0; k < table.t_numblocks; k++)
-    {
-      dummyfs_readblock (sb, k, &block);
-      if (BM_IS_EMPTY (block.b_mode))
-        return k;
-    }
-  return 0;
+  return dummyfs_alloc_blocks (sb, 0, 1, &got);
 }
 
 /*
@@ -208,62 +571,195 @@ dummyfs_empty_block (struct super_block *sb)
 int
 dummyfs_empty_inode (struct super_block *sb)
 {
-  struct dummyfs_inode_table table;
-  unsigned long table_index;
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_table_meta *table;
+  struct dummyfs_inode_table *last_table;
+  struct dummyfs_inode_table *new_table;
+  struct dummyfs_meta *m;
+  struct buffer_head *bh;
+  struct buffer_head *new_bh;
   unsigned long table_num = 0;
-  unsigned long new_table_index;
+  sector_t table_index = TABLE_BLOCK_INDEX;
+  sector_t new_table_index;
   int k;
 
   log_info (FNM, "finding an empty inode");
 
   // Traverse the linked list of inode tables to spot an unallocated entry
-  table_index = TABLE_BLOCK_INDEX;
-  dummyfs_readblock (sb, TABLE_BLOCK_INDEX, (struct dummyfs_block *)&table);
+  table = dummyfs_get_table (sb, table_index, &m);
+  if (!table)
+    return 0;
   while (true)
     {
-      for (k = 0; k < MAX_TABLE_SIZE; k++)
+      for (k = 0; k < sbi->s_max_table_size; k++)
         { // Search through a table
-          log_info (FNM, "table[%d] is %u", k, table.t_table[k]);
-          if (BM_IS_UNALLOCATED (table.t_table[k]))
+          log_info (FNM, "table[%d] is %llu", k, table->t_table[k]);
+          if (BLOCK_IS_UNALLOCATED (table->t_table[k]))
             {
               log_info (FNM, "done empty inode");
-              return k + (table_num * MAX_TABLE_SIZE);
+              dummyfs_meta_put (sb, m);
+              return k + (table_num * sbi->s_max_table_size);
             }
         }
-      if (!BM_IS_UNALLOCATED (table.b_next))
+      if (!BLOCK_IS_UNALLOCATED (table->t_next))
         { // Move to the next table, if present
-          table_index = table.b_next;
-          dummyfs_readblock (sb, table.b_next, (struct dummyfs_block *)&table);
+          table_index = table->t_next;
+          dummyfs_meta_put (sb, m);
+          table = dummyfs_get_table (sb, table_index, &m);
+          if (!table)
+            return 0;
           table_num++;
         }
       else
         {
+          dummyfs_meta_put (sb, m);
           break;
         }
     }
 
   // If we get to here, we need to make a new inode table
   log_info (FNM, "creating a new inode table");
+  last_table = dummyfs_get_block (sb, table_index, &bh);
+  if (!last_table)
+    return 0;
   new_table_index = dummyfs_empty_block (sb); // Get a new empty block
   if (!new_table_index)
     {
       log_info (FNM, "no free blocks to allocate a new table!");
+      dummyfs_put_block (bh);
+      return 0;
+    }
+  new_table = dummyfs_get_new_block (sb, new_table_index, &new_bh);
+  if (!new_table)
+    {
+      dummyfs_free_blocks (sb, new_table_index, 1);
+      dummyfs_put_block (bh);
       return 0;
     }
-  table.b_next
-      = new_table_index; // Update the current table to point to the new one
-  dummyfs_writeblock (sb, table_index, (struct dummyfs_block *)&table);
 
   // Fill out the fields for the new table and write it
-  for (k = 0; k < MAX_TABLE_SIZE; k++)
-    table.t_table[k] = BM_UNALLOCATED;
-  table.b_next = BM_UNALLOCATED;
-  dummyfs_writeblock (sb, new_table_index, (struct dummyfs_block *)&table);
+  new_table->b_mode = BM_TABLE;
+  for (k = 0; k < sbi->s_max_table_size; k++)
+    new_table->t_table[k] = BLOCK_UNALLOCATED;
+  new_table->b_next = BLOCK_UNALLOCATED;
+  dummyfs_dirty_block (sb, new_bh);
+  dummyfs_put_block (new_bh);
+
+  // Update the current table to point to the new one
+  last_table->b_next = new_table_index;
+  dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
   table_num++;
 
   log_info (FNM, "done finding empty inode");
 
-  return (table_num * MAX_TABLE_SIZE);
+  return (table_num * sbi->s_max_table_size);
+}
+
+/*
+ * Count the entries in the inode tables, and how many of them are in use
+ * (for statfs).
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_count_inodes (struct super_block *sb, unsigned long *slots,
+                      unsigned long *used)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_table_meta *table;
+  struct dummyfs_meta *m;
+  sector_t table_index = TABLE_BLOCK_INDEX;
+  int k;
+
+  *slots = 0;
+  *used = 0;
+  while (!BLOCK_IS_UNALLOCATED (table_index))
+    {
+      table = dummyfs_get_table (sb, table_index, &m);
+      if (!table)
+        return -EIO;
+      for (k = 0; k < sbi->s_max_table_size; k++)
+        if (!BLOCK_IS_UNALLOCATED (table->t_table[k]))
+          (*used)++;
+      *slots += sbi->s_max_table_size;
+      table_index = table->t_next;
+      dummyfs_meta_put (sb, m);
+    }
+
+  return 0;
+}
+
+/*
+ * Claim a place for a new inode in an inode group, trying the group of
+ * the directory it's being made in first, then the last group that had
+ * room, and otherwise starting a new group as close after the directory
+ * as there's room for one.
+ *
+ * Returns the new (zeroed) inode, with its group in *bhp, or NULL if
+ * there's no room for it.
+ */
+static struct dummyfs_inode *
+dummyfs_group_claim (struct super_block *sb, sector_t near,
+                     struct buffer_head **bhp)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_inode_group *group;
+  struct dummyfs_inode *inode = NULL;
+  unsigned long per = INODES_PER_GROUP (sb->s_blocksize, sbi->s_inode_size);
+  unsigned long got;
+  unsigned long k;
+  sector_t tries[2] = { near, 0 };
+  sector_t index;
+  int t;
+
+  mutex_lock (&sbi->s_group_lock);
+
+  tries[1] = sbi->s_group_hint;
+  for (t = 0; t < 2 && !inode; t++)
+    {
+      if (!tries[t] || BLOCK_IS_UNALLOCATED (tries[t])
+          || (t && tries[t] == near))
+        continue;
+      group = dummyfs_get_block (sb, tries[t], bhp);
+      if (!group)
+        continue;
+      if (BM_IS_INODE (group->b_mode) && group->g_used < per)
+        for (k = 0; k < per && !inode; k++)
+          if (!BM_IS_INODE (GROUP_INODE (group, sbi->s_inode_size, k)->b_mode))
+            inode = GROUP_INODE (group, sbi->s_inode_size, k);
+      if (inode)
+        {
+          group->g_used++;
+          sbi->s_group_hint = tries[t];
+        }
+      else
+        dummyfs_put_block (*bhp);
+    }
+
+  if (!inode)
+    {
+      index = dummyfs_alloc_blocks (sb, near + 1, 1, &got);
+      group = index ? dummyfs_get_new_block (sb, index, bhp) : NULL;
+      if (group)
+        {
+          group->b_mode = BM_INODE;
+          group->b_next = BLOCK_UNALLOCATED;
+          group->g_used = 1;
+          sbi->s_group_hint = index;
+          inode = GROUP_INODE (group, sbi->s_inode_size, 0);
+        }
+      else if (index)
+        dummyfs_free_blocks (sb, index, 1);
+    }
+
+  // Nobody else can have the place once it's marked as an inode
+  if (inode)
+    inode->b_mode = BM_INODE;
+
+  mutex_unlock (&sbi->s_group_lock);
+
+  return inode;
 }
 
 /*
@@ -273,12 +769,14 @@ struct inode *
 dummyfs_new_inode (const struct inode *dir, umode_t mode,
                    unsigned short inode_mode)
 {
-  struct dummyfs_inode block;
+  struct dummyfs_inode *block;
+  struct buffer_head *bh;
   struct super_block *sb;
   struct inode *inode;
-  unsigned long block_index;
+  sector_t block_index;
+  sector_t near;
   unsigned long new_inode_number;
-  int k;
+  unsigned int flags;
 
   log_info (FNM, "new inode");
 
@@ -286,6 +784,11 @@ dummyfs_new_inode (const struct inode *dir, umode_t mode,
     return NULL;
   sb = dir->i_sb;
 
+  // Files are compressed if their directory is, or the mount says so
+  flags = DUMMYFS_I (dir)->i_flags & IF_COMPRESSED;
+  if (DUMMYFS_SB (sb)->s_compress)
+    flags |= IF_COMPRESSED;
+
   // Initialise a new VFS inode struct
   inode = new_inode (sb);
   if (!inode)
@@ -296,37 +799,60 @@ dummyfs_new_inode (const struct inode *dir, umode_t mode,
   if (new_inode_number == 0)
     {
       log_info (FNM, "inode table is full");
-      return NULL;
+      goto out_iput;
     }
 
-  // Find an empty block in the superblock
-  block_index = dummyfs_empty_block (sb);
-  if (block_index == 0)
+  // Find room for the inode, in a group near its directory if grouped
+  if (DUMMYFS_SB (sb)->s_inode_size)
     {
-      log_info (FNM, "no empty blocks left");
-      return NULL;
+      near = dummyfs_inode_block_index (sb, dir->i_ino, false);
+      block = dummyfs_group_claim (sb, near, &bh);
+      if (!block)
+        {
+          log_info (FNM, "no room left for an inode");
+          goto out_iput;
+        }
+      block_index = bh->b_blocknr;
+    }
+  else
+    {
+      block_index = dummyfs_empty_block (sb);
+      if (block_index == 0)
+        {
+          log_info (FNM, "no empty blocks left");
+          goto out_iput;
+        }
+      block = dummyfs_get_new_block (sb, block_index, &bh);
+      if (!block)
+        {
+          dummyfs_free_blocks (sb, block_index, 1);
+          goto out_iput;
+        }
     }
 
   // Initialise the inode on disk with plain metadata
-  block.b_mode = BM_INODE;
-  block.i_ino = new_inode_number;
-  block.i_kind = inode_mode;
-  block.i_mode = mode;
-  block.i_uid = current_fsuid ().val;
-  block.i_gid = current_fsuid ().val;
-  block.i_links = 1;
-  block.i_size = 0;
-  for (k = 0; k < MAX_INODE_DATA_SIZE; k++)
-    block.i_data[k] = 0;
-  block.b_next = BM_UNALLOCATED;
-  dummyfs_writeblock (sb, block_index, (struct dummyfs_block *)&block);
+  block->b_mode = BM_INODE;
+  block->i_ino = new_inode_number;
+  block->i_kind = inode_mode;
+  block->i_mode = mode;
+  block->i_uid = current_fsuid ().val;
+  block->i_gid = current_fsuid ().val;
+  block->i_links = 1;
+  block->i_flags = flags;
+  block->i_size = 0;
+  block->i_tail = BLOCK_UNALLOCATED;
+  block->i_pack = BLOCK_UNALLOCATED;
+  block->b_next = BLOCK_UNALLOCATED;
+  dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
 
   // Add the block index to the inode table
-  dummyfs_inode_block_index (sb, block.i_ino, block_index);
+  dummyfs_inode_block_index (sb, new_inode_number, block_index);
 
   // Initialise the VFS inode metadata
   inode_init_owner (inode, dir, mode);
   inode->i_ino = new_inode_number;
+  DUMMYFS_I (inode)->i_flags = flags;
   inode->i_ctime = inode->i_mtime = inode->i_atime = current_time (inode);
   inode->i_op = NULL;
   insert_inode_hash (inode);
@@ -334,11 +860,16 @@ dummyfs_new_inode (const struct inode *dir, umode_t mode,
   log_info (FNM, "done new inode");
 
   return inode;
+
+out_iput:
+  iput (inode);
+  return NULL;
 }
 
 /*
  * Map out a file's data into memory (with padding appended,
- * if requested).
+ * if requested). Anything not covered by a data block (and the
+ * padding) is zeroed.
  *
  * Returns a pointer to the data in memory.
  */
@@ -346,18 +877,22 @@ char *
 dummyfs_map_data (struct super_block *sb, struct dummyfs_inode *inode,
                   unsigned int extra)
 {
-  struct dummyfs_block disk_data;
-  unsigned char *mem_data = vmalloc (inode->i_size + extra);
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *disk_data;
+  struct buffer_head *bh;
+  sector_t index;
+  sector_t next;
+  unsigned char *mem_data = vzalloc (inode->i_size + extra);
   unsigned char *eof = mem_data + inode->i_size + extra;
   unsigned char *pos = mem_data;
 
-  log_info (FNM, "mapping %u+%u data from inode %u", inode->i_size, extra,
+  log_info (FNM, "mapping %llu+%u data from inode %u", inode->i_size, extra,
             inode->i_ino);
 
   // Copy the inode's inline data
   memcpy (pos, inode->i_data,
-          MIN (MAX_INODE_DATA_SIZE, inode->i_size + extra));
-  pos += MIN (MAX_INODE_DATA_SIZE, inode->i_size + extra);
+          MIN (sbi->s_max_inode_data_size, inode->i_size + extra));
+  pos += MIN (sbi->s_max_inode_data_size, inode->i_size + extra);
 
   /*
    * Files on disk are stored using linked lists of data blocks. Some data
@@ -365,9 +900,10 @@ dummyfs_map_data (struct super_block *sb, struct dummyfs_inode *inode,
    * Once the inline data has been copied to memory, we need to traverse the
    * linked list of data blocks for the file until we hit a block whose b_next
    * field is unallocated. That is, we need to keep going until we hit the end
-   * of the linked list.
+   * of the linked list. Each block's data goes wherever its b_index says it
+   * belongs, leaving any gaps in the list zeroed.
    */
-  if (BM_IS_UNALLOCATED (inode->b_next))
+  if (BLOCK_IS_UNALLOCATED (inode->b_next))
     { // If the inline data is all there was...
       log_info (FNM, "inode had no extra data blocks, done map data");
       return mem_data;
@@ -375,15 +911,37 @@ dummyfs_map_data (struct super_block *sb, struct dummyfs_inode *inode,
   else
     {
       log_info (FNM, "inode has extra data blocks");
-      dummyfs_readblock (sb, inode->b_next, &disk_data);
-      while (true)
+      index = inode->b_next;
+      while (pos != eof)
         { // Traverse the linked list
-          memcpy (pos, disk_data.b_data, MIN (MAX_BLOCK_DATA_SIZE, eof - pos));
-          pos += MIN (MAX_BLOCK_DATA_SIZE, eof - pos);
-          if (!BM_IS_UNALLOCATED (disk_data.b_next))
-            dummyfs_readblock (sb, disk_data.b_next, &disk_data);
-          else // Stop when we hit the end
+          disk_data = dummyfs_get_block (sb, index, &bh);
+          if (!disk_data)
             break;
+          pos = mem_data + sbi->s_max_inode_data_size
+                + (loff_t)disk_data->b_index * sbi->s_max_block_data_size;
+          if (pos >= eof)
+            { // Preallocated past the end of the file
+              dummyfs_put_block (bh);
+              break;
+            }
+          memcpy (pos, disk_data->b_data,
+                  MIN (sbi->s_max_block_data_size, eof - pos));
+          pos += MIN (sbi->s_max_block_data_size, eof - pos);
+          next = disk_data->b_next;
+          dummyfs_put_block (bh);
+          if (BLOCK_IS_UNALLOCATED (next) || pos == eof)
+            break; // Stop when we hit the end
+
+          /*
+           * If the list carries on into the next block on the device,
+           * read in the rest of the data we need as one batch rather
+           * than one block at a time.
+           */
+          if (next == index + 1)
+            dummyfs_read_run (sb, next,
+                              DIV_ROUND_UP (eof - pos,
+                                            sbi->s_max_block_data_size));
+          index = next;
         }
       log_info (FNM, "done map data");
       return mem_data;
@@ -391,156 +949,405 @@ dummyfs_map_data (struct super_block *sb, struct dummyfs_inode *inode,
 }
 
 /*
- * Allocate a data block on disk (to fill up with juicy data)
- * and point an existing block to that to form a linked list.
+ * Allocate a data block on disk (to fill up with juicy data) for position
+ * index in a file, and link it into the file's linked list right after an
+ * existing block (which must come before index in the file). Whatever
+ * followed the existing block now follows the new one.
  *
  * Returns the index of the newly-allocated block if an
- * allocation was made, and returns 0 if the allocation
+ * allocation was made (or of the existing block's successor, if that's
+ * already the block at index), and returns 0 if the allocation
  * failed.
  */
-unsigned long
-dummyfs_alloc_data (struct super_block *sb, struct dummyfs_block *prev,
-                    unsigned long prev_index)
+sector_t
+dummyfs_alloc_data (struct super_block *sb, struct buffer_head *prev_bh,
+                    struct dummyfs_block *prev, unsigned long index)
 {
-  struct dummyfs_block new;
-  unsigned long new_index;
-  int k;
+  struct dummyfs_block *new;
+  struct buffer_head *bh;
+  sector_t new_index;
+  unsigned long got;
+  int found;
 
-  log_info (FNM, "allocating new data block");
+  log_info (FNM, "allocating new data block at %lu", index);
 
   // Check to see if our work is already done
-  if (!BM_IS_UNALLOCATED (prev->b_next))
+  if (!BLOCK_IS_UNALLOCATED (prev->b_next))
     {
-      log_info (FNM, "current block already has a successor!");
-      log_info (FNM, "done allocation");
-      return prev->b_next;
+      new = dummyfs_get_block (sb, prev->b_next, &bh);
+      if (!new)
+        return 0;
+      found = (new->b_index == index);
+      dummyfs_put_block (bh);
+      if (found)
+        {
+          log_info (FNM, "current block already has that successor!");
+          log_info (FNM, "done allocation");
+          return prev->b_next;
+        }
     }
 
-  // Sigh... If we're here, we actually need to do something.
-  new_index = dummyfs_empty_block (sb);
+  /*
+   * Sigh... If we're here, we actually need to do something. Try for the
+   * block right after the previous one, to keep the list contiguous.
+   */
+  new_index = dummyfs_alloc_blocks (sb, prev_bh->b_blocknr + 1, 1, &got);
   if (new_index == 0)
     { // Report failures
       log_info (FNM, "no empty blocks left!");
+      return 0;
     }
-  else
+  new = dummyfs_get_new_block (sb, new_index, &bh);
+  if (!new)
     {
-      prev->b_next = new_index; // Point the previous block to the new one
-      dummyfs_writeblock (sb, prev_index, prev);
-      new.b_mode
-          = BM_DATA; // Write out empty data to the newly-allocated block
-                     // (so there aren't any nasty artefacts from memory)
-      for (k = 0; k < MAX_BLOCK_DATA_SIZE; k++)
-        new.b_data[k] = 0;
-      new.b_next = BM_UNALLOCATED;
-      dummyfs_writeblock (sb, new_index, &new);
+      dummyfs_free_blocks (sb, new_index, 1);
+      return 0;
     }
 
+  // Write out the (zeroed) new block before anything points to it
+  new->b_mode = BM_DATA;
+  new->b_index = index;
+  new->b_next = prev->b_next;
+  dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
+
+  prev->b_next = new_index; // Point the previous block to the new one
+  dummyfs_dirty_block (sb, prev_bh);
+
   log_info (FNM, "done allocation");
   return new_index;
 }
 
 /*
- * Deallocate (mark as empty) every block in a linked list
- * of data blocks for a file.
+ * Give a batch of blocks from a list being freed back to the allocation
+ * bitmap (in runs of consecutive blocks), and release them. Whatever
+ * hadn't been written out of them yet no longer needs to be.
  */
-void
-dummyfs_dealloc_data (struct super_block *sb, unsigned long block_index)
+static void
+dummyfs_release_blocks (struct super_block *sb, struct buffer_head **bhs,
+                        unsigned long nr)
 {
-  struct dummyfs_block block;
-  unsigned long next;
-  int k;
-
-  log_info (FNM, "deallocating data blocks, starting with %lu", block_index);
+  sector_t start = 0;
+  unsigned long count = 0;
+  unsigned long k;
 
-  /*
-   * Traverse the linked list of data blocks, zeroing
-   * everything out, until we hit the end (i.e.: a block
-   * whose b_next field is unallocated).
-   */
-  while (true)
+  for (k = 0; k < nr; k++)
     {
-      dummyfs_readblock (sb, block_index, &block);
-      next = block.b_next;
-      block.b_mode = BM_EMPTY;
-      for (k = 0; k < MAX_BLOCK_DATA_SIZE; k++)
-        block.b_data[k] = BM_UNALLOCATED;
-      block.b_next = BM_UNALLOCATED;
-      dummyfs_writeblock (sb, block_index, &block);
-      block_index = next;
-      if (BM_IS_UNALLOCATED (block_index)) // Break if we hit the end
-        break;
+      if (count && bhs[k]->b_blocknr != start + count)
+        {
+          dummyfs_free_blocks (sb, start, count);
+          count = 0;
+        }
+      if (!count)
+        start = bhs[k]->b_blocknr;
+      count++;
+      clear_buffer_dirty (bhs[k]);
+      dummyfs_put_block (bhs[k]);
     }
+  if (count)
+    dummyfs_free_blocks (sb, start, count);
+}
 
-  log_info (FNM, "done deallocating data blocks");
+/*
+ * Add a reference to a data block that's about to be pointed at from
+ * somewhere else as well.
+ *
+ * Returns 0 on success, or -EMLINK if the block has as many as it can.
+ */
+static int
+dummyfs_share_get (struct super_block *sb, sector_t index)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  int err = 0;
+
+  block = dummyfs_get_block (sb, index, &bh);
+  if (!block)
+    return -EIO;
+
+  mutex_lock (&sbi->s_share_lock);
+  if (block->b_refs == U16_MAX)
+    err = -EMLINK;
+  else
+    block->b_refs++;
+  mutex_unlock (&sbi->s_share_lock);
+
+  if (!err)
+    dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
+
+  return err;
 }
 
 /*
- * Write out a file's data to a linked list of data blocks
- * (beginning with the inline data in its inode block).
+ * Drop a reference to a data block, if it has any beyond the one being
+ * dropped.
  *
- * Returns the amount of data written.
+ * Returns true if it did (so the block is still in use), or false if the
+ * reference was the block's last.
  */
-int
-dummyfs_write_data (struct super_block *sb, struct dummyfs_inode *inode,
-                    unsigned char *data, unsigned long size)
+static int
+dummyfs_share_put (struct super_block *sb, struct buffer_head *bh)
 {
-  struct dummyfs_block block;
-  unsigned long required;
-  long long remainder_size;
-  unsigned long block_index
-      = dummyfs_inode_block_index (sb, inode->i_ino, false);
-  unsigned char *eof = data + size;
-  unsigned char *pos = data;
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block = (struct dummyfs_block *)bh->b_data;
+  int shared;
 
-  log_info (FNM, "writing data (%lu bytes)", size);
+  mutex_lock (&sbi->s_share_lock);
+  shared = (block->b_refs > 0);
+  if (shared)
+    block->b_refs--;
+  mutex_unlock (&sbi->s_share_lock);
 
-  // Calculate how many blocks we'll need beyond the inode's inline data
-  remainder_size = ((signed long long)size) - MAX_INODE_DATA_SIZE;
-  required = (remainder_size > 0)
-                 ? DIV_ROUND_UP (remainder_size, MAX_BLOCK_DATA_SIZE)
-                 : 0;
-  log_info (FNM, "data write needs %lu blocks after inode block", required);
+  if (shared)
+    dummyfs_dirty_block (sb, bh);
+
+  return shared;
+}
+
+/*
+ * Deallocate (mark as empty) every block in a linked list
+ * of data blocks for a file, up to (but not including) stop.
+ *
+ * A block shared with a clone (see dummyfs_clone_data) isn't the list's
+ * to free: the first one reached only loses the list's reference to it,
+ * and it's left (along with everything after it) to the files still
+ * using it. As the rest of the list is then still there, stop gets a
+ * reference from whatever is taking the list's place.
+ *
+ * The blocks aren't emptied on the device, which would cost a write each
+ * (and with a journal, would be writing them in place ahead of the
+ * transaction that frees them): the bitmap alone says which blocks are
+ * free. On a mount with the discard option, the device is told about them
+ * instead (see dummyfs_free_blocks).
+ */
+void
+dummyfs_dealloc_until (struct super_block *sb, sector_t block_index,
+                       sector_t stop)
+{
+  struct dummyfs_block *block;
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  unsigned long nr = 0;
+  sector_t next;
+
+  log_info (FNM, "deallocating data blocks, starting with %llu",
+            block_index);
+
+  // Any read cursors into a list of blocks may be about to go stale
+  atomic64_inc (&DUMMYFS_SB (sb)->s_chain_gen);
+
+  // There's no failing here, or the whole list would be leaked
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS | __GFP_NOFAIL);
+
+  /*
+   * Traverse the linked list of data blocks until we hit the
+   * end (i.e.: a block whose b_next field is unallocated),
+   * freeing the blocks in batches.
+   */
+  while (true)
+    {
+      block = dummyfs_get_block (sb, block_index, &bh);
+      if (!block)
+        break;
+      next = block->b_next;
+
+      // Whatever else shares the rest of the list keeps it
+      if (BM_IS_DATA (block->b_mode) && dummyfs_share_put (sb, bh))
+        {
+          dummyfs_put_block (bh);
+          if (!BLOCK_IS_UNALLOCATED (stop) && dummyfs_share_get (sb, stop))
+            log_info (FNM, "can't share block %llu", stop);
+          break;
+        }
+
+      // The inode is going away, so drop anything cached (or packed)
+      if (BM_IS_INODE (block->b_mode) && !DUMMYFS_SB (sb)->s_inode_size)
+        {
+          dummyfs_meta_forget (sb, META_INODE,
+                               ((struct dummyfs_inode *)block)->i_ino);
+          dummyfs_meta_forget (sb, META_DIR,
+                               ((struct dummyfs_inode *)block)->i_ino);
+          dummyfs_pack_truncate (sb, (struct dummyfs_inode *)block, 0);
+        }
+      bhs[nr++] = bh;
+
+      if (nr == MAX_BATCH_BLOCKS)
+        {
+          dummyfs_release_blocks (sb, bhs, nr);
+          nr = 0;
+        }
+
+      if (BLOCK_IS_UNALLOCATED (next) || next == stop) // Hit the end
+        break;
+      if (next == block_index + 1)
+        dummyfs_read_run (sb, next, MAX_BATCH_BLOCKS);
+      block_index = next;
+    }
+  dummyfs_release_blocks (sb, bhs, nr);
+  kfree (bhs);
+
+  log_info (FNM, "done deallocating data blocks");
+}
+
+/*
+ * Deallocate every block in a linked list of data blocks for a file (see
+ * dummyfs_dealloc_until).
+ */
+void
+dummyfs_dealloc_data (struct super_block *sb, sector_t block_index)
+{
+  dummyfs_dealloc_until (sb, block_index, BLOCK_UNALLOCATED);
+}
+
+/*
+ * Free an inode on disk, along with all of its data, and take it out of
+ * the inode table. An inode group is freed along with the last inode in
+ * it.
+ */
+void
+dummyfs_remove_inode (struct super_block *sb, unsigned long inum)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_inode_group *group;
+  struct dummyfs_inode *inode;
+  struct buffer_head *bh;
+  sector_t index;
+  sector_t next;
+  int used;
+
+  log_info (FNM, "freeing inode %lu", inum);
+
+  index = dummyfs_inode_block_index (sb, inum, BLOCK_UNALLOCATED);
+  if (!index || BLOCK_IS_UNALLOCATED (index))
+    return;
+
+  // A block to itself heads the list of its data blocks
+  if (!sbi->s_inode_size)
+    {
+      dummyfs_dealloc_data (sb, index);
+      return;
+    }
+
+  group = dummyfs_get_block (sb, index, &bh);
+  if (!group)
+    return;
+  inode = dummyfs_group_find (sb, group, inum);
+  if (!inode)
+    {
+      dummyfs_put_block (bh);
+      return;
+    }
+  dummyfs_meta_forget (sb, META_INODE, inum);
+  dummyfs_meta_forget (sb, META_DIR, inum);
+  dummyfs_pack_truncate (sb, inode, 0);
+  next = inode->b_next;
+
+  mutex_lock (&sbi->s_group_lock);
+  memset (inode, 0, sbi->s_inode_size);
+  used = --group->g_used;
+  if (!used && sbi->s_group_hint == index)
+    sbi->s_group_hint = 0;
+  mutex_unlock (&sbi->s_group_lock);
+
+  if (used)
+    dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
+  if (!used)
+    dummyfs_dealloc_data (sb, index);
+  if (!BLOCK_IS_UNALLOCATED (next))
+    dummyfs_dealloc_data (sb, next);
+}
+
+/*
+ * Write out a file's data to a linked list of data blocks
+ * (beginning with the inline data in its inode block).
+ *
+ * Returns the amount of data written.
+ */
+int
+dummyfs_write_data (struct super_block *sb, struct buffer_head *inode_bh,
+                    struct dummyfs_inode *inode, unsigned char *data,
+                    unsigned long size)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block = NULL;
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  unsigned long nr = 0;
+  unsigned long k;
+  unsigned long required;
+  unsigned long fill;
+  unsigned long ord = 0;
+  long long remainder_size;
+  sector_t block_index;
+  unsigned char *eof = data + size;
+  unsigned char *pos = data;
+
+  log_info (FNM, "writing data (%lu bytes)", size);
+
+  // Before anything is changed, so there's nothing to undo if this fails
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  if (!bhs)
+    return 0;
+
+  // Calculate how many blocks we'll need beyond the inode's inline data
+  remainder_size = ((signed long long)size) - sbi->s_max_inode_data_size;
+  required = (remainder_size > 0)
+                 ? DIV_ROUND_UP (remainder_size, sbi->s_max_block_data_size)
+                 : 0;
+  log_info (FNM, "data write needs %lu blocks after inode block", required);
 
   /*
    * Allocate the extra blocks we need.
    *
    * We'll need to treat the inode block specially, because it stores less data
    * than pure data blocks, so we'll need to use different values for the math
-   * involved allocating blocks and truncating data.
+   * involved allocating blocks and truncating data. Blocks the file already
+   * has are reused, and any gaps in its list are filled in.
    */
   if (required)
     {
-      block_index = dummyfs_alloc_data (sb, (struct dummyfs_block *)inode,
-                                        block_index);
-      if (block_index == 0)
+      block_index = dummyfs_alloc_data (sb, inode_bh,
+                                        (struct dummyfs_block *)inode, ord++);
+      if (block_index)
+        block = dummyfs_get_block (sb, block_index, &bh);
+      if (!block)
         { // If there are no more empty blocks, truncate the data
           // by marking the eof as earlier than it actually is.
           log_info (FNM, "will only write what I can fit");
-          eof = data + MAX_INODE_DATA_SIZE;
+          eof = data + sbi->s_max_inode_data_size;
           required = 0;
         }
       else
         {
-          dummyfs_readblock (sb, block_index, &block);
-          pos += MAX_INODE_DATA_SIZE;
+          pos += sbi->s_max_inode_data_size;
           required--;
         }
       while (required > 0)
         {
-          block_index = dummyfs_alloc_data (sb, &block, block_index);
-          if (block_index == 0)
+          block_index = dummyfs_alloc_data (sb, bh, block, ord++);
+          dummyfs_put_block (bh);
+          block = NULL;
+          if (block_index)
+            block = dummyfs_get_block (sb, block_index, &bh);
+          if (!block)
             {
               log_info (FNM, "will only write what I can fit");
-              eof = pos + MAX_BLOCK_DATA_SIZE;
+              eof = pos + sbi->s_max_block_data_size;
               required = 0;
             }
           else
             {
-              dummyfs_readblock (sb, block_index, &block);
-              pos += MAX_BLOCK_DATA_SIZE;
+              pos += sbi->s_max_block_data_size;
               required--;
             }
         }
+      if (block)
+        dummyfs_put_block (bh);
     }
 
   // Time to write to disk!
@@ -549,38 +1356,2003 @@ dummyfs_write_data (struct super_block *sb, struct dummyfs_inode *inode,
   // Reset all the pointers to be back to the start (we adjusted them
   // in case we needed to truncate data in the above allocation loop)
   pos = data;
-  block_index = dummyfs_inode_block_index (sb, inode->i_ino, false);
 
   // Copy out the inline data first
-  memcpy (inode->i_data, pos, MIN (MAX_INODE_DATA_SIZE, eof - pos));
+  memcpy (inode->i_data, pos, MIN (sbi->s_max_inode_data_size, eof - pos));
   inode->i_size = eof - data;
-  dummyfs_writeblock (sb, block_index, (struct dummyfs_block *)inode);
-  pos += MIN (MAX_INODE_DATA_SIZE, eof - pos);
+  inode->i_tail = BLOCK_UNALLOCATED;
+  inode->i_tail_index = 0;
+  pos += MIN (sbi->s_max_inode_data_size, eof - pos);
 
-  // Iterate through the linked list, copying data, until we hit the end
-  if (!BM_IS_UNALLOCATED (inode->b_next))
+  /*
+   * Iterate through the linked list, copying data, until we hit the end.
+   * The data is copied straight into the cached blocks, which are then
+   * written out in batches rather than one synchronous write per block.
+   */
+  block_index = inode->b_next;
+  while (pos != eof && !BLOCK_IS_UNALLOCATED (block_index))
     {
-      block_index = inode->b_next;
-      dummyfs_readblock (sb, inode->b_next, &block);
-      while (pos != eof)
-        {
+      block = dummyfs_get_block (sb, block_index, &bh);
+      if (!block)
+        break;
 
-          /*
-           * Only copy as much data as we have, rather than just ripping
-           * out a BLOCK_DATA_SIZE worth of bytes out of memory regardless
-           * of whether they store meaningful data or not (your file
-           * reads will thank us later)
-           */
-          memcpy (block.b_data, pos, MIN (MAX_BLOCK_DATA_SIZE, eof - pos));
-          dummyfs_writeblock (sb, block_index, &block);
-          pos += MIN (MAX_BLOCK_DATA_SIZE, eof - pos);
-          block_index = block.b_next;
-          if (!BM_IS_UNALLOCATED (block.b_next))
-            dummyfs_readblock (sb, block.b_next, &block);
+      /*
+       * Only copy as much data as we have, rather than just ripping
+       * out a BLOCK_DATA_SIZE worth of bytes out of memory regardless
+       * of whether they store meaningful data or not (your file
+       * reads will thank us later)
+       */
+      fill = MIN (sbi->s_max_block_data_size, eof - pos);
+      memcpy (block->b_data, pos, fill);
+      pos += fill;
+
+      // The last block written holds the end of the data
+      inode->i_tail = block_index;
+      inode->i_tail_index = block->b_index;
+
+      block_index = block->b_next;
+
+      // Directory listings are metadata, so they go through any journal
+      if (sbi->s_log)
+        {
+          dummyfs_dirty_block (sb, bh);
+          dummyfs_put_block (bh);
+          continue;
+        }
+      mark_buffer_dirty (bh);
+      bhs[nr++] = bh;
+      if (nr == MAX_BATCH_BLOCKS || pos == eof)
+        {
+          dummyfs_write_blocks (sb, bhs, nr);
+          for (k = 0; k < nr; k++)
+            dummyfs_put_block (bhs[k]);
+          nr = 0;
         }
     }
+  dummyfs_write_blocks (sb, bhs, nr);
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+  kfree (bhs);
+
+  // Write the inode block last, once the tail of the data is known
+  dummyfs_dirty_block (sb, inode_bh);
 
   log_info (FNM, "done write data");
 
   return pos - data;
 }
+
+/*
+ * Size the readahead window for a read on an open file, based on where the
+ * previous read left off (much like the VFS does for the page cache). A
+ * read that carries on from the last one, or starts at the beginning of
+ * the file, is sequential and grows the window: it starts at a few times
+ * the size of the read and doubles on every read after that, up to the
+ * device's readahead limit. Anything else is random access, which turns
+ * readahead off until the reads become sequential again.
+ */
+static void
+dummyfs_ra_window (struct super_block *sb, struct dummyfs_read_state *rs,
+                   loff_t pos, size_t count)
+{
+  unsigned long max
+      = sb->s_bdi->ra_pages << (PAGE_SHIFT - sb->s_blocksize_bits);
+  unsigned long req
+      = DIV_ROUND_UP (count, DUMMYFS_SB (sb)->s_max_block_data_size);
+
+  if (pos != 0 && pos != rs->r_next_pos)
+    {
+      rs->r_window = 0;
+      rs->r_ra_start = rs->r_ra_end = rs->r_ra_mark = 0;
+      return;
+    }
+
+  if (rs->r_window)
+    rs->r_window *= 2;
+  else
+    rs->r_window = (req <= max / 4) ? req * 4 : req * 2;
+  rs->r_window = MIN (rs->r_window, max);
+
+  log_info (FNM, "sequential read, readahead window %lu", rs->r_window);
+}
+
+/*
+ * Read ahead along the linked list of a file's data blocks while a read
+ * moves from one block to the next. Data written in one go sits in
+ * consecutive blocks, so the window is read from the next block onwards
+ * on the guess that the list carries on contiguously (never past the end
+ * of the file). Once the read gets halfway through the window, the next
+ * window is started so that it arrives before it's needed.
+ *
+ * left is the number of file blocks after the current one.
+ */
+static void
+dummyfs_ra_chain (struct super_block *sb, struct dummyfs_read_state *rs,
+                  sector_t index, sector_t next, unsigned long left)
+{
+  sector_t start;
+  unsigned long count;
+
+  if (!rs->r_window || !left || BLOCK_IS_UNALLOCATED (next))
+    return;
+
+  if (next < rs->r_ra_start || next >= rs->r_ra_end)
+    { // Outside of what's been read ahead, so start a new window here
+      start = next;
+      count = MIN (rs->r_window, left);
+      rs->r_ra_start = start;
+      rs->r_ra_end = start + count;
+      rs->r_ra_mark = start + count / 2;
+    }
+  else if (next == rs->r_ra_mark && next == index + 1
+           && left > rs->r_ra_end - next)
+    { // Halfway through the window, so read the next one
+      start = rs->r_ra_end;
+      count = MIN (rs->r_window, left - (rs->r_ra_end - next));
+      rs->r_ra_end = start + count;
+      rs->r_ra_mark = start + count / 2;
+    }
+  else
+    {
+      return;
+    }
+
+  dummyfs_readahead (sb, start, count);
+}
+
+/*
+ * Copy one read state into another, all but the lock (with the lock of
+ * the open file's state held).
+ */
+static void
+dummyfs_read_state_copy (struct dummyfs_read_state *to,
+                         const struct dummyfs_read_state *from)
+{
+  to->r_next_pos = from->r_next_pos;
+  to->r_gen = from->r_gen;
+  to->r_cursor_pos = from->r_cursor_pos;
+  to->r_cursor_block = from->r_cursor_block;
+  to->r_window = from->r_window;
+  to->r_ra_start = from->r_ra_start;
+  to->r_ra_end = from->r_ra_end;
+  to->r_ra_mark = from->r_ra_mark;
+}
+
+/*
+ * Read part of a file's data straight into an iov_iter, walking the linked
+ * list of data blocks only as far as the read goes (anything the blocks
+ * don't cover reads as zeros). If the read state of an open file is
+ * given, a read can carry on from where the last one stopped in the list,
+ * and sequential reads are read ahead. The cursor is only taken up if its
+ * block is still where the state says it is in the file.
+ *
+ * Returns the amount of data read, or a negative error.
+ */
+ssize_t
+dummyfs_read_data (struct super_block *sb, struct dummyfs_inode *inode,
+                   loff_t pos, struct iov_iter *to,
+                   struct dummyfs_read_state *file_rs)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_read_state state;
+  struct dummyfs_read_state *rs = NULL;
+  struct dummyfs_cluster_buf cb = { 0 };
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long span;
+  unsigned long left;
+  unsigned char *data;
+  loff_t block_pos;
+  loff_t cursor_pos = 0;
+  loff_t hole_end;
+  loff_t end;
+  sector_t index;
+  sector_t next;
+  sector_t cursor_block = BLOCK_UNALLOCATED;
+  size_t count = iov_iter_count (to);
+  size_t done = 0;
+  size_t n;
+  ssize_t packed;
+  u64 gen = atomic64_read (&sbi->s_chain_gen);
+  int from_cursor = false;
+  int err = 0;
+
+  if (pos < 0 || pos >= inode->i_size || !count)
+    return 0;
+  end = MIN ((loff_t)inode->i_size, pos + (loff_t)count);
+
+  log_info (FNM, "reading data (%lld+%lld)", pos, end - pos);
+
+  if (file_rs)
+    {
+      spin_lock (&file_rs->r_lock);
+      dummyfs_read_state_copy (&state, file_rs);
+      spin_unlock (&file_rs->r_lock);
+      rs = &state;
+      dummyfs_ra_window (sb, rs, pos, end - pos);
+    }
+
+  // Start with whatever is in the inode's inline data
+  if (pos < sbi->s_max_inode_data_size)
+    {
+      n = MIN (end, (loff_t)sbi->s_max_inode_data_size) - pos;
+      done = copy_to_iter (inode->i_data + pos, n, to);
+      if (done != n)
+        goto out;
+    }
+  if (pos + done == end)
+    goto out;
+
+  // A small file may have the rest packed in with others
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    {
+      packed = dummyfs_pack_read (sb, inode,
+                                  pos + done - sbi->s_max_inode_data_size,
+                                  end - (pos + done), to);
+      if (packed < 0)
+        err = packed;
+      else
+        done += packed;
+      goto out;
+    }
+
+  // Pick up from the cursor if it's still good and not past the read
+  if (rs && !BLOCK_IS_UNALLOCATED (rs->r_cursor_block)
+      && rs->r_gen == gen
+      && rs->r_cursor_pos <= pos + done)
+    {
+      index = rs->r_cursor_block;
+      from_cursor = true;
+    }
+  else
+    {
+      index = inode->b_next;
+    }
+
+  while (true)
+    {
+      block = NULL;
+      if (!BLOCK_IS_UNALLOCATED (index))
+        {
+          block = dummyfs_get_block (sb, index, &bh);
+          if (!block)
+            {
+              err = -EIO;
+              break;
+            }
+          block_pos = sbi->s_max_inode_data_size
+                      + (loff_t)block->b_index * max_data;
+          if (from_cursor)
+            {
+              from_cursor = false;
+              if (!BM_IS_DATA (block->b_mode)
+                  || block_pos != rs->r_cursor_pos)
+                { // The cursor's gone stale, so start from the inode
+                  dummyfs_put_block (bh);
+                  index = inode->b_next;
+                  continue;
+                }
+            }
+          if (block_pos >= end)
+            {
+              dummyfs_put_block (bh);
+              block = NULL;
+            }
+        }
+
+      // Anything before the next block (if any) is a hole
+      hole_end = block ? MIN (end, block_pos) : end;
+      n = (hole_end > pos + done) ? hole_end - (pos + done) : 0;
+      if (n && iov_iter_zero (n, to) != n)
+        {
+          if (block)
+            dummyfs_put_block (bh);
+          err = -EFAULT;
+          break;
+        }
+      done += n;
+      if (!block)
+        break;
+      next = block->b_next;
+      cursor_block = index;
+      cursor_pos = block_pos;
+      data = block->b_data;
+      span = max_data;
+
+      // A compressed cluster is read in whole, and covers the whole cluster
+      if (BF_IS_COMPRESSED (block->b_flags))
+        {
+          if (!cb.c_data)
+            err = dummyfs_cluster_buf_init (sb, &cb, false);
+          if (!err)
+            err = dummyfs_cluster_read (sb, bh, &cb, &next);
+          if (err)
+            {
+              dummyfs_put_block (bh);
+              break;
+            }
+          data = cb.c_data;
+          span = CLUSTER_SIZE (sb);
+        }
+
+      left = (inode->i_size > block_pos + span)
+                 ? DIV_ROUND_UP (inode->i_size - (block_pos + span),
+                                 max_data)
+                 : 0;
+      if (rs && rs->r_window)
+        dummyfs_ra_chain (sb, rs, index, next, left);
+      else if (pos + done >= block_pos + max_data && next == index + 1)
+        dummyfs_read_run (sb, next,
+                          (pos + done - block_pos) / max_data);
+
+      // Copy out anything in this block that's part of the read
+      if (pos + done < block_pos + span)
+        {
+          n = MIN (end, block_pos + (loff_t)span) - (pos + done);
+          if (copy_to_iter (data + (pos + done - block_pos), n, to) != n)
+            {
+              dummyfs_put_block (bh);
+              err = -EFAULT;
+              break;
+            }
+          done += n;
+        }
+      dummyfs_put_block (bh);
+
+      if (pos + done == end)
+        break; // Leave the cursor on the last block read from
+      index = next;
+    }
+
+  if (rs && !err && !BLOCK_IS_UNALLOCATED (cursor_block))
+    {
+      rs->r_gen = gen;
+      rs->r_cursor_pos = cursor_pos;
+      rs->r_cursor_block = cursor_block;
+    }
+
+out:
+  dummyfs_cluster_buf_free (&cb);
+  if (rs)
+    {
+      rs->r_next_pos = pos + done;
+      spin_lock (&file_rs->r_lock);
+      dummyfs_read_state_copy (file_rs, rs);
+      spin_unlock (&file_rs->r_lock);
+    }
+
+  log_info (FNM, "done reading data (%zu bytes)", done);
+
+  return done ? done : err;
+}
+
+/*
+ * Find the last data block of a file at or before position n in the
+ * file, walking the linked list from the file's tail block instead of
+ * from the inode whenever that's closer.
+ *
+ * Returns the index of the block (with its position in *ord), or
+ * BLOCK_UNALLOCATED if there are no blocks that early in the file (or
+ * the list couldn't be read).
+ */
+sector_t
+dummyfs_find_block (struct super_block *sb, struct dummyfs_inode *inode,
+                    unsigned long n, unsigned long *ord)
+{
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  sector_t found = BLOCK_UNALLOCATED;
+  sector_t index = inode->b_next;
+  int before;
+
+  if (!BLOCK_IS_UNALLOCATED (inode->i_tail) && inode->i_tail_index <= n)
+    index = inode->i_tail;
+
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        return BLOCK_UNALLOCATED;
+      before = (block->b_index <= n);
+      if (before)
+        {
+          found = index;
+          *ord = block->b_index;
+        }
+      index = block->b_next;
+      dummyfs_put_block (bh);
+      if (!before)
+        break;
+    }
+
+  return found;
+}
+
+/*
+ * Point a file's tail at the last data block at or before the end of the
+ * file, after the file has grown.
+ */
+static void
+dummyfs_grow_tail (struct super_block *sb, struct dummyfs_inode *inode)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  unsigned long ord;
+  sector_t index;
+
+  if (inode->i_size <= sbi->s_max_inode_data_size)
+    return;
+
+  index = dummyfs_find_block (sb, inode,
+                              (inode->i_size - sbi->s_max_inode_data_size - 1)
+                                  / sbi->s_max_block_data_size,
+                              &ord);
+  if (BLOCK_IS_UNALLOCATED (index))
+    return; // The file is all hole after its inline data
+  inode->i_tail = index;
+  inode->i_tail_index = ord;
+}
+
+/*
+ * Make the data blocks of a file before position n its own, so they can
+ * be changed in place. Once the list reaches a block shared with a clone
+ * (see dummyfs_clone_data), the rest of it is shared too, so that block
+ * and the ones after it up to n are copied, and the copies linked in
+ * instead. Whatever is past n stays shared. A file whose whole list turns
+ * out to be its own stops being marked as sharing blocks. The caller
+ * writes out the inode.
+ *
+ * Returns 0 on success, or a negative error (with the file as it was).
+ */
+int
+dummyfs_unshare_data (struct super_block *sb, struct buffer_head *inode_bh,
+                      struct dummyfs_inode *inode, unsigned long n)
+{
+  struct dummyfs_block *prev = (struct dummyfs_block *)inode;
+  struct dummyfs_block *block;
+  struct dummyfs_block *copy = NULL;
+  struct dummyfs_block *next;
+  struct buffer_head **bhs;
+  struct buffer_head *prev_bh = inode_bh;
+  struct buffer_head *bh;
+  unsigned long nr = 0;
+  unsigned long got;
+  unsigned long k;
+  sector_t index;
+  sector_t shared = BLOCK_UNALLOCATED;
+  sector_t first = BLOCK_UNALLOCATED;
+  sector_t tail = inode->i_tail;
+  sector_t goal;
+  sector_t new;
+  int err = 0;
+
+  if (!IF_IS_SHARED (inode->i_flags))
+    return 0;
+
+  // Walk the blocks that are the file's own, up to the first shared one
+  index = inode->b_next;
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          goto out;
+        }
+      if (block->b_index < n && block->b_refs)
+        shared = index;
+      if (block->b_index >= n || block->b_refs)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+      if (prev_bh != inode_bh)
+        dummyfs_put_block (prev_bh);
+      prev = block;
+      prev_bh = bh;
+      index = block->b_next;
+    }
+  if (BLOCK_IS_UNALLOCATED (shared))
+    goto out;
+
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  if (!bhs)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  // Copy the shared blocks before n, each right after the one before it
+  goal = prev_bh->b_blocknr + 1;
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          break;
+        }
+      if (block->b_index >= n)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+
+      new = dummyfs_alloc_blocks (sb, goal, 1, &got);
+      if (!new)
+        {
+          dummyfs_put_block (bh);
+          err = -ENOSPC;
+          break;
+        }
+      if (nr == MAX_BATCH_BLOCKS)
+        { // Write out all but the last copy, which gets linked to this one
+          dummyfs_write_blocks (sb, bhs, nr - 1);
+          for (k = 0; k + 1 < nr; k++)
+            dummyfs_put_block (bhs[k]);
+          bhs[0] = bhs[nr - 1];
+          nr = 1;
+        }
+      next = dummyfs_get_new_block (sb, new, &bhs[nr]);
+      if (!next)
+        {
+          dummyfs_free_blocks (sb, new, 1);
+          dummyfs_put_block (bh);
+          err = -ENOMEM;
+          break;
+        }
+      memcpy (next, block, sb->s_blocksize);
+      next->b_refs = 0;
+      mark_buffer_dirty (bhs[nr++]);
+      if (copy)
+        copy->b_next = new;
+      else
+        first = new;
+      copy = next;
+
+      if (!BLOCK_IS_UNALLOCATED (inode->i_tail) && inode->i_tail == index)
+        inode->i_tail = new;
+      goal = new + 1;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+    }
+  if (copy)
+    copy->b_next = index;
+  dummyfs_write_blocks (sb, bhs, nr);
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+  kfree (bhs);
+
+  if (err)
+    {
+      // Nothing points at the copies yet, so they can just be freed
+      if (!BLOCK_IS_UNALLOCATED (first))
+        dummyfs_dealloc_until (sb, first, index);
+      inode->i_tail = tail;
+      goto out;
+    }
+
+  // Swap the copies in, and let go of the blocks they're copies of
+  prev->b_next = first;
+  if (prev_bh != inode_bh)
+    dummyfs_dirty_block (sb, prev_bh);
+  dummyfs_dealloc_until (sb, shared, index);
+
+out:
+  if (!err && BLOCK_IS_UNALLOCATED (index))
+    inode->i_flags &= ~IF_SHARED;
+  if (prev_bh != inode_bh)
+    dummyfs_put_block (prev_bh);
+  return err;
+}
+
+/*
+ * Fill in a hole in a file, from the block at ord on, with newly-allocated
+ * blocks holding data from an iov_iter (starting off bytes into the first
+ * one). As much of the hole as the write covers (up to want blocks) is
+ * claimed in one go, as a run right after the block before the hole, so
+ * data written back together stays together on disk. The run is written
+ * out, data and all, as a ready-linked list carrying on into whatever
+ * followed the hole, and only then is the block before it pointed at it.
+ * bhs needs room for want blocks.
+ *
+ * Returns the amount of data written (with the last block of the run
+ * held in *last_bh), or a negative error if nothing could be written.
+ */
+static ssize_t
+dummyfs_fill_hole (struct super_block *sb, struct buffer_head *prev_bh,
+                   struct dummyfs_block *prev, unsigned long ord,
+                   unsigned long off, unsigned long want,
+                   struct iov_iter *from, struct buffer_head **bhs,
+                   struct buffer_head **last_bh)
+{
+  struct dummyfs_block *block;
+  unsigned long max_data = DUMMYFS_SB (sb)->s_max_block_data_size;
+  unsigned long got;
+  unsigned long k;
+  sector_t run;
+  size_t n;
+  size_t copied;
+  ssize_t done = 0;
+  int err = 0;
+
+  run = dummyfs_alloc_blocks (sb, prev_bh->b_blocknr + 1, want, &got);
+  if (!run)
+    return -ENOSPC;
+
+  for (k = 0; k < got && iov_iter_count (from); k++)
+    {
+      block = dummyfs_get_new_block (sb, run + k, &bhs[k]);
+      if (!block)
+        {
+          err = -ENOMEM;
+          break;
+        }
+      block->b_mode = BM_DATA;
+      block->b_index = ord + k;
+      block->b_next = run + k + 1;
+
+      n = MIN (max_data - off, iov_iter_count (from));
+      copied = copy_from_iter (block->b_data + off, n, from);
+      if (!copied)
+        {
+          dummyfs_put_block (bhs[k]);
+          err = -EFAULT;
+          break;
+        }
+      done += copied;
+      off = 0;
+      mark_buffer_dirty (bhs[k]);
+      if (copied != n)
+        {
+          k++;
+          break;
+        }
+    }
+
+  // Hand back whatever of the run there was no data for
+  if (k < got)
+    dummyfs_free_blocks (sb, run + k, got - k);
+  if (!k)
+    return err;
+
+  log_info (FNM, "filling hole at %lu with %llu+%lu", ord, run, k);
+
+  ((struct dummyfs_block *)bhs[k - 1]->b_data)->b_next = prev->b_next;
+  dummyfs_write_blocks (sb, bhs, k);
+  *last_bh = bhs[--k];
+  while (k--)
+    dummyfs_put_block (bhs[k]);
+
+  prev->b_next = run;
+  dummyfs_dirty_block (sb, prev_bh);
+
+  return done;
+}
+
+/*
+ * Write data from an iov_iter into a file at pos, touching only the blocks
+ * the write covers. Blocks are only allocated for the parts of the write
+ * that land in a hole (a write past the end of the file leaves a hole
+ * behind it), each hole the write covers being claimed as one run, and
+ * appends find their block from the file's tail rather than by walking
+ * the linked list, so the cost of a write depends on how much is written
+ * rather than on the size of the file. The blocks written to are written
+ * out in batches.
+ *
+ * Returns the amount of data written, or a negative error if nothing
+ * could be written.
+ */
+ssize_t
+dummyfs_write_range (struct super_block *sb, struct buffer_head *inode_bh,
+                     struct dummyfs_inode *inode, loff_t pos,
+                     struct iov_iter *from)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block = NULL;
+  struct dummyfs_block *next;
+  struct buffer_head **bhs = NULL;
+  struct buffer_head **run_bhs = NULL;
+  struct buffer_head *bh;
+  struct buffer_head *next_bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long nr = 0;
+  unsigned long ord;
+  unsigned long cur_ord = 0;
+  unsigned long last_ord;
+  unsigned long hole_end;
+  unsigned long off;
+  unsigned long n;
+  unsigned long k;
+  sector_t index;
+  size_t count = iov_iter_count (from);
+  size_t copied;
+  size_t done = 0;
+  ssize_t filled;
+  int dirty = false;
+  int err = 0;
+
+  log_info (FNM, "writing data (%lld+%zu)", pos, count);
+
+  // Start with whatever lands in the inode's inline data
+  if (pos < inline_size)
+    {
+      n = MIN (inline_size - pos, count);
+      done = copy_from_iter (inode->i_data + pos, n, from);
+      if (done != n)
+        {
+          err = -EFAULT;
+          goto out;
+        }
+    }
+  if (done == count)
+    goto out;
+
+  /*
+   * A small file keeps whatever doesn't fit inline packed in with others,
+   * until it outgrows that.
+   */
+  if (dummyfs_pack_fits (sb, inode, pos + count))
+    {
+      filled = dummyfs_pack_write (sb, inode, pos + done - inline_size, from);
+      if (filled < 0)
+        err = filled;
+      else
+        done += filled;
+      goto out;
+    }
+  err = dummyfs_unpack_data (sb, inode_bh, inode);
+  if (err)
+    goto out;
+
+  // A compressed file is written a cluster at a time
+  if (IF_IS_COMPRESSED (inode->i_flags))
+    {
+      filled = dummyfs_compress_write (sb, inode_bh, inode, pos + done,
+                                       count - done, from);
+      if (filled < 0)
+        err = filled;
+      else
+        done += filled;
+      goto out;
+    }
+
+  // Blocks shared with a clone are copied before they're written to
+  last_ord = (pos + count - 1 - inline_size) / max_data;
+  err = dummyfs_unshare_data (sb, inode_bh, inode, last_ord + 1);
+  if (err)
+    goto out;
+
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  run_bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                           GFP_NOFS);
+  if (!bhs || !run_bhs)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  // Start from the last block at or before the write
+  index = dummyfs_find_block (sb, inode, (pos + done - inline_size) / max_data,
+                              &cur_ord);
+  if (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          goto out;
+        }
+    }
+
+  while (done < count)
+    {
+      ord = (pos + done - inline_size) / max_data;
+      off = (pos + done - inline_size) % max_data;
+
+      // Move on to the block at ord, or fill in the hole it's in
+      if (!block || cur_ord != ord)
+        {
+          index = block ? block->b_next : inode->b_next;
+          next = NULL;
+          hole_end = last_ord + 1;
+          if (!BLOCK_IS_UNALLOCATED (index))
+            {
+              next = dummyfs_get_block (sb, index, &next_bh);
+              if (!next)
+                {
+                  err = -EIO;
+                  break;
+                }
+              if (next->b_index == ord)
+                {
+                  if (block && !dirty)
+                    dummyfs_put_block (bh); // Batched ones go later
+                  block = next;
+                  bh = next_bh;
+                  cur_ord = ord;
+                  dirty = false;
+                }
+              else
+                {
+                  hole_end = MIN (hole_end, (unsigned long)next->b_index);
+                  dummyfs_put_block (next_bh);
+                  next = NULL;
+                }
+            }
+
+          if (!next)
+            {
+              filled = dummyfs_fill_hole (
+                  sb, block ? bh : inode_bh,
+                  block ? block : (struct dummyfs_block *)inode, ord, off,
+                  MIN (hole_end - ord, MAX_BATCH_BLOCKS), from, run_bhs,
+                  &next_bh);
+              if (filled < 0)
+                {
+                  log_info (FNM, "couldn't fill hole at %lu", ord);
+                  err = filled;
+                  break;
+                }
+              done += filled;
+              if (block && !dirty)
+                dummyfs_put_block (bh);
+              bh = next_bh;
+              block = (struct dummyfs_block *)bh->b_data;
+              cur_ord = block->b_index;
+              dirty = false; // Written out already
+              continue;
+            }
+        }
+
+      n = MIN (max_data - off, count - done);
+      copied = copy_from_iter (block->b_data + off, n, from);
+      done += copied;
+      if (copied && !dirty)
+        {
+          mark_buffer_dirty (bh);
+          bhs[nr++] = bh;
+          dirty = true;
+        }
+      if (copied != n)
+        {
+          err = -EFAULT;
+          break;
+        }
+
+      if (nr == MAX_BATCH_BLOCKS)
+        {
+          // Hang on to the current block, which links to the next one
+          if (dirty && !dummyfs_get_block (sb, bh->b_blocknr, &bh))
+            {
+              block = NULL;
+              err = -EIO;
+            }
+          dirty = false;
+          dummyfs_write_blocks (sb, bhs, nr);
+          for (k = 0; k < nr; k++)
+            dummyfs_put_block (bhs[k]);
+          nr = 0;
+          if (err)
+            break;
+        }
+    }
+  if (block && !dirty)
+    dummyfs_put_block (bh);
+  dummyfs_write_blocks (sb, bhs, nr);
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+
+out:
+  kfree (bhs);
+  kfree (run_bhs);
+
+  // Record the new size, even if only part of the data fit
+  if (pos + done > inode->i_size)
+    inode->i_size = pos + done;
+
+  // Writing past the tail (growing the file or filling a hole) moves it on
+  if (pos + count > inline_size
+      && (BLOCK_IS_UNALLOCATED (inode->i_tail)
+          || cur_ord > inode->i_tail_index))
+    dummyfs_grow_tail (sb, inode);
+  dummyfs_dirty_block (sb, inode_bh);
+
+  log_info (FNM, "done write data (%zu bytes)", done);
+
+  return done ? done : err;
+}
+
+/*
+ * Zero a range of a file's data in place (the caller writes out the
+ * inode, whose inline data may have changed). Holes in the range are
+ * zeros already, so they're left alone.
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_zero_data (struct super_block *sb, struct buffer_head *inode_bh,
+                   struct dummyfs_inode *inode, loff_t start, loff_t end)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block;
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long nr = 0;
+  unsigned long ord;
+  unsigned long k;
+  loff_t block_pos;
+  loff_t from;
+  sector_t index;
+  ssize_t written;
+  int err = 0;
+
+  log_info (FNM, "zeroing data (%lld-%lld)", start, end);
+
+  if (start < inline_size)
+    {
+      memset (inode->i_data + start, 0,
+              MIN (end, (loff_t)inline_size) - start);
+      start = MIN (end, (loff_t)inline_size);
+    }
+  if (start == end)
+    return 0;
+
+  // Zeroing part of a compressed cluster means rewriting the cluster
+  if (IF_IS_COMPRESSED (inode->i_flags)
+      && BLOCK_IS_UNALLOCATED (inode->i_pack))
+    {
+      written = dummyfs_compress_write (sb, inode_bh, inode, start,
+                                        end - start, NULL);
+      if (written < 0)
+        return written;
+      return (written == end - start) ? 0 : -ENOSPC;
+    }
+
+  err = dummyfs_unshare_data (sb, inode_bh, inode,
+                              (end - 1 - inline_size) / max_data + 1);
+  if (err)
+    return err;
+
+  index = dummyfs_find_block (sb, inode, (start - inline_size) / max_data,
+                              &ord);
+  if (BLOCK_IS_UNALLOCATED (index))
+    index = inode->b_next;
+
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  if (!bhs)
+    return -ENOMEM;
+
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          break;
+        }
+      block_pos = inline_size + (loff_t)block->b_index * max_data;
+      if (block_pos >= end)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+      index = block->b_next;
+      if (block_pos + max_data <= start)
+        {
+          dummyfs_put_block (bh);
+          continue;
+        }
+
+      from = MAX (start, block_pos);
+      memset (block->b_data + (from - block_pos), 0,
+              MIN (end, block_pos + (loff_t)max_data) - from);
+      mark_buffer_dirty (bh);
+      bhs[nr++] = bh;
+
+      if (nr == MAX_BATCH_BLOCKS)
+        {
+          dummyfs_write_blocks (sb, bhs, nr);
+          for (k = 0; k < nr; k++)
+            dummyfs_put_block (bhs[k]);
+          nr = 0;
+        }
+    }
+  dummyfs_write_blocks (sb, bhs, nr);
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+  kfree (bhs);
+
+  return err;
+}
+
+/*
+ * Preallocate the data blocks a file needs to hold the range from start
+ * to end, filling in every hole in the range (including any past the
+ * last block) with zeroed blocks. Each hole is claimed as contiguous
+ * runs placed right after the block before it, and written out as a
+ * ready-linked list before it's linked in, where later writes fill it
+ * in. Unless keep_size is set, the file is also grown to end bytes
+ * (which read back as zeros).
+ *
+ * Returns 0 on success, or a negative error (having kept whatever blocks
+ * were preallocated before the error).
+ */
+int
+dummyfs_prealloc_data (struct super_block *sb, struct buffer_head *inode_bh,
+                       struct dummyfs_inode *inode, loff_t start, loff_t end,
+                       int keep_size)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block;
+  struct dummyfs_block *prev = (struct dummyfs_block *)inode;
+  struct buffer_head **bhs;
+  struct buffer_head *prev_bh = inode_bh;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long ord = 0;
+  unsigned long need;
+  unsigned long hole_end;
+  unsigned long got;
+  unsigned long k;
+  sector_t index;
+  sector_t next;
+  sector_t run;
+  int err = 0;
+
+  need = (end > inline_size) ? DIV_ROUND_UP (end - inline_size, max_data)
+                             : 0;
+  if (start > inline_size)
+    ord = (start - inline_size) / max_data;
+
+  /*
+   * A compressed file only takes the blocks its clusters compress to,
+   * which isn't known until they're written, so there's nothing to set
+   * aside (only the size changes).
+   */
+  if (IF_IS_COMPRESSED (inode->i_flags))
+    ord = need = 0;
+
+  log_info (FNM, "preallocating data (%lld-%lld, blocks %lu-%lu)", start,
+            end, ord, need);
+
+  /*
+   * Blocks are wanted, so a packed file gets one of its own first, and
+   * the ones that holes get linked in after can't be shared
+   */
+  if (need)
+    {
+      err = dummyfs_unpack_data (sb, inode_bh, inode);
+      if (!err)
+        err = dummyfs_unshare_data (sb, inode_bh, inode, need);
+      if (err)
+        return err;
+    }
+
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  if (!bhs)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  // Start from the last block before the range
+  if (ord)
+    {
+      index = dummyfs_find_block (sb, inode, ord - 1, &k);
+      if (!BLOCK_IS_UNALLOCATED (index))
+        {
+          prev = dummyfs_get_block (sb, index, &prev_bh);
+          if (!prev)
+            {
+              prev_bh = inode_bh;
+              err = -EIO;
+              goto out;
+            }
+        }
+    }
+
+  while (ord < need)
+    {
+      // Find where the hole (if any) at ord ends
+      next = prev->b_next;
+      hole_end = need;
+      block = NULL;
+      if (!BLOCK_IS_UNALLOCATED (next))
+        {
+          block = dummyfs_get_block (sb, next, &bh);
+          if (!block)
+            {
+              err = -EIO;
+              break;
+            }
+          hole_end = MIN (need, (unsigned long)block->b_index);
+        }
+      if (hole_end == ord)
+        { // Not a hole, so move along the list
+          if (prev_bh != inode_bh)
+            dummyfs_put_block (prev_bh);
+          prev = block;
+          prev_bh = bh;
+          ord++;
+          continue;
+        }
+      if (block)
+        dummyfs_put_block (bh);
+
+      /*
+       * Claim as long a run as we can after the previous block, and write
+       * it out as a ready-linked list of empty data blocks (carrying on
+       * into whatever followed the hole) before linking it in.
+       */
+      run = dummyfs_alloc_blocks (sb, prev_bh->b_blocknr + 1,
+                                  MIN (hole_end - ord, MAX_BATCH_BLOCKS),
+                                  &got);
+      if (!run)
+        {
+          err = -ENOSPC;
+          break;
+        }
+      for (k = 0; k < got; k++)
+        {
+          block = dummyfs_get_new_block (sb, run + k, &bhs[k]);
+          if (!block)
+            break;
+          block->b_mode = BM_DATA;
+          block->b_index = ord + k;
+          block->b_next = (k + 1 < got) ? run + k + 1 : next;
+          mark_buffer_dirty (bhs[k]);
+        }
+      if (k < got)
+        { // Out of memory partway through the run
+          dummyfs_free_blocks (sb, run + k, got - k);
+          if (k)
+            ((struct dummyfs_block *)bhs[k - 1]->b_data)->b_next = next;
+          got = k;
+          err = -ENOMEM;
+          if (!got)
+            break;
+        }
+      dummyfs_write_blocks (sb, bhs, got);
+      for (k = 0; k + 1 < got; k++)
+        dummyfs_put_block (bhs[k]);
+
+      prev->b_next = run;
+      if (prev_bh != inode_bh)
+        {
+          dummyfs_dirty_block (sb, prev_bh);
+          dummyfs_put_block (prev_bh);
+        }
+      prev_bh = bhs[got - 1];
+      prev = (struct dummyfs_block *)prev_bh->b_data;
+      ord += got;
+      if (err)
+        break;
+    }
+
+  /*
+   * Grow the file over the preallocated blocks (which are already zeroed).
+   * Blocks may have gone into a hole at the end of the file either way,
+   * which can move the tail.
+   */
+  if (!err && !keep_size && end > inode->i_size)
+    inode->i_size = end;
+  dummyfs_grow_tail (sb, inode);
+
+out:
+  kfree (bhs);
+  if (prev_bh != inode_bh)
+    dummyfs_put_block (prev_bh);
+  dummyfs_dirty_block (sb, inode_bh);
+
+  log_info (FNM, "done preallocating data");
+
+  return err;
+}
+
+/*
+ * Cut a file's linked list of data blocks after a block (or after the
+ * inode), freeing everything that followed it.
+ */
+static void
+dummyfs_cut_data (struct super_block *sb, struct buffer_head *inode_bh,
+                  struct buffer_head *prev_bh, struct dummyfs_block *prev)
+{
+  sector_t next = prev->b_next;
+
+  if (BLOCK_IS_UNALLOCATED (next))
+    return;
+
+  prev->b_next = BLOCK_UNALLOCATED;
+  if (prev_bh != inode_bh)
+    dummyfs_dirty_block (sb, prev_bh);
+  dummyfs_dealloc_data (sb, next);
+}
+
+/*
+ * Punch a hole in a file's data between start and end. The data blocks
+ * wholly inside the hole are unlinked from the file and freed, and the
+ * rest of the hole (the ends of the blocks either side of it, and any
+ * inline data) is zeroed in place.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_punch_data (struct super_block *sb, struct buffer_head *inode_bh,
+                    struct dummyfs_inode *inode, loff_t start, loff_t end)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *prev = (struct dummyfs_block *)inode;
+  struct dummyfs_block *block;
+  struct buffer_head *prev_bh = inode_bh;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long first = 0;
+  unsigned long last = 0;
+  unsigned long prev_ord = 0;
+  loff_t size = inode->i_size;
+  loff_t whole_start;
+  loff_t whole_end;
+  sector_t index;
+  sector_t freed = BLOCK_UNALLOCATED;
+  int err = 0;
+
+  log_info (FNM, "punching data (%lld-%lld)", start, end);
+
+  // The hole is punched in blocks, so a packed file needs one of its own
+  if (end > inline_size && start < size)
+    {
+      err = dummyfs_unpack_data (sb, inode_bh, inode);
+      if (err)
+        return err;
+    }
+
+  // Work out which blocks lie wholly inside the hole
+  if (start > inline_size)
+    first = DIV_ROUND_UP (start - inline_size, max_data);
+  if (end > inline_size)
+    last = (end - inline_size) / max_data;
+  // A compressed file's blocks only go a whole cluster at a time
+  if (IF_IS_COMPRESSED (inode->i_flags))
+    {
+      first = roundup (first, CLUSTER_BLOCKS (sb->s_blocksize));
+      last = rounddown (last, CLUSTER_BLOCKS (sb->s_blocksize));
+    }
+  if (last < first)
+    last = first;
+  whole_start = inline_size + (loff_t)first * max_data;
+  whole_end = inline_size + (loff_t)last * max_data;
+
+  // The block before the hole gets relinked, so it can't be shared
+  err = dummyfs_unshare_data (sb, inode_bh, inode, first);
+  if (err || first == last)
+    goto zero;
+
+  // Find the last block before the hole
+  if (first)
+    {
+      index = dummyfs_find_block (sb, inode, first - 1, &prev_ord);
+      if (!BLOCK_IS_UNALLOCATED (index))
+        {
+          prev = dummyfs_get_block (sb, index, &prev_bh);
+          if (!prev)
+            {
+              prev_bh = inode_bh;
+              err = -EIO;
+              goto zero;
+            }
+        }
+    }
+
+  /*
+   * The blocks inside the hole follow on from each other in the list, so
+   * they can be unlinked as one piece and then freed like any other list.
+   */
+  index = prev->b_next;
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          break;
+        }
+      if (block->b_index >= last)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+      if (BLOCK_IS_UNALLOCATED (freed))
+        freed = index;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+    }
+  if (!err && !BLOCK_IS_UNALLOCATED (freed))
+    {
+      prev->b_next = index;
+      if (prev_bh != inode_bh)
+        dummyfs_dirty_block (sb, prev_bh);
+      dummyfs_dealloc_until (sb, freed, index);
+
+      // The tail may have been in the hole
+      if (!BLOCK_IS_UNALLOCATED (inode->i_tail) && inode->i_tail_index >= first
+          && inode->i_tail_index < last)
+        {
+          inode->i_tail
+              = (prev_bh != inode_bh) ? prev_bh->b_blocknr : BLOCK_UNALLOCATED;
+          inode->i_tail_index = (prev_bh != inode_bh) ? prev_ord : 0;
+        }
+    }
+  if (prev_bh != inode_bh)
+    dummyfs_put_block (prev_bh);
+
+zero:
+  // Zero the parts of the hole outside of those (and past the end, it's 0s)
+  if (!err && start < MIN (whole_start, size))
+    err = dummyfs_zero_data (sb, inode_bh, inode, start,
+                             MIN (MIN (end, whole_start), size));
+  if (!err && MAX (start, whole_end) < MIN (end, size))
+    err = dummyfs_zero_data (sb, inode_bh, inode, MAX (start, whole_end),
+                             MIN (end, size));
+
+  dummyfs_dirty_block (sb, inode_bh);
+
+  log_info (FNM, "done punching data");
+
+  return err;
+}
+
+/*
+ * Change the size of a file. Shrinking it frees the data blocks wholly
+ * past the new end of the file (including any preallocated ones) and
+ * zeroes what's left of the block the file now ends in. Growing it only
+ * moves the end of the file: the new range is a hole (or preallocated
+ * blocks) until something is written there.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_truncate_data (struct super_block *sb, struct buffer_head *inode_bh,
+                       struct dummyfs_inode *inode, loff_t size)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *prev = (struct dummyfs_block *)inode;
+  struct buffer_head *prev_bh = inode_bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long keep = 0;
+  unsigned long ord = 0;
+  sector_t index = BLOCK_UNALLOCATED;
+  loff_t zero_end = inline_size;
+  int err = 0;
+
+  log_info (FNM, "truncating data (%llu to %lld bytes)", inode->i_size,
+            size);
+
+  if (size >= inode->i_size)
+    {
+      inode->i_size = size;
+      dummyfs_grow_tail (sb, inode);
+      goto out;
+    }
+
+  // A packed fragment is cut down in place
+  err = dummyfs_pack_truncate (sb, inode,
+                               (size > inline_size) ? size - inline_size : 0);
+  if (err)
+    goto out;
+
+  /*
+   * Keep the data blocks up to the one the file now ends in (or for a
+   * compressed file, the whole cluster it ends in)
+   */
+  if (size > inline_size)
+    {
+      keep = (size - inline_size - 1) / max_data;
+      if (IF_IS_COMPRESSED (inode->i_flags))
+        keep = roundup (keep + 1, CLUSTER_BLOCKS (sb->s_blocksize)) - 1;
+      zero_end = inline_size + (loff_t)(keep + 1) * max_data;
+    }
+  err = dummyfs_zero_data (sb, inode_bh, inode, size,
+                           MIN (zero_end, (loff_t)inode->i_size));
+  if (!err && size > inline_size)
+    err = dummyfs_unshare_data (sb, inode_bh, inode, keep + 1);
+  if (err)
+    goto out;
+  if (size > inline_size)
+    index = dummyfs_find_block (sb, inode, keep, &ord);
+
+  if (!BLOCK_IS_UNALLOCATED (index))
+    {
+      prev = dummyfs_get_block (sb, index, &prev_bh);
+      if (!prev)
+        {
+          prev_bh = inode_bh;
+          err = -EIO;
+          goto out;
+        }
+    }
+  dummyfs_cut_data (sb, inode_bh, prev_bh, prev);
+  if (prev_bh != inode_bh)
+    dummyfs_put_block (prev_bh);
+
+  inode->i_size = size;
+  inode->i_tail = index;
+  inode->i_tail_index = BLOCK_IS_UNALLOCATED (index) ? 0 : ord;
+
+out:
+  dummyfs_dirty_block (sb, inode_bh);
+
+  log_info (FNM, "done truncating data");
+
+  return err;
+}
+
+/*
+ * Find the next data (or the next hole, if hole is set) in a file at or
+ * after offset, for SEEK_DATA and SEEK_HOLE. The inline data (and all of
+ * a packed file) always counts as data, and the end of the file as a
+ * hole.
+ *
+ * Returns the offset found, or -ENXIO if there's no more data (or the
+ * offset is past the end of the file).
+ */
+loff_t
+dummyfs_seek_data (struct super_block *sb, struct dummyfs_inode *inode,
+                   loff_t offset, int hole)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long blocks = CLUSTER_BLOCKS (sb->s_blocksize);
+  unsigned long span;
+  unsigned long ord;
+  unsigned long n;
+  loff_t size = inode->i_size;
+  loff_t pos = offset;
+  loff_t start;
+  sector_t index;
+
+  if (offset < 0 || offset >= size)
+    return -ENXIO;
+  if (offset < inline_size)
+    {
+      if (!hole)
+        return offset;
+      pos = inline_size;
+    }
+
+  // All of a packed file counts as data too
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    return hole ? size : pos;
+
+  /*
+   * Walk the blocks from the one covering pos (or the first). The first
+   * block of a compressed cluster covers all of the cluster, so a
+   * compressed file's walk starts at the cluster pos is in.
+   */
+  n = (pos - inline_size) / max_data;
+  if (IF_IS_COMPRESSED (inode->i_flags))
+    n -= n % blocks;
+  index = dummyfs_find_block (sb, inode, n, &ord);
+  if (BLOCK_IS_UNALLOCATED (index))
+    index = inode->b_next;
+
+  while (!BLOCK_IS_UNALLOCATED (index) && pos < size)
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        return -EIO;
+      start = inline_size + (loff_t)block->b_index * max_data;
+      span = BF_IS_COMPRESSED (block->b_flags) ? blocks * max_data
+                                                : max_data;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+
+      if (start + span <= pos)
+        continue;
+      if (!hole)
+        return (start < size) ? MAX (start, pos) : -ENXIO;
+      if (start > pos)
+        break; // pos is in a hole
+      pos = start + span;
+    }
+
+  return hole ? MIN (pos, size) : -ENXIO;
+}
+
+/*
+ * An extent of a FIEMAP reply that's held back in case the next one
+ * carries straight on from it (see dummyfs_fiemap_add).
+ */
+struct dummyfs_fiemap_extent
+{
+  u64 e_logical;
+  u64 e_physical;
+  u64 e_length;
+  u64 e_next; // Where on the device it would carry on from, or 0
+  u32 e_flags;
+};
+
+/*
+ * Add a piece of a file to a FIEMAP reply, joining it onto the extent
+ * held back in ext if it follows on from it both in the file and on the
+ * device. Otherwise the held back extent goes into the reply and the
+ * piece is held back instead.
+ *
+ * Returns 0 to carry on, 1 if the reply is full, or a negative error.
+ */
+static int
+dummyfs_fiemap_add (struct fiemap_extent_info *fieinfo,
+                    struct dummyfs_fiemap_extent *ext, u64 logical,
+                    u64 physical, u64 length, u64 next, u32 flags)
+{
+  int err = 0;
+
+  if (ext->e_length && ext->e_flags == flags && ext->e_next == physical
+      && ext->e_logical + ext->e_length == logical)
+    {
+      ext->e_length += length;
+      ext->e_next = next;
+      return 0;
+    }
+
+  if (ext->e_length)
+    err = fiemap_fill_next_extent (fieinfo, ext->e_logical, ext->e_physical,
+                                   ext->e_length, ext->e_flags);
+  ext->e_logical = logical;
+  ext->e_physical = physical;
+  ext->e_length = length;
+  ext->e_next = next;
+  ext->e_flags = flags;
+
+  return err;
+}
+
+/*
+ * Report where a file's data is on the device, from start for len bytes
+ * (FIEMAP). The inline data and a packed fragment are reported as such.
+ * Each run of data blocks one after another on the device is an extent,
+ * though the data in it isn't quite contiguous: every block starts with
+ * its header, so extents aren't block aligned. A compressed cluster is an
+ * encoded extent covering all of the cluster. Once a file's list reaches
+ * a block shared with a clone, the rest of it is shared.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_fiemap_data (struct super_block *sb, struct buffer_head *inode_bh,
+                     struct dummyfs_inode *inode,
+                     struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_fiemap_extent ext = { 0 };
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  unsigned long max_data = sbi->s_max_block_data_size;
+  unsigned long inline_size = sbi->s_max_inode_data_size;
+  unsigned long blocks = CLUSTER_BLOCKS (sb->s_blocksize);
+  unsigned long cluster_end = 0;
+  unsigned long ord;
+  unsigned int bits = sb->s_blocksize_bits;
+  u64 end = (len > U64_MAX - start) ? U64_MAX : start + len;
+  u64 logical;
+  u64 physical;
+  u64 span;
+  u32 flags;
+  size_t n;
+  sector_t index;
+  int shared = false;
+  int err = 0;
+
+  if (inode->i_size && start < inline_size)
+    {
+      physical = ((u64)inode_bh->b_blocknr << bits)
+                 + ((char *)inode->i_data - inode_bh->b_data);
+      err = dummyfs_fiemap_add (fieinfo, &ext, 0, physical,
+                                MIN (inode->i_size, (u64)inline_size), 0,
+                                FIEMAP_EXTENT_DATA_INLINE
+                                    | FIEMAP_EXTENT_NOT_ALIGNED);
+      if (err)
+        return (err < 0) ? err : 0;
+    }
+
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    {
+      physical = dummyfs_pack_locate (sb, inode, &n);
+      if (!physical)
+        return -EIO;
+      if (inline_size + n > start && inline_size < end)
+        err = dummyfs_fiemap_add (fieinfo, &ext, inline_size, physical, n,
+                                  0,
+                                  FIEMAP_EXTENT_DATA_TAIL
+                                      | FIEMAP_EXTENT_NOT_ALIGNED);
+      if (err)
+        return (err < 0) ? err : 0;
+    }
+
+  /*
+   * A file that shares blocks is walked from the start, to find the
+   * first shared one; any other can start at the block (or for a
+   * compressed file, the cluster) that start is in.
+   */
+  index = BLOCK_UNALLOCATED;
+  if (start > inline_size && !IF_IS_SHARED (inode->i_flags))
+    {
+      ord = (start - inline_size) / max_data;
+      if (IF_IS_COMPRESSED (inode->i_flags))
+        ord -= ord % blocks;
+      index = dummyfs_find_block (sb, inode, ord, &ord);
+    }
+  if (BLOCK_IS_UNALLOCATED (index))
+    index = inode->b_next;
+
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          break;
+        }
+      physical = (u64)index << bits;
+      logical = inline_size + (u64)block->b_index * max_data;
+      if (block->b_refs)
+        shared = true;
+
+      if (block->b_index < cluster_end)
+        {
+          // More of the compressed cluster before it
+          if (ext.e_next == physical)
+            ext.e_next += sb->s_blocksize;
+          else
+            ext.e_next = 0;
+          index = block->b_next;
+          dummyfs_put_block (bh);
+          continue;
+        }
+
+      flags = FIEMAP_EXTENT_NOT_ALIGNED;
+      span = max_data;
+      if (BF_IS_COMPRESSED (block->b_flags))
+        {
+          flags |= FIEMAP_EXTENT_ENCODED;
+          span = blocks * max_data;
+          cluster_end = block->b_index + blocks;
+        }
+      if (shared)
+        flags |= FIEMAP_EXTENT_SHARED;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+
+      if (logical >= end)
+        break;
+      if (logical + span <= start)
+        continue;
+      err = dummyfs_fiemap_add (fieinfo, &ext, logical, physical, span,
+                                physical + sb->s_blocksize, flags);
+      if (err)
+        return (err < 0) ? err : 0;
+    }
+  if (err)
+    return err;
+
+  // The last extent of the file is marked as such
+  if (ext.e_length)
+    {
+      if (BLOCK_IS_UNALLOCATED (index))
+        ext.e_flags |= FIEMAP_EXTENT_LAST;
+      err = fiemap_fill_next_extent (fieinfo, ext.e_logical, ext.e_physical,
+                                     ext.e_length, ext.e_flags);
+    }
+
+  return (err < 0) ? err : 0;
+}
+
+/*
+ * Copy part of one file into another (or elsewhere in the same file)
+ * without the data going through userspace. Only the data in the source
+ * range is copied; wherever the source has a hole, the destination gets
+ * one too. The data is copied in batches through a kernel buffer.
+ *
+ * Returns the amount copied, or a negative error if nothing could be.
+ */
+ssize_t
+dummyfs_copy_data (struct super_block *sb, struct dummyfs_inode *src,
+                   loff_t pos_in, struct buffer_head *dst_bh,
+                   struct dummyfs_inode *dst, loff_t pos_out, size_t count)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_read_state rs = { 0 };
+  struct iov_iter iter;
+  struct kvec kv;
+  size_t chunk = MAX_BATCH_BLOCKS * sbi->s_max_block_data_size;
+  size_t done = 0;
+  ssize_t n;
+  loff_t pos;
+  loff_t data;
+  loff_t hole = 0;
+  loff_t end;
+  char *buf;
+  int err = 0;
+
+  if (pos_in >= src->i_size || !count)
+    return 0;
+  end = MIN ((loff_t)src->i_size, pos_in + (loff_t)count);
+
+  log_info (FNM, "copying data (%lld+%lld to %lld)", pos_in, end - pos_in,
+            pos_out);
+
+  buf = kvmalloc (chunk, GFP_NOFS);
+  if (!buf)
+    return -ENOMEM;
+
+  // Carry on down the source's list (with readahead) from chunk to chunk
+  spin_lock_init (&rs.r_lock);
+  rs.r_cursor_block = BLOCK_UNALLOCATED;
+  rs.r_next_pos = pos_in;
+
+  while (pos_in + done < end)
+    {
+      pos = pos_in + done;
+
+      // Find the next run of data, making a hole for anything before it
+      if (pos >= hole)
+        {
+          data = dummyfs_seek_data (sb, src, pos, false);
+          if (data == -ENXIO)
+            data = end;
+          if (data < 0)
+            {
+              err = data;
+              break;
+            }
+          data = MIN (data, end);
+          if (data > pos)
+            {
+              err = dummyfs_punch_data (sb, dst_bh, dst, pos_out + done,
+                                        pos_out + (data - pos_in));
+              if (err)
+                break;
+              done = data - pos_in;
+              continue;
+            }
+          hole = dummyfs_seek_data (sb, src, pos, true);
+          if (hole < 0)
+            {
+              err = hole;
+              break;
+            }
+        }
+
+      kv.iov_base = buf;
+      kv.iov_len = MIN ((size_t)(MIN (hole, end) - pos), chunk);
+      iov_iter_kvec (&iter, READ, &kv, 1, kv.iov_len);
+      n = dummyfs_read_data (sb, src, pos, &iter, &rs);
+      if (n <= 0)
+        {
+          err = n ? n : -EIO;
+          break;
+        }
+
+      kv.iov_len = n;
+      iov_iter_kvec (&iter, WRITE, &kv, 1, n);
+      n = dummyfs_write_range (sb, dst_bh, dst, pos_out + done, &iter);
+      if (n <= 0)
+        {
+          err = n ? n : -EIO;
+          break;
+        }
+      done += n;
+    }
+
+  kvfree (buf);
+
+  // A hole at the end of the source still has to make the copy that long
+  if (done && pos_out + done > dst->i_size)
+    {
+      err = dummyfs_truncate_data (sb, dst_bh, dst, pos_out + done);
+      if (err)
+        done = 0;
+    }
+
+  log_info (FNM, "done copying data (%zu bytes)", done);
+
+  return done ? done : err;
+}
+
+/*
+ * Make one file a clone of another: the clone's data is replaced with the
+ * source's, by sharing the source's list of data blocks rather than
+ * copying it. Neither file can then change a shared block in place, so
+ * whichever writes to one first gets its own copies of the blocks up to
+ * there (see dummyfs_unshare_data). A source without data blocks (whose
+ * data is all inline or packed) is just copied. The caller writes out the
+ * source's inode.
+ *
+ * Returns 0 on success, or a negative error.
+ */
+int
+dummyfs_clone_data (struct super_block *sb, struct dummyfs_inode *src,
+                    struct buffer_head *dst_bh, struct dummyfs_inode *dst)
+{
+  ssize_t copied;
+  int err;
+
+  log_info (FNM, "cloning data (%llu bytes) from inode %u to inode %u",
+            src->i_size, src->i_ino, dst->i_ino);
+
+  err = dummyfs_truncate_data (sb, dst_bh, dst, 0);
+  if (err)
+    return err;
+  dst->i_flags |= src->i_flags & IF_COMPRESSED;
+
+  if (BLOCK_IS_UNALLOCATED (src->b_next))
+    {
+      copied = dummyfs_copy_data (sb, src, 0, dst_bh, dst, 0, src->i_size);
+      if (copied < 0)
+        return copied;
+      return (copied == src->i_size) ? 0 : -ENOSPC;
+    }
+
+  err = dummyfs_share_get (sb, src->b_next);
+  if (err)
+    return err;
+
+  memcpy (dst->i_data, src->i_data, DUMMYFS_SB (sb)->s_max_inode_data_size);
+  dst->i_size = src->i_size;
+  dst->b_next = src->b_next;
+  dst->i_tail = src->i_tail;
+  dst->i_tail_index = src->i_tail_index;
+  src->i_flags |= IF_SHARED;
+  dst->i_flags |= IF_SHARED;
+  dummyfs_dirty_block (sb, dst_bh);
+
+  return 0;
+}
+
+/*
+ * Move a file's data blocks into a single run of free blocks, in order.
+ * The blocks are copied into the run, each linked to the next, and
+ * written out; only then is the inode pointed at the run and the old
+ * blocks freed, so the file is always either wholly in its old blocks or
+ * wholly in its new ones. Blocks shared with a clone can't be moved, as
+ * other lists point at them. The caller writes out the inode.
+ *
+ * Returns the number of blocks moved (0 if they were in one run already),
+ * or a negative error (with the file as it was).
+ */
+long
+dummyfs_defrag_data (struct super_block *sb, struct dummyfs_inode *inode)
+{
+  struct dummyfs_block *block;
+  struct dummyfs_block *copy = NULL;
+  struct dummyfs_block *next;
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  unsigned long count = 0;
+  unsigned long done = 0;
+  unsigned long nr = 0;
+  unsigned long got;
+  unsigned long k;
+  sector_t index;
+  sector_t last = BLOCK_UNALLOCATED;
+  sector_t tail = BLOCK_UNALLOCATED;
+  sector_t run;
+  int scattered = false;
+  int err = 0;
+
+  log_info (FNM, "defragmenting inode %u", inode->i_ino);
+
+  if (IF_IS_SHARED (inode->i_flags))
+    return -EINVAL;
+
+  // Count the blocks, and see whether they're in one run already
+  index = inode->b_next;
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        return -EIO;
+      if (count && index != last + 1)
+        scattered = true;
+      last = index;
+      count++;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+    }
+  if (!scattered)
+    return 0;
+
+  run = dummyfs_alloc_blocks (sb, 0, count, &got);
+  if (run && got < count)
+    {
+      dummyfs_free_blocks (sb, run, got);
+      run = 0;
+    }
+  if (!run)
+    return -ENOSPC;
+
+  bhs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct buffer_head *),
+                       GFP_NOFS);
+  if (!bhs)
+    {
+      dummyfs_free_blocks (sb, run, count);
+      return -ENOMEM;
+    }
+
+  index = inode->b_next;
+  while (done < count)
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          break;
+        }
+      if (nr == MAX_BATCH_BLOCKS)
+        { // Write out all but the last copy, which may need relinking
+          dummyfs_write_blocks (sb, bhs, nr - 1);
+          for (k = 0; k + 1 < nr; k++)
+            dummyfs_put_block (bhs[k]);
+          bhs[0] = bhs[nr - 1];
+          nr = 1;
+        }
+      next = dummyfs_get_new_block (sb, run + done, &bhs[nr]);
+      if (!next)
+        {
+          dummyfs_put_block (bh);
+          err = -ENOMEM;
+          break;
+        }
+      memcpy (next, block, sb->s_blocksize);
+      next->b_next = run + done + 1;
+      mark_buffer_dirty (bhs[nr++]);
+      copy = next;
+
+      if (index == inode->i_tail)
+        tail = run + done;
+      done++;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+    }
+  if (copy)
+    copy->b_next = BLOCK_UNALLOCATED;
+  dummyfs_write_blocks (sb, bhs, nr);
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+  kfree (bhs);
+
+  if (err)
+    {
+      // Nothing points at the copies yet, so they can just be freed
+      if (done)
+        dummyfs_dealloc_data (sb, run);
+      if (done < count)
+        dummyfs_free_blocks (sb, run + done, count - done);
+      return err;
+    }
+
+  // Swap the run in, and let go of the old blocks
+  index = inode->b_next;
+  inode->b_next = run;
+  if (!BLOCK_IS_UNALLOCATED (inode->i_tail))
+    inode->i_tail = tail;
+  dummyfs_dealloc_data (sb, index);
+
+  log_info (FNM, "moved %lu blocks of inode %u to %llu", count,
+            inode->i_ino, run);
+
+  return count;
+}
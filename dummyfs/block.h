@@ -7,29 +7,91 @@
 #ifndef BLOCK
 #define BLOCK
 
+#include "cache.h"
 #include "inode.h"
 #include "mod.h"
 
+// The most blocks read or written together in one plugged batch
+#define MAX_BATCH_BLOCKS 256
+
+/*
+ * Per-open-file state for reads: where in the linked list of data blocks
+ * the last read stopped (so a sequential read can carry on from there
+ * instead of walking the list from the inode), and the readahead window.
+ * Reads on the same file can run at once, so each works on a copy taken
+ * under r_lock, and leaves its own copy behind when it's done.
+ */
+struct dummyfs_read_state
+{
+  spinlock_t r_lock;
+  loff_t r_next_pos;        // Where a sequential read would start
+  u64 r_gen;                // s_chain_gen the cursor was taken at
+  loff_t r_cursor_pos;      // File offset of the data in the cursor block
+  sector_t r_cursor_block;  // Block index of the cursor
+  unsigned long r_window;   // Readahead window (in blocks), 0 when random
+  sector_t r_ra_start;      // Blocks read ahead so far...
+  sector_t r_ra_end;        // ...up to (but not including) this one
+  sector_t r_ra_mark;       // Reaching this block reads the next window
+};
+
 struct inode *dummyfs_new_inode (const struct inode *, umode_t,
                                  unsigned short);
-unsigned long dummyfs_inode_block_index (struct super_block *, unsigned long,
-                                         int);
-unsigned long dummyfs_empty_block (struct super_block *);
-unsigned long dummyfs_alloc_data (struct super_block *, struct dummyfs_block *,
-                                  unsigned long);
+sector_t dummyfs_inode_block_index (struct super_block *, unsigned long,
+                                    sector_t);
+sector_t dummyfs_empty_block (struct super_block *);
+sector_t dummyfs_alloc_data (struct super_block *, struct buffer_head *,
+                             struct dummyfs_block *, unsigned long);
 char *dummyfs_map_data (struct super_block *, struct dummyfs_inode *,
                         unsigned int);
-void dummyfs_dealloc_data (struct super_block *, unsigned long);
-int dummyfs_readblock (struct super_block *, unsigned long,
-                       struct dummyfs_block *);
-int dummyfs_writeblock (struct super_block *, unsigned long,
-                        struct dummyfs_block *);
-int dummyfs_read_inode (struct super_block *, unsigned long,
-                        struct dummyfs_inode *);
-int dummyfs_write_inode (struct super_block *, unsigned long,
-                         struct dummyfs_inode *);
+void dummyfs_dealloc_data (struct super_block *, sector_t);
+void dummyfs_dealloc_until (struct super_block *, sector_t, sector_t);
+void dummyfs_remove_inode (struct super_block *, unsigned long);
+void dummyfs_readahead (struct super_block *, sector_t, unsigned long);
+int dummyfs_read_blocks (struct super_block *, sector_t, unsigned long);
+int dummyfs_write_blocks (struct super_block *, struct buffer_head **,
+                          unsigned long);
+void *dummyfs_get_block (struct super_block *, sector_t,
+                         struct buffer_head **);
+void *dummyfs_get_new_block (struct super_block *, sector_t,
+                             struct buffer_head **);
+void dummyfs_dirty_block (struct super_block *, struct buffer_head *);
+void dummyfs_put_block (struct buffer_head *);
+struct dummyfs_inode *dummyfs_get_inode (struct super_block *, unsigned long,
+                                         struct buffer_head **);
+int dummyfs_stat_inode (struct super_block *, unsigned long,
+                        struct dummyfs_inode_meta *);
 int dummyfs_empty_inode (struct super_block *);
-int dummyfs_write_data (struct super_block *, struct dummyfs_inode *,
-                        unsigned char *, unsigned long);
+int dummyfs_count_inodes (struct super_block *, unsigned long *,
+                          unsigned long *);
+int dummyfs_write_data (struct super_block *, struct buffer_head *,
+                        struct dummyfs_inode *, unsigned char *,
+                        unsigned long);
+sector_t dummyfs_find_block (struct super_block *, struct dummyfs_inode *,
+                             unsigned long, unsigned long *);
+ssize_t dummyfs_read_data (struct super_block *, struct dummyfs_inode *,
+                           loff_t, struct iov_iter *,
+                           struct dummyfs_read_state *);
+ssize_t dummyfs_write_range (struct super_block *, struct buffer_head *,
+                             struct dummyfs_inode *, loff_t,
+                             struct iov_iter *);
+int dummyfs_prealloc_data (struct super_block *, struct buffer_head *,
+                           struct dummyfs_inode *, loff_t, loff_t, int);
+int dummyfs_unshare_data (struct super_block *, struct buffer_head *,
+                          struct dummyfs_inode *, unsigned long);
+int dummyfs_punch_data (struct super_block *, struct buffer_head *,
+                        struct dummyfs_inode *, loff_t, loff_t);
+int dummyfs_truncate_data (struct super_block *, struct buffer_head *,
+                           struct dummyfs_inode *, loff_t);
+loff_t dummyfs_seek_data (struct super_block *, struct dummyfs_inode *, loff_t,
+                          int);
+int dummyfs_fiemap_data (struct super_block *, struct buffer_head *,
+                         struct dummyfs_inode *, struct fiemap_extent_info *,
+                         u64, u64);
+ssize_t dummyfs_copy_data (struct super_block *, struct dummyfs_inode *,
+                           loff_t, struct buffer_head *,
+                           struct dummyfs_inode *, loff_t, size_t);
+int dummyfs_clone_data (struct super_block *, struct dummyfs_inode *,
+                        struct buffer_head *, struct dummyfs_inode *);
+long dummyfs_defrag_data (struct super_block *, struct dummyfs_inode *);
 
 #endif
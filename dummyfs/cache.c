@@ -0,0 +1,317 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "cache.h"
+#include "logging.h"
+#include "mod.h"
+
+#define FNM "cache"
+
+/*
+ * The metadata cache keeps hot inode tables, inodes, and directory
+ * listings resident as decoded structures, so they don't have to be
+ * looked up in (and decoded from) the buffer cache on every operation.
+ * Its memory use is capped per mount, and it gives memory back to the
+ * system through a shrinker.
+ */
+
+static struct hlist_head *
+dummyfs_meta_bucket (struct dummyfs_meta_cache *cache, unsigned int kind,
+                     unsigned long key)
+{
+  return &cache->c_hash[hash_64 (((__u64)key << 2) | kind, META_HASH_BITS)];
+}
+
+// Memory an object is charged for
+static size_t
+dummyfs_meta_charge (struct dummyfs_meta *m)
+{
+  return sizeof (struct dummyfs_meta) + m->m_size;
+}
+
+static void
+dummyfs_meta_free (struct dummyfs_meta *m)
+{
+  kvfree (m->m_data);
+  kfree (m);
+}
+
+/*
+ * Take an object out of the hash (with the cache locked). Objects that
+ * aren't pinned are moved onto the given list to be freed once the lock
+ * has been dropped; pinned ones are freed by their last user.
+ */
+static void
+dummyfs_meta_unhash (struct dummyfs_meta_cache *cache, struct dummyfs_meta *m,
+                     struct list_head *dispose)
+{
+  hlist_del_init (&m->m_hash);
+  cache->c_size -= dummyfs_meta_charge (m);
+  if (!m->m_pins)
+    {
+      list_move (&m->m_lru, dispose);
+      cache->c_count--;
+    }
+}
+
+/*
+ * Evict up to nr least recently used objects, and keep going for as long
+ * as the cache is over its memory cap (with the cache locked).
+ *
+ * Returns the number of objects evicted.
+ */
+static unsigned long
+dummyfs_meta_evict (struct dummyfs_meta_cache *cache, unsigned long nr,
+                    struct list_head *dispose)
+{
+  struct dummyfs_meta *m;
+  unsigned long freed = 0;
+
+  while (!list_empty (&cache->c_lru)
+         && (freed < nr || cache->c_size > cache->c_max_size))
+    {
+      m = list_last_entry (&cache->c_lru, struct dummyfs_meta, m_lru);
+      dummyfs_meta_unhash (cache, m, dispose);
+      freed++;
+    }
+
+  return freed;
+}
+
+static void
+dummyfs_meta_dispose (struct list_head *dispose)
+{
+  struct dummyfs_meta *m, *n;
+
+  list_for_each_entry_safe (m, n, dispose, m_lru)
+  {
+    list_del (&m->m_lru);
+    dummyfs_meta_free (m);
+  }
+}
+
+static unsigned long
+dummyfs_meta_count (struct shrinker *shrink, struct shrink_control *sc)
+{
+  struct dummyfs_meta_cache *cache
+      = container_of (shrink, struct dummyfs_meta_cache, c_shrinker);
+
+  return cache->c_count ? cache->c_count : SHRINK_EMPTY;
+}
+
+static unsigned long
+dummyfs_meta_scan (struct shrinker *shrink, struct shrink_control *sc)
+{
+  struct dummyfs_meta_cache *cache
+      = container_of (shrink, struct dummyfs_meta_cache, c_shrinker);
+  unsigned long freed;
+  LIST_HEAD (dispose);
+
+  spin_lock (&cache->c_lock);
+  freed = dummyfs_meta_evict (cache, sc->nr_to_scan, &dispose);
+  spin_unlock (&cache->c_lock);
+  dummyfs_meta_dispose (&dispose);
+
+  log_info (FNM, "shrinker freed %lu objects", freed);
+
+  return freed;
+}
+
+/*
+ * Set up the metadata cache of a mount, holding up to max_size bytes.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_meta_init (struct super_block *sb, size_t max_size)
+{
+  struct dummyfs_meta_cache *cache;
+  int k;
+  int err;
+
+  cache = kzalloc (sizeof (struct dummyfs_meta_cache), GFP_KERNEL);
+  if (!cache)
+    return -ENOMEM;
+
+  spin_lock_init (&cache->c_lock);
+  for (k = 0; k < (1 << META_HASH_BITS); k++)
+    INIT_HLIST_HEAD (&cache->c_hash[k]);
+  INIT_LIST_HEAD (&cache->c_lru);
+  cache->c_max_size = max_size;
+
+  cache->c_shrinker.count_objects = dummyfs_meta_count;
+  cache->c_shrinker.scan_objects = dummyfs_meta_scan;
+  cache->c_shrinker.seeks = DEFAULT_SEEKS;
+  err = register_shrinker (&cache->c_shrinker);
+  if (err)
+    {
+      kfree (cache);
+      return err;
+    }
+
+  DUMMYFS_SB (sb)->s_meta = cache;
+
+  log_info (FNM, "metadata cache of %zu bytes", max_size);
+
+  return 0;
+}
+
+/*
+ * Tear down the metadata cache of a mount. Nothing may be pinned.
+ */
+void
+dummyfs_meta_destroy (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_meta_cache *cache;
+  LIST_HEAD (dispose);
+
+  if (!sbi || !sbi->s_meta)
+    return;
+  cache = sbi->s_meta;
+
+  unregister_shrinker (&cache->c_shrinker);
+  spin_lock (&cache->c_lock);
+  dummyfs_meta_evict (cache, ULONG_MAX, &dispose);
+  spin_unlock (&cache->c_lock);
+  dummyfs_meta_dispose (&dispose);
+
+  kfree (cache);
+  sbi->s_meta = NULL;
+}
+
+/*
+ * Look up an object in the cache, pinning it if it's there.
+ *
+ * Returns the object (to be released with dummyfs_meta_put), or NULL if
+ * it isn't cached.
+ */
+struct dummyfs_meta *
+dummyfs_meta_get (struct super_block *sb, unsigned int kind,
+                  unsigned long key)
+{
+  struct dummyfs_meta_cache *cache = DUMMYFS_SB (sb)->s_meta;
+  struct dummyfs_meta *m;
+
+  spin_lock (&cache->c_lock);
+  hlist_for_each_entry (m, dummyfs_meta_bucket (cache, kind, key), m_hash)
+  {
+    if (m->m_kind == kind && m->m_key == key)
+      {
+        if (!m->m_pins++)
+          {
+            list_del_init (&m->m_lru);
+            cache->c_count--;
+          }
+        spin_unlock (&cache->c_lock);
+        return m;
+      }
+  }
+  spin_unlock (&cache->c_lock);
+
+  return NULL;
+}
+
+/*
+ * Add an object to the cache (replacing any older copy of it), handing
+ * the decoded data (allocated with kvmalloc or vmalloc) over to the
+ * cache. Older objects are evicted if this takes the cache over its cap.
+ *
+ * Returns the object, pinned, or NULL if there was no memory for it (in
+ * which case the data still belongs to the caller).
+ */
+struct dummyfs_meta *
+dummyfs_meta_insert (struct super_block *sb, unsigned int kind,
+                     unsigned long key, void *data, size_t size)
+{
+  struct dummyfs_meta_cache *cache = DUMMYFS_SB (sb)->s_meta;
+  struct hlist_head *bucket = dummyfs_meta_bucket (cache, kind, key);
+  struct dummyfs_meta *m, *old;
+  LIST_HEAD (dispose);
+
+  m = kmalloc (sizeof (struct dummyfs_meta), GFP_NOFS);
+  if (!m)
+    return NULL;
+  INIT_LIST_HEAD (&m->m_lru);
+  m->m_kind = kind;
+  m->m_key = key;
+  m->m_pins = 1;
+  m->m_size = size;
+  m->m_data = data;
+
+  spin_lock (&cache->c_lock);
+  hlist_for_each_entry (old, bucket, m_hash)
+  {
+    if (old->m_kind == kind && old->m_key == key)
+      {
+        dummyfs_meta_unhash (cache, old, &dispose);
+        break;
+      }
+  }
+  hlist_add_head (&m->m_hash, bucket);
+  cache->c_size += dummyfs_meta_charge (m);
+  dummyfs_meta_evict (cache, 0, &dispose);
+  spin_unlock (&cache->c_lock);
+  dummyfs_meta_dispose (&dispose);
+
+  return m;
+}
+
+/*
+ * Unpin an object. Once nobody is using it, it goes to the front of the
+ * LRU list (or is freed, if it was dropped from the cache meanwhile).
+ */
+void
+dummyfs_meta_put (struct super_block *sb, struct dummyfs_meta *m)
+{
+  struct dummyfs_meta_cache *cache = DUMMYFS_SB (sb)->s_meta;
+  LIST_HEAD (dispose);
+
+  spin_lock (&cache->c_lock);
+  if (!--m->m_pins)
+    {
+      if (hlist_unhashed (&m->m_hash))
+        {
+          list_add (&m->m_lru, &dispose);
+        }
+      else
+        {
+          list_add (&m->m_lru, &cache->c_lru);
+          cache->c_count++;
+          dummyfs_meta_evict (cache, 0, &dispose);
+        }
+    }
+  spin_unlock (&cache->c_lock);
+  dummyfs_meta_dispose (&dispose);
+}
+
+/*
+ * Drop an object from the cache (because what it was decoded from has
+ * changed on disk).
+ */
+void
+dummyfs_meta_forget (struct super_block *sb, unsigned int kind,
+                     unsigned long key)
+{
+  struct dummyfs_meta_cache *cache = DUMMYFS_SB (sb)->s_meta;
+  struct dummyfs_meta *m;
+  LIST_HEAD (dispose);
+
+  spin_lock (&cache->c_lock);
+  hlist_for_each_entry (m, dummyfs_meta_bucket (cache, kind, key), m_hash)
+  {
+    if (m->m_kind == kind && m->m_key == key)
+      {
+        dummyfs_meta_unhash (cache, m, &dispose);
+        break;
+      }
+  }
+  spin_unlock (&cache->c_lock);
+  dummyfs_meta_dispose (&dispose);
+}
@@ -0,0 +1,79 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#ifndef CACHE
+#define CACHE
+
+#include <linux/list.h>
+#include <linux/shrinker.h>
+#include <linux/spinlock.h>
+
+#include "mod.h"
+
+// Kinds of metadata kept in the cache (and what they're keyed by)
+#define META_TABLE 0 // Inode table, by block index
+#define META_INODE 1 // Inode, by inode number
+#define META_DIR 2   // Directory listings, by inode number
+
+#define META_HASH_BITS 8
+#define DEFAULT_META_CACHE_KB 4096
+
+/*
+ * A decoded piece of metadata held in the cache. Objects are pinned while
+ * someone is using them, and only unpinned objects sit on the LRU list
+ * (where they can be evicted). An object replaced or forgotten while it's
+ * pinned is freed once the last user is done with it.
+ */
+struct dummyfs_meta
+{
+  struct hlist_node m_hash;
+  struct list_head m_lru;
+  unsigned int m_kind;
+  unsigned long m_key;
+  int m_pins;
+  size_t m_size; // Size of m_data
+  void *m_data;  // Layout depends on m_kind (see below)
+};
+
+// META_TABLE: an inode table's entries and the next table in the list
+struct dummyfs_table_meta
+{
+  sector_t t_next;
+  __u64 t_table[];
+};
+
+// META_INODE: the inode fields needed without the rest of the block
+struct dummyfs_inode_meta
+{
+  sector_t i_index; // Block holding the inode
+  __u64 i_size;
+  __u16 i_mode;
+  __u8 i_kind;
+  __u8 i_links;
+  __u8 i_flags;
+};
+
+// META_DIR: m_data is the directory's array of dummyfs_dir_listing
+
+struct dummyfs_meta_cache
+{
+  spinlock_t c_lock;
+  struct hlist_head c_hash[1 << META_HASH_BITS];
+  struct list_head c_lru; // Unpinned objects, most recently used first
+  unsigned long c_count;  // Objects on the LRU
+  size_t c_size;          // Memory used by every object in the hash
+  size_t c_max_size;
+  struct shrinker c_shrinker;
+};
+
+int dummyfs_meta_init (struct super_block *, size_t);
+void dummyfs_meta_destroy (struct super_block *);
+struct dummyfs_meta *dummyfs_meta_get (struct super_block *, unsigned int,
+                                       unsigned long);
+struct dummyfs_meta *dummyfs_meta_insert (struct super_block *, unsigned int,
+                                          unsigned long, void *, size_t);
+void dummyfs_meta_put (struct super_block *, struct dummyfs_meta *);
+void dummyfs_meta_forget (struct super_block *, unsigned int, unsigned long);
+
+#endif
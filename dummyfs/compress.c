@@ -0,0 +1,489 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "compress.h"
+#include "logging.h"
+#include "mod.h"
+
+#define FNM "compress"
+
+/*
+ * The data of a compressed file (past its inline data) is kept in
+ * clusters of CLUSTER_BLOCKS blocks' worth, each written as a whole. A
+ * cluster that LZ4 shrinks by at least a block is stored compressed: its
+ * blocks take the first b_index positions of the cluster, the first of
+ * them has BF_COMPRESSED set, and their data holds the length of the
+ * compressed stream followed by the stream itself. Any other cluster is
+ * stored as plain data blocks (leaving out those that would be all
+ * zeros), which read like those of any other file. Reads only decompress
+ * the clusters they touch.
+ *
+ * A cluster is rewritten by writing its new blocks out as a list of their
+ * own, then swapping that in for the cluster's old blocks, which are
+ * freed. A crash part way leaves the old cluster in place.
+ */
+
+// The most blocks in a cluster, on the smallest block size
+#define MAX_CLUSTER_BLOCKS CLUSTER_BLOCKS (MIN_BLOCKSIZE)
+
+/*
+ * Set up the buffers for working on clusters. LZ4's scratch space is only
+ * set up if writing.
+ *
+ * Returns 0 on success, or -ENOMEM.
+ */
+int
+dummyfs_cluster_buf_init (struct super_block *sb,
+                          struct dummyfs_cluster_buf *cb, int writing)
+{
+  unsigned long size = CLUSTER_SIZE (sb);
+
+  cb->c_data = kvmalloc (size, GFP_NOFS);
+  cb->c_packed = kvmalloc (size, GFP_NOFS);
+  cb->c_work = writing ? kvmalloc (LZ4_MEM_COMPRESS, GFP_NOFS) : NULL;
+
+  if (!cb->c_data || !cb->c_packed || (writing && !cb->c_work))
+    {
+      dummyfs_cluster_buf_free (cb);
+      return -ENOMEM;
+    }
+
+  return 0;
+}
+
+void
+dummyfs_cluster_buf_free (struct dummyfs_cluster_buf *cb)
+{
+  kvfree (cb->c_data);
+  kvfree (cb->c_packed);
+  kvfree (cb->c_work);
+  cb->c_data = NULL;
+  cb->c_packed = NULL;
+  cb->c_work = NULL;
+}
+
+/*
+ * Read a compressed cluster, given the buffer of its first block, into
+ * the cluster buffer's data (zero filled past the end of what the
+ * cluster held).
+ *
+ * Returns 0 on success (with the block after the cluster's blocks in
+ * *next), or a negative error.
+ */
+int
+dummyfs_cluster_read (struct super_block *sb, struct buffer_head *head_bh,
+                      struct dummyfs_cluster_buf *cb, sector_t *next)
+{
+  struct dummyfs_block *block = (struct dummyfs_block *)head_bh->b_data;
+  struct buffer_head *bh;
+  unsigned long max_data = DUMMYFS_SB (sb)->s_max_block_data_size;
+  unsigned long size = CLUSTER_SIZE (sb);
+  unsigned long first = block->b_index;
+  unsigned long have;
+  unsigned long total;
+  unsigned long n;
+  sector_t index;
+  __u32 len;
+  int got;
+
+  memcpy (&len, block->b_data, sizeof (len));
+  total = sizeof (len) + (unsigned long)len;
+  if (total > size)
+    {
+      log_info (FNM, "Bad compressed cluster at block %llu.\n",
+                (u64)head_bh->b_blocknr);
+      return -EIO;
+    }
+
+  // Gather the stream from the cluster's blocks, reading them in together
+  have = MIN (max_data, total);
+  memcpy (cb->c_packed, block->b_data, have);
+  index = block->b_next;
+  if (have < total && index == head_bh->b_blocknr + 1)
+    dummyfs_readahead (sb, index, DIV_ROUND_UP (total, max_data) - 1);
+
+  while (have < total)
+    {
+      if (BLOCK_IS_UNALLOCATED (index))
+        return -EIO;
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        return -EIO;
+      if (block->b_index != first + have / max_data)
+        {
+          dummyfs_put_block (bh);
+          return -EIO;
+        }
+
+      n = MIN (max_data, total - have);
+      memcpy (cb->c_packed + have, block->b_data, n);
+      have += n;
+      index = block->b_next;
+      dummyfs_put_block (bh);
+    }
+  *next = index;
+
+  got = LZ4_decompress_safe (cb->c_packed + sizeof (len), cb->c_data, len,
+                             size);
+  if (got < 0)
+    {
+      log_info (FNM, "Bad compressed cluster at block %llu.\n",
+                (u64)head_bh->b_blocknr);
+      return -EIO;
+    }
+  memset (cb->c_data + got, 0, size - got);
+
+  return 0;
+}
+
+/*
+ * Read the first used bytes of a cluster into the (zeroed) cluster
+ * buffer, whether the cluster is compressed or not.
+ *
+ * Returns 0 on success, or a negative error.
+ */
+static int
+dummyfs_cluster_load (struct super_block *sb, struct dummyfs_inode *inode,
+                      unsigned long cluster, struct dummyfs_cluster_buf *cb,
+                      unsigned long used)
+{
+  struct dummyfs_block *block;
+  struct buffer_head *bh;
+  unsigned long max_data = DUMMYFS_SB (sb)->s_max_block_data_size;
+  unsigned long blocks = CLUSTER_BLOCKS (sb->s_blocksize);
+  unsigned long first = cluster * blocks;
+  unsigned long ord;
+  unsigned long k;
+  sector_t index;
+  sector_t next;
+  int err = 0;
+
+  index = dummyfs_find_block (sb, inode, first, &ord);
+  if (BLOCK_IS_UNALLOCATED (index))
+    index = inode->b_next;
+
+  while (!BLOCK_IS_UNALLOCATED (index))
+    {
+      block = dummyfs_get_block (sb, index, &bh);
+      if (!block)
+        return -EIO;
+      if (block->b_index >= first + blocks)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+      index = block->b_next;
+
+      if (block->b_index >= first && BF_IS_COMPRESSED (block->b_flags))
+        {
+          // The cluster's other blocks are all part of the stream
+          err = dummyfs_cluster_read (sb, bh, cb, &next);
+          dummyfs_put_block (bh);
+          break;
+        }
+      if (block->b_index >= first)
+        {
+          k = (block->b_index - first) * max_data;
+          if (k < used)
+            memcpy (cb->c_data + k, block->b_data, MIN (max_data, used - k));
+        }
+      dummyfs_put_block (bh);
+    }
+
+  return err;
+}
+
+/*
+ * Write out the first used bytes of the cluster buffer as a cluster's new
+ * blocks, and swap them into the file's list in place of the cluster's
+ * old ones. The inode is left for the caller to write out.
+ *
+ * Returns 0 on success, or a negative error (with the file as it was).
+ */
+static int
+dummyfs_cluster_store (struct super_block *sb, struct buffer_head *inode_bh,
+                       struct dummyfs_inode *inode, unsigned long cluster,
+                       struct dummyfs_cluster_buf *cb, unsigned long used)
+{
+  struct dummyfs_block *prev = (struct dummyfs_block *)inode;
+  struct dummyfs_block *block;
+  struct buffer_head *bhs[MAX_CLUSTER_BLOCKS];
+  struct buffer_head *prev_bh = inode_bh;
+  struct buffer_head *bh;
+  unsigned char ords[MAX_CLUSTER_BLOCKS];
+  unsigned long max_data = DUMMYFS_SB (sb)->s_max_block_data_size;
+  unsigned long blocks = CLUSTER_BLOCKS (sb->s_blocksize);
+  unsigned long first = cluster * blocks;
+  unsigned long plain = DIV_ROUND_UP (used, max_data);
+  unsigned long packed = 0;
+  unsigned long nr = 0;
+  unsigned long got;
+  unsigned long ord;
+  unsigned long k;
+  unsigned long j;
+  sector_t old = BLOCK_UNALLOCATED;
+  sector_t after;
+  sector_t index;
+  sector_t goal;
+  sector_t run;
+  __u32 len = 0;
+  int n;
+  int err = 0;
+
+  // Compress the cluster, as long as that saves a block
+  if (plain > 1)
+    {
+      n = LZ4_compress_default (cb->c_data, cb->c_packed + sizeof (len),
+                                used, (plain - 1) * max_data - sizeof (len),
+                                cb->c_work);
+      if (n > 0)
+        {
+          len = n;
+          memcpy (cb->c_packed, &len, sizeof (len));
+          packed = DIV_ROUND_UP (sizeof (len) + len, max_data);
+        }
+    }
+
+  // Work out which of the cluster's blocks to write
+  for (k = 0; k < (packed ? packed : plain); k++)
+    {
+      if (!packed
+          && !memchr_inv (cb->c_data + k * max_data, 0,
+                          MIN (max_data, used - k * max_data)))
+        continue;
+      ords[nr++] = k;
+    }
+
+  // Find the block before the cluster, and the cluster's old blocks
+  if (first)
+    {
+      index = dummyfs_find_block (sb, inode, first - 1, &ord);
+      if (!BLOCK_IS_UNALLOCATED (index))
+        {
+          prev = dummyfs_get_block (sb, index, &prev_bh);
+          if (!prev)
+            return -EIO;
+        }
+    }
+
+  after = prev->b_next;
+  while (!BLOCK_IS_UNALLOCATED (after))
+    {
+      block = dummyfs_get_block (sb, after, &bh);
+      if (!block)
+        {
+          err = -EIO;
+          goto out;
+        }
+      if (block->b_index >= first + blocks)
+        {
+          dummyfs_put_block (bh);
+          break;
+        }
+      if (BLOCK_IS_UNALLOCATED (old))
+        old = after;
+      after = block->b_next;
+      dummyfs_put_block (bh);
+    }
+
+  // Claim the new blocks, in runs following on from the block before
+  goal = prev_bh->b_blocknr + 1;
+  for (k = 0; k < nr && !err;)
+    {
+      run = dummyfs_alloc_blocks (sb, goal, nr - k, &got);
+      if (!run)
+        {
+          err = -ENOSPC;
+          break;
+        }
+      for (j = 0; j < got; j++, k++)
+        if (!dummyfs_get_new_block (sb, run + j, &bhs[k]))
+          {
+            dummyfs_free_blocks (sb, run + j, got - j);
+            err = -ENOMEM;
+            break;
+          }
+      goal = run + got;
+    }
+  if (err)
+    {
+      // Nothing points at them yet, so they can just be given back
+      while (k--)
+        {
+          dummyfs_free_blocks (sb, bhs[k]->b_blocknr, 1);
+          dummyfs_put_block (bhs[k]);
+        }
+      goto out;
+    }
+
+  for (k = 0; k < nr; k++)
+    {
+      block = (struct dummyfs_block *)bhs[k]->b_data;
+      block->b_mode = BM_DATA;
+      block->b_index = first + ords[k];
+      block->b_next = (k + 1 < nr) ? bhs[k + 1]->b_blocknr : after;
+      if (packed)
+        {
+          j = k * max_data;
+          memcpy (block->b_data, cb->c_packed + j,
+                  MIN (max_data, sizeof (len) + len - j));
+        }
+      else
+        {
+          j = ords[k] * max_data;
+          memcpy (block->b_data, cb->c_data + j, MIN (max_data, used - j));
+        }
+      if (packed && !k)
+        block->b_flags = BF_COMPRESSED;
+      mark_buffer_dirty (bhs[k]);
+    }
+
+  // The new blocks are on disk before anything points at them
+  if (nr)
+    {
+      err = dummyfs_write_blocks (sb, bhs, nr);
+      if (err)
+        {
+          for (k = 0; k < nr; k++)
+            {
+              dummyfs_free_blocks (sb, bhs[k]->b_blocknr, 1);
+              dummyfs_put_block (bhs[k]);
+            }
+          goto out;
+        }
+    }
+
+  prev->b_next = nr ? bhs[0]->b_blocknr : after;
+  if (prev_bh != inode_bh)
+    dummyfs_dirty_block (sb, prev_bh);
+
+  // The tail may have been among the old blocks, or be before the new ones
+  if (!BLOCK_IS_UNALLOCATED (inode->i_tail) && inode->i_tail_index >= first
+      && inode->i_tail_index < first + blocks)
+    {
+      inode->i_tail = BLOCK_UNALLOCATED;
+      inode->i_tail_index = 0;
+      if (prev_bh != inode_bh)
+        {
+          inode->i_tail = prev_bh->b_blocknr;
+          inode->i_tail_index = prev->b_index;
+        }
+    }
+  if (nr
+      && (BLOCK_IS_UNALLOCATED (inode->i_tail)
+          || inode->i_tail_index < first + ords[nr - 1]))
+    {
+      inode->i_tail = bhs[nr - 1]->b_blocknr;
+      inode->i_tail_index = first + ords[nr - 1];
+    }
+
+  for (k = 0; k < nr; k++)
+    dummyfs_put_block (bhs[k]);
+
+  if (!BLOCK_IS_UNALLOCATED (old))
+    dummyfs_dealloc_until (sb, old, after);
+
+out:
+  if (prev_bh != inode_bh)
+    dummyfs_put_block (prev_bh);
+  return err;
+}
+
+/*
+ * Write count bytes from an iov_iter (or zeros, if from is NULL) into a
+ * compressed file at pos (which is past the inline data), a cluster at a
+ * time. The parts of a cluster the write doesn't cover are read in
+ * first. The caller updates the size of the file, and writes out the
+ * inode.
+ *
+ * Returns the amount written, or a negative error if nothing could be.
+ */
+ssize_t
+dummyfs_compress_write (struct super_block *sb, struct buffer_head *inode_bh,
+                        struct dummyfs_inode *inode, loff_t pos, size_t count,
+                        struct iov_iter *from)
+{
+  struct dummyfs_cluster_buf cb;
+  unsigned long inline_size = DUMMYFS_SB (sb)->s_max_inode_data_size;
+  unsigned long size = CLUSTER_SIZE (sb);
+  unsigned long cluster;
+  unsigned long off;
+  unsigned long old;
+  unsigned long used;
+  unsigned long n;
+  size_t copied;
+  size_t done = 0;
+  loff_t start;
+  int err;
+
+  // The block before the first cluster gets relinked, so can't be shared
+  err = dummyfs_unshare_data (sb, inode_bh, inode,
+                              (pos - inline_size) / size
+                                  * CLUSTER_BLOCKS (sb->s_blocksize));
+  if (err)
+    return err;
+
+  err = dummyfs_cluster_buf_init (sb, &cb, true);
+  if (err)
+    return err;
+
+  while (done < count)
+    {
+      cluster = (pos + done - inline_size) / size;
+      off = (pos + done - inline_size) % size;
+      start = inline_size + (loff_t)cluster * size;
+      n = MIN (size - off, count - done);
+
+      // Start from what the cluster holds, unless it's all being replaced
+      old = 0;
+      if (inode->i_size > start)
+        old = MIN ((loff_t)size, (loff_t)inode->i_size - start);
+      memset (cb.c_data, 0, size);
+      if (old && (off || off + n < old))
+        {
+          err = dummyfs_cluster_load (sb, inode, cluster, &cb, old);
+          if (err)
+            break;
+        }
+
+      copied = n;
+      if (from)
+        copied = copy_from_iter (cb.c_data + off, n, from);
+      else
+        memset (cb.c_data + off, 0, n);
+      if (!copied)
+        {
+          err = -EFAULT;
+          break;
+        }
+
+      // Zeros up to the end of the data are left off (e.g.: truncating)
+      used = MAX (old, off + copied);
+      if (!from && off + copied >= old)
+        used = off;
+
+      err = dummyfs_cluster_store (sb, inode_bh, inode, cluster, &cb, used);
+      if (err)
+        break;
+      done += copied;
+      if (copied != n)
+        {
+          err = -EFAULT;
+          break;
+        }
+    }
+
+  dummyfs_cluster_buf_free (&cb);
+  return done ? done : err;
+}
@@ -0,0 +1,37 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#ifndef COMPRESS
+#define COMPRESS
+
+#include <linux/uio.h>
+
+#include "mod.h"
+
+// Bytes of file data a cluster holds
+#define CLUSTER_SIZE(sb)                                                      \
+  (CLUSTER_BLOCKS ((sb)->s_blocksize)                                         \
+   * DUMMYFS_SB (sb)->s_max_block_data_size)
+
+/*
+ * Room to work on one cluster at a time: its data, its compressed form,
+ * and LZ4's scratch space (only needed for compressing).
+ */
+struct dummyfs_cluster_buf
+{
+  char *c_data;
+  char *c_packed;
+  void *c_work;
+};
+
+int dummyfs_cluster_buf_init (struct super_block *,
+                              struct dummyfs_cluster_buf *, int);
+void dummyfs_cluster_buf_free (struct dummyfs_cluster_buf *);
+int dummyfs_cluster_read (struct super_block *, struct buffer_head *,
+                          struct dummyfs_cluster_buf *, sector_t *);
+ssize_t dummyfs_compress_write (struct super_block *, struct buffer_head *,
+                                struct dummyfs_inode *, loff_t, size_t,
+                                struct iov_iter *);
+
+#endif
@@ -5,16 +5,84 @@
  */
 
 #include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/fiemap.h>
+#include <linux/falloc.h>
+#include <linux/mount.h>
+#include <linux/pagemap.h>
+#include <linux/parser.h>
+#include <linux/slab.h>
 #include <linux/statfs.h>
-#include <linux/version.h>
+#include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/writeback.h>
 
+#include "alloc.h"
 #include "block.h"
+#include "cache.h"
 #include "inode.h"
+#include "journal.h"
 #include "logging.h"
 #include "mod.h"
 
 #define FNM "inode"
 
+/*
+ * Get a directory's listings from the metadata cache, mapping them in
+ * from the device (and caching them) if they aren't there.
+ *
+ * Returns the listings, pinned (release them with dummyfs_meta_put), or
+ * NULL if they couldn't be read.
+ */
+static struct dummyfs_meta *
+dummyfs_get_listings (struct inode *dir)
+{
+  struct super_block *sb = dir->i_sb;
+  struct dummyfs_inode *dir_data;
+  struct dummyfs_meta *m;
+  struct buffer_head *bh;
+  unsigned char *listings = NULL;
+  size_t size;
+
+  m = dummyfs_meta_get (sb, META_DIR, dir->i_ino);
+  if (m)
+    return m;
+
+  dir_data = dummyfs_get_inode (sb, dir->i_ino, &bh);
+  if (!dir_data)
+    return NULL;
+  size = dir_data->i_size;
+  if (size)
+    listings = dummyfs_map_data (sb, dir_data, 0);
+  dummyfs_put_block (bh);
+  if (size && !listings)
+    return NULL;
+
+  m = dummyfs_meta_insert (sb, META_DIR, dir->i_ino, listings, size);
+  if (!m)
+    vfree (listings);
+  return m;
+}
+
+/*
+ * Hand a directory's freshly written listings over to the metadata cache
+ * (which frees them when they're evicted), replacing the old ones.
+ */
+static void
+dummyfs_cache_listings (struct inode *dir, unsigned char *listings,
+                        size_t size)
+{
+  struct dummyfs_meta *m;
+
+  m = dummyfs_meta_insert (dir->i_sb, META_DIR, dir->i_ino, listings, size);
+  if (!m)
+    {
+      vfree (listings);
+      return;
+    }
+  dummyfs_meta_put (dir->i_sb, m);
+}
+
 /*
  * Create an inode in a directory.
  *
@@ -24,11 +92,14 @@ int
 dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
                 unsigned short inode_mode)
 {
-  struct dummyfs_inode dir_data;
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *dir_data;
+  struct buffer_head *bh;
   int num_listings;
   struct dummyfs_dir_listing *listing;
   struct inode *inode;
   unsigned char *listings;
+  int err = 0;
 
   log_info (FNM, "create -> %s", dentry->d_name.name);
 
@@ -36,6 +107,12 @@ dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
   if (!mode)
     mode = S_IRUGO | S_IWUGO;
 
+  // Make sure we've got a directory to put this in
+  if (!dir)
+    return -1;
+
+  dummyfs_journal_start (dir->i_sb, &handle);
+
   /*
    * Create a dummyfs inode on disk and instantiate a corresponding
    * VFS inode, making sure to create the right kind (dir or
@@ -46,7 +123,10 @@ dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
   else
     inode = dummyfs_new_inode (dir, mode | S_IFREG, inode_mode);
   if (!inode)
-    return -ENOSPC;
+    {
+      err = -ENOSPC;
+      goto out;
+    }
   if (IM_IS_DIR (inode_mode))
     {
       inode->i_op = &dummyfs_dir_inode_operations;
@@ -57,12 +137,16 @@ dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
     {
       inode->i_op = &dummyfs_file_inode_operations;
       inode->i_fop = &dummyfs_file_operations;
+      inode->i_mapping->a_ops = &dummyfs_file_aops;
       inode->i_mode = mode;
     }
 
-  // Make sure we've got a directory to put this in
-  if (!dir)
-    return -1;
+  dir_data = dummyfs_get_inode (dir->i_sb, dir->i_ino, &bh);
+  if (!dir_data)
+    {
+      err = -EIO;
+      goto out;
+    }
 
   /*
    * dummyfs stores dentries as a dir_listing, which is just a name/inode
@@ -70,9 +154,8 @@ dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
    * we'll need to map the directory's existing data (listings) into memory,
    * and append a new name/inode number pair onto the end.
    */
-  dummyfs_read_inode (dir->i_sb, dir->i_ino, &dir_data);
-  num_listings = dir_data.i_size / sizeof (struct dummyfs_dir_listing);
-  listings = dummyfs_map_data (dir->i_sb, &dir_data,
+  num_listings = dir_data->i_size / sizeof (struct dummyfs_dir_listing);
+  listings = dummyfs_map_data (dir->i_sb, dir_data,
                                sizeof (struct dummyfs_dir_listing));
   listing
       = (struct dummyfs_dir_listing *)(listings
@@ -87,170 +170,1163 @@ dummyfs_create (struct inode *dir, struct dentry *dentry, umode_t mode,
   strncpy (listing->l_name, dentry->d_name.name, dentry->d_name.len);
   listing->l_name[dentry->d_name.len] = '\0';
   listing->l_ino = inode->i_ino;
-  dummyfs_write_data (dir->i_sb, &dir_data, listings,
+  dummyfs_write_data (dir->i_sb, bh, dir_data, listings,
                       (num_listings + 1)
                           * sizeof (struct dummyfs_dir_listing));
 
   // Update the directory's VFS inode and clean up
-  dir->i_size = dir_data.i_size;
+  dir->i_size = dir_data->i_size;
   mark_inode_dirty (dir);
-  vfree (listings);              // Free the listings from memory
+  dummyfs_cache_listings (dir, listings, dir_data->i_size);
+  dummyfs_put_block (bh);
   d_instantiate (dentry, inode); // Couple the VFS dentry with the VFS inode
 
   log_info (FNM, "file created -> %ld", inode->i_ino);
+
+out:
+  dummyfs_journal_stop (&handle);
+  return err;
+}
+
+/*
+ * Read a page of a file in from its data blocks, with the page locked.
+ * Anything past the end of the file on disk (which may be behind the file's
+ * size, while pages that grew it are waiting to be written back) reads as
+ * zeros.
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_fill_page (struct file *filp, struct page *page)
+{
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct inode *inode = page->mapping->host;
+  struct super_block *sb = inode->i_sb;
+  struct bio_vec bv = { .bv_page = page, .bv_len = PAGE_SIZE };
+  struct iov_iter iter;
+  ssize_t n;
+
+  iov_iter_bvec (&iter, READ, &bv, 1, PAGE_SIZE);
+
+  down_read (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (!file_data)
+    {
+      up_read (&DUMMYFS_I (inode)->i_chain_sem);
+      return -EIO;
+    }
+  n = dummyfs_read_data (sb, file_data, page_offset (page), &iter,
+                         filp ? filp->private_data : NULL);
+  dummyfs_put_block (bh);
+  up_read (&DUMMYFS_I (inode)->i_chain_sem);
+  if (n < 0)
+    return n;
+
+  zero_user_segment (page, n, PAGE_SIZE);
   return 0;
 }
 
 /*
- * Write to a file.
+ * Read a page of a file into the page cache (for page faults on mapped
+ * files and for buffered reads alike). The open file's read state lets
+ * the pages of a sequential read carry on down the linked list of data
+ * blocks, and read ahead of themselves.
  *
- * Returns the size of the write.
+ * Returns 0 on success.
+ */
+int
+dummyfs_readpage (struct file *filp, struct page *page)
+{
+  int err;
+
+  log_info (FNM, "readpage, ino -> %lu, index -> %lu",
+            page->mapping->host->i_ino, page->index);
+
+  err = dummyfs_fill_page (filp, page);
+  if (err)
+    SetPageError (page);
+  else
+    SetPageUptodate (page);
+  unlock_page (page);
+
+  return err;
+}
+
+/*
+ * Write out a run of consecutive pages of a file (already under writeback
+ * and unlocked) to its data blocks in one go, ending their writeback.
+ * Only the part of the run inside the file is written, so the file grows
+ * on disk to cover the pages as they're written.
  *
- * Works by reading in an inode and appending a series
- * of bytes (from userspace) to its data field.  */
-ssize_t
-dummyfs_file_write (struct file *filp, const char *buf, size_t count,
-                    loff_t *ppos)
+ * Returns 0 on success.
+ */
+static int
+dummyfs_write_pages (struct inode *inode, struct bio_vec *bvs,
+                     unsigned int nr)
 {
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct super_block *sb = inode->i_sb;
+  struct iov_iter iter;
+  loff_t pos = page_offset (bvs[0].bv_page);
+  loff_t size;
+  size_t len;
+  ssize_t n;
+  unsigned int k;
+  int err = 0;
+
+  // Read the size under the lock, so a truncate can't be undone
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (inode)->i_chain_sem);
+  size = i_size_read (inode);
+  if (pos < size)
+    {
+      len = MIN ((loff_t)nr * PAGE_SIZE, size - pos);
+      iov_iter_bvec (&iter, WRITE, bvs, nr, len);
+      file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+      if (!file_data)
+        {
+          err = -EIO;
+        }
+      else
+        {
+          n = dummyfs_write_range (sb, bh, file_data, pos, &iter);
+          if (n < 0)
+            err = n;
+          else if ((size_t)n < len)
+            err = -ENOSPC;
+          dummyfs_put_block (bh);
+        }
+    }
+  up_write (&DUMMYFS_I (inode)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
 
-  struct dummyfs_inode file_data; // dir_data;
-  struct inode *inode = filp->f_path.dentry->d_inode;
-  unsigned char *data;
-  // struct inode * dir = filp->f_path.dentry->d_parent->d_inode;
-  ssize_t pos;
-  unsigned long extra;
-  struct super_block *sb;
+  log_info (FNM, "wrote %u pages at %lld -> %d", nr, pos, err);
 
-  log_info (FNM, "file write, count -> %zu, ppos -> %Ld", count, *ppos);
+  for (k = 0; k < nr; k++)
+    {
+      if (err)
+        SetPageError (bvs[k].bv_page);
+      end_page_writeback (bvs[k].bv_page);
+    }
+  if (err)
+    mapping_set_error (inode->i_mapping, err);
 
-  /*
-   * These error checks ensure no shenanigans (writing beyond the end/beginning
-   * of a file, writing directly to a directory's data, et cetera) are about to
-   * happen.
-   */
-  if (!inode)
+  return err;
+}
+
+/*
+ * Write a single dirty page of a file back to its data blocks.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_writepage (struct page *page, struct writeback_control *wbc)
+{
+  struct bio_vec bv = { .bv_page = page, .bv_len = PAGE_SIZE };
+
+  set_page_writeback (page);
+  unlock_page (page);
+
+  return dummyfs_write_pages (page->mapping->host, &bv, 1);
+}
+
+// Dirty pages gathered up by dummyfs_writepages
+struct dummyfs_wb_batch
+{
+  struct bio_vec *w_bvs;
+  unsigned int w_nr;
+  int w_err;
+};
+
+static int
+dummyfs_writepages_add (struct page *page, struct writeback_control *wbc,
+                        void *data)
+{
+  struct dummyfs_wb_batch *batch = data;
+  struct inode *inode = page->mapping->host;
+  int err;
+
+  // Write out what's been gathered if this page doesn't carry it on
+  if (batch->w_nr
+      && (batch->w_nr == MAX_BATCH_BLOCKS
+          || batch->w_bvs[batch->w_nr - 1].bv_page->index + 1 != page->index))
     {
-      log_info (FNM, "problem with file inode");
-      return -EINVAL;
+      err = dummyfs_write_pages (inode, batch->w_bvs, batch->w_nr);
+      if (err && !batch->w_err)
+        batch->w_err = err;
+      batch->w_nr = 0;
     }
-  if (!(S_ISREG (inode->i_mode)))
+
+  set_page_writeback (page);
+  unlock_page (page);
+  batch->w_bvs[batch->w_nr].bv_page = page;
+  batch->w_bvs[batch->w_nr].bv_len = PAGE_SIZE;
+  batch->w_bvs[batch->w_nr].bv_offset = 0;
+  batch->w_nr++;
+
+  return 0;
+}
+
+/*
+ * Write back the dirty pages of a file, gathering up runs of consecutive
+ * pages so that each run is written through the linked list of data
+ * blocks (and its blocks allocated) in one pass, rather than a page at a
+ * time.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_writepages (struct address_space *mapping,
+                    struct writeback_control *wbc)
+{
+  struct dummyfs_wb_batch batch = { 0 };
+  int err;
+  int ret;
+
+  batch.w_bvs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct bio_vec),
+                               GFP_NOFS);
+  if (!batch.w_bvs)
+    return -ENOMEM;
+
+  err = write_cache_pages (mapping, wbc, dummyfs_writepages_add, &batch);
+  if (batch.w_nr)
     {
-      log_info (FNM, "not regular file");
-      return -EINVAL;
+      ret = dummyfs_write_pages (mapping->host, batch.w_bvs, batch.w_nr);
+      if (ret && !batch.w_err)
+        batch.w_err = ret;
+    }
+  kfree (batch.w_bvs);
+
+  return err ? err : batch.w_err;
+}
+
+/*
+ * Get a page of a file ready for a buffered write, reading it in first
+ * unless the write covers all of it.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_write_begin (struct file *filp, struct address_space *mapping,
+                     loff_t pos, unsigned len, unsigned flags,
+                     struct page **pagep, void **fsdata)
+{
+  struct page *page;
+  int err;
+
+  page = grab_cache_page_write_begin (mapping, pos >> PAGE_SHIFT, flags);
+  if (!page)
+    return -ENOMEM;
+
+  if (!PageUptodate (page) && len != PAGE_SIZE)
+    {
+      err = dummyfs_fill_page (filp, page);
+      if (err)
+        {
+          unlock_page (page);
+          put_page (page);
+          return err;
+        }
+      SetPageUptodate (page);
+    }
+
+  *pagep = page;
+  return 0;
+}
+
+/*
+ * Finish a buffered write into a page, growing the file if the write went
+ * past its end. The data reaches the disk when the page is written back.
+ *
+ * Returns the amount of the write that was taken.
+ */
+int
+dummyfs_write_end (struct file *filp, struct address_space *mapping,
+                   loff_t pos, unsigned len, unsigned copied,
+                   struct page *page, void *fsdata)
+{
+  struct inode *inode = mapping->host;
+
+  if (!PageUptodate (page))
+    {
+      // The page wasn't read in, so a short copy has to be tried again
+      if (copied < len)
+        {
+          copied = 0;
+          goto out;
+        }
+      SetPageUptodate (page);
     }
-  if (*ppos > inode->i_size || count <= 0)
+
+  if (pos + copied > inode->i_size)
     {
-      log_info (FNM, "attempting to write over the end of a file");
-      return 0;
+      i_size_write (inode, pos + copied);
+      mark_inode_dirty (inode);
     }
+  set_page_dirty (page);
 
-  // Read the inode block in
-  sb = inode->i_sb;
-  dummyfs_read_inode (sb, inode->i_ino, &file_data);
+out:
+  unlock_page (page);
+  put_page (page);
 
-  // If we're appending, move our start position to the end of the file
-  if (filp->f_flags & O_APPEND)
-    pos = inode->i_size;
-  else // Otherwise, put it where it's been specified
-    pos = *ppos;
+  return copied;
+}
+
+/*
+ * Read into or write from a run of pages for O_DIRECT, with the file's
+ * list of data blocks locked.
+ *
+ * Returns the amount read or written.
+ */
+static ssize_t
+dummyfs_direct_pages (struct kiocb *iocb, struct iov_iter *iter, loff_t pos)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct file *filp = iocb->ki_filp;
+  struct inode *inode = filp->f_mapping->host;
+  struct super_block *sb = inode->i_sb;
+  int write = (iov_iter_rw (iter) == WRITE);
+  ssize_t ret;
+
+  if (write)
+    {
+      dummyfs_journal_start (sb, &handle);
+      down_write (&DUMMYFS_I (inode)->i_chain_sem);
+    }
+  else
+    down_read (&DUMMYFS_I (inode)->i_chain_sem);
+
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (!file_data)
+    {
+      ret = -EIO;
+      goto out;
+    }
 
   /*
-   * If the file is about to grow beyond its original size, work
-   * out how much it will grow by (so that we can have some padding
-   * to write the extra data to when we map the data blocks to memory)
+   * Reads stop at the end of the file on disk, which the VFS finishes off
+   * through the page cache if there are pages past it yet to be written.
    */
-  extra = ((pos + count) <= file_data.i_size)
-              ? 0
-              : ((pos + count) - file_data.i_size);
-
-  // Map the file data to memory and copy the data from userspace to that
-  // memory
-  data = dummyfs_map_data (sb, &file_data, extra);
-  if (copy_from_user (data + pos, buf, count)) // Append to the file
-    return -ENOSPC;
-  *ppos = pos;
-  buf += count;
+  if (write)
+    ret = dummyfs_write_range (sb, bh, file_data, pos, iter);
+  else
+    ret = dummyfs_read_data (sb, file_data, pos, iter, filp->private_data);
+  dummyfs_put_block (bh);
 
-  // Write the inode + data blocks back out to the device
-  dummyfs_write_data (sb, &file_data, data, file_data.i_size + extra);
-  inode->i_size = file_data.i_size;
-  mark_inode_dirty (inode);
+out:
+  if (write)
+    {
+      up_write (&DUMMYFS_I (inode)->i_chain_sem);
+      dummyfs_journal_stop (&handle);
+    }
+  else
+    up_read (&DUMMYFS_I (inode)->i_chain_sem);
 
-  vfree (data); // Free the data from memory
+  return ret;
+}
 
-  log_info (FNM, "file write, done -> %zu, ppos -> %Ld", count, *ppos);
+/*
+ * Read or write part of a file for O_DIRECT, going straight between the
+ * caller's pages and the file's data blocks rather than through the page
+ * cache (which generic_file_read_iter and generic_file_write_iter flush
+ * and invalidate around the range beforehand). Data blocks carry a header
+ * in front of their data, so file data can't be transferred to or from
+ * the device in place: it's copied once, between the pages and the
+ * buffers of the blocks, and written blocks go out before the write
+ * returns.
+ *
+ * Userspace pages are pinned a batch at a time before the file is
+ * locked, so that a buffer mapped from the file itself can't fault while
+ * the lock is held.
+ *
+ * Blocks are read and written synchronously, so direct I/O can never
+ * be done without waiting, and I/O that mustn't wait (IOCB_NOWAIT) is
+ * turned away with -EAGAIN to be retried from somewhere that can block.
+ *
+ * Returns the amount read or written.
+ */
+ssize_t
+dummyfs_direct_IO (struct kiocb *iocb, struct iov_iter *iter)
+{
+  struct page **pages;
+  struct bio_vec *bvs;
+  struct iov_iter batch;
+  loff_t pos = iocb->ki_pos;
+  size_t start;
+  size_t len;
+  size_t done = 0;
+  ssize_t n;
+  unsigned int nr;
+  unsigned int k;
+  int write = (iov_iter_rw (iter) == WRITE);
+  int err = 0;
+
+  log_info (FNM, "direct %s, count -> %zu, pos -> %Ld",
+            write ? "write" : "read", iov_iter_count (iter), pos);
+
+  if (iocb->ki_flags & IOCB_NOWAIT)
+    return -EAGAIN;
+
+  // Kernel buffers can't fault, so they're used as they are
+  if (!iter_is_iovec (iter))
+    return dummyfs_direct_pages (iocb, iter, pos);
+
+  pages = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct page *),
+                         GFP_KERNEL);
+  bvs = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (struct bio_vec),
+                       GFP_KERNEL);
+  if (!pages || !bvs)
+    {
+      err = -ENOMEM;
+      goto out;
+    }
+
+  while (iov_iter_count (iter))
+    {
+      n = iov_iter_get_pages (iter, pages, iov_iter_count (iter),
+                              MAX_BATCH_BLOCKS, &start);
+      if (n <= 0)
+        {
+          err = n ? n : -EFAULT;
+          break;
+        }
 
-  return count;
+      nr = DIV_ROUND_UP (start + n, PAGE_SIZE);
+      len = n;
+      for (k = 0; k < nr; k++)
+        {
+          bvs[k].bv_page = pages[k];
+          bvs[k].bv_offset = k ? 0 : start;
+          bvs[k].bv_len = MIN (len, PAGE_SIZE - bvs[k].bv_offset);
+          len -= bvs[k].bv_len;
+        }
+      iov_iter_bvec (&batch, iov_iter_rw (iter), bvs, nr, n);
+
+      len = n;
+      n = dummyfs_direct_pages (iocb, &batch, pos + done);
+
+      for (k = 0; k < nr; k++)
+        {
+          if (!write && n > 0)
+            set_page_dirty_lock (pages[k]);
+          put_page (pages[k]);
+        }
+      if (n <= 0)
+        {
+          err = n;
+          break;
+        }
+      iov_iter_advance (iter, n);
+      done += n;
+      if ((size_t)n < len)
+        break; // End of the file, or out of space
+    }
+
+out:
+  kfree (pages);
+  kfree (bvs);
+
+  log_info (FNM, "done direct %s -> %zu (%d)", write ? "write" : "read", done,
+            err);
+
+  return done ? done : err;
 }
 
 /*
- * Read data from a file.
+ * Read from a regular file. A read that mustn't wait (from io_uring, or
+ * preadv2 with RWF_NOWAIT) is only served from the page cache: it's
+ * cut short where the cache runs out, or fails with -EAGAIN if nothing
+ * at all is cached, rather than reading blocks from the submitter.
  *
- * Returns the size of the read.
+ * Returns the amount read.
  */
 ssize_t
-dummyfs_file_read (struct file *filp, char *buf, size_t count, loff_t *ppos)
+dummyfs_file_read_iter (struct kiocb *iocb, struct iov_iter *to)
 {
+  if ((iocb->ki_flags & IOCB_NOWAIT) && !(iocb->ki_flags & IOCB_DIRECT))
+    iocb->ki_flags |= IOCB_NOIO;
 
-  struct dummyfs_inode file_data;
+  return generic_file_read_iter (iocb, to);
+}
+
+/*
+ * Write to a regular file. A write that mustn't wait fails with -EAGAIN
+ * here, before it can block on the inode lock: a direct write writes its
+ * blocks synchronously (see dummyfs_direct_IO), and a buffered one may
+ * have to read in or allocate blocks.
+ *
+ * Returns the amount written.
+ */
+ssize_t
+dummyfs_file_write_iter (struct kiocb *iocb, struct iov_iter *from)
+{
+  if (iocb->ki_flags & IOCB_NOWAIT)
+    return -EAGAIN;
+
+  return generic_file_write_iter (iocb, from);
+}
+
+/*
+ * Open a file, setting up the state used to follow sequential reads.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_file_open (struct inode *inode, struct file *filp)
+{
+  struct dummyfs_read_state *rs;
+
+  rs = kzalloc (sizeof (struct dummyfs_read_state), GFP_KERNEL);
+  if (!rs)
+    return -ENOMEM;
+  spin_lock_init (&rs->r_lock);
+  rs->r_cursor_block = BLOCK_UNALLOCATED;
+  filp->private_data = rs;
+
+  // I/O with IOCB_NOWAIT is honoured (see dummyfs_file_read_iter)
+  filp->f_mode |= FMODE_NOWAIT;
+
+  return 0;
+}
+
+/*
+ * Release a file, freeing its read state.
+ *
+ * Returns 0.
+ */
+int
+dummyfs_file_release (struct inode *inode, struct file *filp)
+{
+  kfree (filp->private_data);
+  return 0;
+}
+
+/*
+ * Preallocate space for a file (growing it too, unless FALLOC_FL_KEEP_SIZE
+ * is given), or punch a hole in it with FALLOC_FL_PUNCH_HOLE.
+ *
+ * Returns 0 on success.
+ */
+long
+dummyfs_fallocate (struct file *filp, int mode, loff_t offset, loff_t len)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
   struct inode *inode = filp->f_path.dentry->d_inode;
-  unsigned char *data;
-  ssize_t offset, size;
-  struct super_block *sb;
+  struct super_block *sb = inode->i_sb;
+  long err;
 
-  log_info (FNM, "file read, count -> %zu, ppos -> %Ld", count, *ppos);
+  log_info (FNM, "fallocate, mode -> %d, range -> %Ld+%Ld", mode, offset,
+            len);
 
-  /*
-   * These error checks ensure no shenanigans (reading beyond the end/beginning
-   * of a file, reading a directory's data directly, et cetera) are about to
-   * happen.
-   */
-  if (!inode)
+  if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+    return -EOPNOTSUPP;
+  if (!(S_ISREG (inode->i_mode)))
+    return -EINVAL;
+
+  inode_lock (inode);
+
+  // Get any dirty pages in a hole out of the way before it's punched
+  if (mode & FALLOC_FL_PUNCH_HOLE)
     {
-      log_info (FNM, "problem with file inode");
-      return -EINVAL;
+      err = filemap_write_and_wait_range (inode->i_mapping, offset,
+                                          offset + len - 1);
+      if (err)
+        goto out;
+      truncate_pagecache_range (inode, offset, offset + len - 1);
     }
 
-  if (!(S_ISREG (inode->i_mode)))
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (!file_data)
     {
-      log_info (FNM, "not regular file");
-      return -EINVAL;
+      up_write (&DUMMYFS_I (inode)->i_chain_sem);
+      dummyfs_journal_stop (&handle);
+      err = -EIO;
+      goto out;
     }
-  if (*ppos > inode->i_size || count <= 0)
+
+  if (mode & FALLOC_FL_PUNCH_HOLE)
+    err = dummyfs_punch_data (sb, bh, file_data, offset, offset + len);
+  else
+    err = dummyfs_prealloc_data (sb, bh, file_data, offset, offset + len,
+                                 mode & FALLOC_FL_KEEP_SIZE);
+
+  // The file may be bigger in the page cache than on disk, never smaller
+  if (file_data->i_size > inode->i_size)
+    i_size_write (inode, file_data->i_size);
+  inode->i_ctime = inode->i_mtime = current_time (inode);
+  mark_inode_dirty (inode);
+  dummyfs_put_block (bh);
+  up_write (&DUMMYFS_I (inode)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
+
+out:
+  inode_unlock (inode);
+
+  log_info (FNM, "done fallocate -> %ld", err);
+
+  return err;
+}
+
+/*
+ * Get a file's dirty pages, and everything else done to it, onto the
+ * disk. With a journal that means committing the running transaction
+ * (along with whatever other operations have joined it meanwhile).
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_fsync (struct file *filp, loff_t start, loff_t end, int datasync)
+{
+  struct super_block *sb = filp->f_mapping->host->i_sb;
+  int err;
+
+  log_info (FNM, "fsync, range -> %Ld-%Ld", start, end);
+
+  if (!DUMMYFS_SB (sb)->s_log)
+    return generic_file_fsync (filp, start, end, datasync);
+
+  err = file_write_and_wait_range (filp, start, end);
+  if (err)
+    return err;
+
+  return dummyfs_journal_commit (sb);
+}
+
+/*
+ * Change a file's attributes, truncating (or growing) its data on disk if
+ * its size is changing.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_setattr (struct dentry *dentry, struct iattr *attr)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct inode *inode = d_inode (dentry);
+  struct super_block *sb = inode->i_sb;
+  loff_t old_size = inode->i_size;
+  int err;
+
+  log_info (FNM, "setattr, valid -> %u", attr->ia_valid);
+
+  err = setattr_prepare (dentry, attr);
+  if (err)
+    return err;
+
+  if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != inode->i_size)
     {
-      log_info (FNM, "attempting to read beyond the start/end of a file");
-      return 0;
+      if (!(S_ISREG (inode->i_mode)))
+        return -EINVAL;
+
+      /*
+       * The inode lock is already held by whoever is changing the size.
+       * The page cache goes first, so no page past the new end can be
+       * written back over the truncated blocks. If the truncate fails,
+       * the size goes back to what the disk still says it is.
+       */
+      truncate_setsize (inode, attr->ia_size);
+      dummyfs_journal_start (sb, &handle);
+      down_write (&DUMMYFS_I (inode)->i_chain_sem);
+      file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+      if (file_data)
+        {
+          err = dummyfs_truncate_data (sb, bh, file_data, attr->ia_size);
+          if (err)
+            i_size_write (inode, file_data->i_size);
+          dummyfs_put_block (bh);
+        }
+      else
+        {
+          err = -EIO;
+          i_size_write (inode, old_size);
+        }
+      up_write (&DUMMYFS_I (inode)->i_chain_sem);
+      dummyfs_journal_stop (&handle);
+      if (err)
+        return err;
     }
 
-  // Map the data to memory (refer to dummyfs_file_write for an explanation of
-  // how dummyfs stores data as linked lists)
-  sb = inode->i_sb;
-  dummyfs_read_inode (sb, inode->i_ino, &file_data);
-  data = dummyfs_map_data (sb, &file_data, 0);
+  setattr_copy (inode, attr);
+  mark_inode_dirty (inode);
 
-  size = MIN (inode->i_size - *ppos,
-              count); // Ensure we only read up to end of file, not past it
+  return 0;
+}
 
-  offset = *ppos;
-  *ppos += size;
+/*
+ * Move a file's data blocks into one run (DUMMYFS_IOC_DEFRAG). The file
+ * has to be open for writing, but stays usable throughout: the move only
+ * holds off other users of the file's list of blocks while it's done.
+ *
+ * Returns the number of blocks moved.
+ */
+static long
+dummyfs_ioctl_defrag (struct file *filp)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct inode *inode = file_inode (filp);
+  struct super_block *sb = inode->i_sb;
+  long ret;
+
+  if (!S_ISREG (inode->i_mode))
+    return -EINVAL;
+  if (!(filp->f_mode & FMODE_WRITE))
+    return -EBADF;
+
+  ret = mnt_want_write_file (filp);
+  if (ret)
+    return ret;
+  inode_lock (inode);
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (file_data)
+    {
+      ret = dummyfs_defrag_data (sb, file_data);
+      if (ret > 0)
+        dummyfs_dirty_block (sb, bh);
+      dummyfs_put_block (bh);
+    }
+  else
+    {
+      ret = -EIO;
+    }
+  up_write (&DUMMYFS_I (inode)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
+  inode_unlock (inode);
+  mnt_drop_write_file (filp);
 
-  log_info (FNM, "copying bytes to userspace -> %u, size -> %ld",
-            file_data.i_size, size);
+  return ret;
+}
 
-  // Copy the data from memory to userspace
-  if (copy_to_user (buf, data + offset, size))
-    return -EIO;
-  buf += size;
+/*
+ * Report where a file's data is on the device (FIEMAP, as used by
+ * filefrag). Dirty pages only get blocks once they're written out, which
+ * is done first if FIEMAP_FLAG_SYNC is asked for.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_fiemap (struct inode *inode, struct fiemap_extent_info *fieinfo,
+                u64 start, u64 len)
+{
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct super_block *sb = inode->i_sb;
+  int err;
+
+  log_info (FNM, "fiemap, inode -> %lu, %llu+%llu", inode->i_ino, start,
+            len);
+
+  err = fiemap_prep (inode, fieinfo, start, &len, FIEMAP_FLAG_SYNC);
+  if (err)
+    return err;
+
+  down_read (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (file_data)
+    {
+      err = dummyfs_fiemap_data (sb, bh, file_data, fieinfo, start, len);
+      dummyfs_put_block (bh);
+    }
+  else
+    {
+      err = -EIO;
+    }
+  up_read (&DUMMYFS_I (inode)->i_chain_sem);
+
+  return err;
+}
+
+/*
+ * Discard the free space on the device (FITRIM, as used by fstrim). The
+ * running transaction is committed first, so that all but the blocks
+ * freed from then on can be discarded.
+ *
+ * Returns 0 on success, with the amount discarded in the range passed.
+ */
+static long
+dummyfs_ioctl_trim (struct file *filp, unsigned long arg)
+{
+  struct super_block *sb = file_inode (filp)->i_sb;
+  struct request_queue *q = bdev_get_queue (sb->s_bdev);
+  struct fstrim_range range;
+  unsigned int bits = sb->s_blocksize_bits;
+  sector_t start;
+  sector_t end;
+  u64 minlen;
+  long err;
+
+  if (!capable (CAP_SYS_ADMIN))
+    return -EPERM;
+  if (!blk_queue_discard (q))
+    return -EOPNOTSUPP;
+  if (copy_from_user (&range, (struct fstrim_range __user *)arg,
+                      sizeof (range)))
+    return -EFAULT;
+
+  minlen = max_t (u64, range.minlen, q->limits.discard_granularity);
+  minlen = DIV_ROUND_UP (minlen, sb->s_blocksize);
+  start = range.start >> bits;
+  end = (range.len >> bits) + start;
+  if (end < start || end > DUMMYFS_SB (sb)->s_numblocks)
+    end = DUMMYFS_SB (sb)->s_numblocks;
+  if (minlen > DUMMYFS_SB (sb)->s_numblocks)
+    return -EINVAL;
+
+  err = dummyfs_journal_commit (sb);
+  if (err)
+    return err;
+
+  range.len = (u64)dummyfs_trim_blocks (sb, start, end, minlen) << bits;
+  if (copy_to_user ((struct fstrim_range __user *)arg, &range,
+                    sizeof (range)))
+    return -EFAULT;
+
+  return 0;
+}
+
+/*
+ * Get or set a file's flags (FS_IOC_GETFLAGS and FS_IOC_SETFLAGS, as
+ * used by lsattr and chattr), defragment it (DUMMYFS_IOC_DEFRAG), or
+ * discard the filesystem's free space (FITRIM). The only flag there is is
+ * FS_COMPR_FL: on a file, whatever is written from then on is compressed,
+ * and on a directory, files created in it are compressed. A file only
+ * stops being compressed while it has no data blocks.
+ *
+ * Returns 0 on success (or what was asked for).
+ */
+long
+dummyfs_ioctl (struct file *filp, unsigned int cmd, unsigned long arg)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct inode *inode = file_inode (filp);
+  struct super_block *sb = inode->i_sb;
+  unsigned int flags;
+  long err;
+
+  log_info (FNM, "ioctl, cmd -> %u", cmd);
+
+  switch (cmd)
+    {
+    case FS_IOC_GETFLAGS:
+      flags = IF_IS_COMPRESSED (DUMMYFS_I (inode)->i_flags) ? FS_COMPR_FL
+                                                            : 0;
+      return put_user (flags, (int __user *)arg);
+    case FS_IOC_SETFLAGS:
+      break;
+    case DUMMYFS_IOC_DEFRAG:
+      err = dummyfs_ioctl_defrag (filp);
+      log_info (FNM, "done ioctl -> %ld", err);
+      return err;
+    case FITRIM:
+      err = dummyfs_ioctl_trim (filp, arg);
+      log_info (FNM, "done ioctl -> %ld", err);
+      return err;
+    default:
+      return -ENOTTY;
+    }
+
+  if (!inode_owner_or_capable (inode))
+    return -EACCES;
+  if (get_user (flags, (int __user *)arg))
+    return -EFAULT;
+  if (flags & ~FS_COMPR_FL)
+    return -EOPNOTSUPP;
+
+  err = mnt_want_write_file (filp);
+  if (err)
+    return err;
+  inode_lock (inode);
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (sb, inode->i_ino, &bh);
+  if (!file_data)
+    {
+      err = -EIO;
+      goto out;
+    }
+
+  if (flags & FS_COMPR_FL)
+    file_data->i_flags |= IF_COMPRESSED;
+  else if (S_ISREG (inode->i_mode)
+           && !BLOCK_IS_UNALLOCATED (file_data->b_next))
+    err = -EINVAL;
+  else
+    file_data->i_flags &= ~IF_COMPRESSED;
+
+  if (!err && file_data->i_flags != DUMMYFS_I (inode)->i_flags)
+    {
+      DUMMYFS_I (inode)->i_flags = file_data->i_flags;
+      dummyfs_dirty_block (sb, bh);
+      inode->i_ctime = current_time (inode);
+      mark_inode_dirty (inode);
+    }
+  dummyfs_put_block (bh);
+
+out:
+  up_write (&DUMMYFS_I (inode)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
+  inode_unlock (inode);
+  mnt_drop_write_file (filp);
+
+  log_info (FNM, "done ioctl -> %ld", err);
+
+  return err;
+}
+
+/*
+ * Clone one file into another (FICLONE, or FICLONERANGE over the whole of
+ * the source), so that the two share their data blocks until either is
+ * written to. Only whole files can be cloned, since only the ends of two
+ * files' lists of blocks can be shared: the clone must start at the start
+ * of both files, take in all of the source and replace all of the
+ * destination. Deduplication is not supported.
+ *
+ * Returns the amount cloned.
+ */
+loff_t
+dummyfs_remap_file_range (struct file *file_in, loff_t pos_in,
+                          struct file *file_out, loff_t pos_out, loff_t len,
+                          unsigned int remap_flags)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *src_data;
+  struct dummyfs_inode *dst_data;
+  struct buffer_head *src_bh;
+  struct buffer_head *dst_bh;
+  struct inode *src = file_inode (file_in);
+  struct inode *dst = file_inode (file_out);
+  struct super_block *sb = src->i_sb;
+  loff_t ret;
+
+  log_info (FNM, "remap file range, %lu:%Ld -> %lu:%Ld, len -> %Ld",
+            src->i_ino, pos_in, dst->i_ino, pos_out, len);
+
+  if (remap_flags & ~(REMAP_FILE_CAN_SHORTEN | REMAP_FILE_ADVISORY))
+    return -EOPNOTSUPP;
+  if (src == dst || !S_ISREG (src->i_mode) || !S_ISREG (dst->i_mode))
+    return -EINVAL;
+
+  lock_two_nondirectories (src, dst);
+
+  // Checks the range and gets both files' dirty pages in it to disk
+  ret = generic_remap_file_range_prep (file_in, pos_in, file_out, pos_out,
+                                       &len, remap_flags);
+  if (ret < 0 || !len)
+    goto unlock;
+  ret = -EINVAL;
+  if (pos_in || pos_out || len != i_size_read (src)
+      || i_size_read (dst) > len)
+    goto unlock;
+
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (dst)->i_chain_sem);
+  down_write (&DUMMYFS_I (src)->i_chain_sem);
+
+  ret = -EIO;
+  dst_data = dummyfs_get_inode (sb, dst->i_ino, &dst_bh);
+  if (!dst_data)
+    goto unlock_chains;
+  src_data = dummyfs_get_inode (sb, src->i_ino, &src_bh);
+  if (!src_data)
+    {
+      dummyfs_put_block (dst_bh);
+      goto unlock_chains;
+    }
+
+  ret = dummyfs_clone_data (sb, src_data, dst_bh, dst_data);
+  if (!ret)
+    {
+      dummyfs_dirty_block (sb, src_bh);
+      DUMMYFS_I (src)->i_flags = src_data->i_flags;
+      DUMMYFS_I (dst)->i_flags = dst_data->i_flags;
+      i_size_write (dst, dst_data->i_size);
+      dst->i_ctime = dst->i_mtime = current_time (dst);
+      mark_inode_dirty (dst);
+      ret = len;
+    }
+
+  dummyfs_put_block (src_bh);
+  dummyfs_put_block (dst_bh);
+unlock_chains:
+  up_write (&DUMMYFS_I (src)->i_chain_sem);
+  up_write (&DUMMYFS_I (dst)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
+
+  // Whatever the destination had cached is of its old data
+  truncate_inode_pages (dst->i_mapping, 0);
+unlock:
+  unlock_two_nondirectories (src, dst);
+
+  log_info (FNM, "done remap file range -> %Ld", ret);
+
+  return ret;
+}
+
+/*
+ * Copy part of one file to another. Copies within a mount are done by the
+ * filesystem itself, so the data never leaves the kernel (and holes stay
+ * holes); anything else is left to the generic splice-based copy.
+ *
+ * Returns the amount copied.
+ */
+ssize_t
+dummyfs_copy_file_range (struct file *file_in, loff_t pos_in,
+                         struct file *file_out, loff_t pos_out, size_t len,
+                         unsigned int flags)
+{
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *src_data;
+  struct dummyfs_inode *dst_data;
+  struct buffer_head *src_bh;
+  struct buffer_head *dst_bh;
+  struct inode *src = file_in->f_path.dentry->d_inode;
+  struct inode *dst = file_out->f_path.dentry->d_inode;
+  struct super_block *sb = src->i_sb;
+  ssize_t ret;
+
+  log_info (FNM, "copy file range, %lu:%Ld -> %lu:%Ld, len -> %zu",
+            src->i_ino, pos_in, dst->i_ino, pos_out, len);
+
+  if (sb != dst->i_sb || flags)
+    return generic_copy_file_range (file_in, pos_in, file_out, pos_out, len,
+                                    flags);
+  if (!S_ISREG (src->i_mode) || !S_ISREG (dst->i_mode))
+    return -EINVAL;
+
+  lock_two_nondirectories (src, dst);
+  ret = file_remove_privs (file_out);
+  if (ret)
+    goto unlock;
+
+  /*
+   * The copy is done on disk, so get all of the source there (which also
+   * brings its size on disk up to date) and the destination's dirty pages
+   * in the range out of the way.
+   */
+  ret = filemap_write_and_wait (src->i_mapping);
+  if (!ret)
+    ret = filemap_write_and_wait_range (dst->i_mapping, pos_out,
+                                        pos_out + len - 1);
+  if (ret)
+    goto unlock;
+
+  dummyfs_journal_start (sb, &handle);
+  down_write (&DUMMYFS_I (dst)->i_chain_sem);
+  if (src != dst)
+    down_read (&DUMMYFS_I (src)->i_chain_sem);
+
+  ret = -EIO;
+  dst_data = dummyfs_get_inode (sb, dst->i_ino, &dst_bh);
+  if (!dst_data)
+    goto unlock_chains;
+  src_data = dst_data;
+  src_bh = NULL;
+  if (src != dst)
+    {
+      src_data = dummyfs_get_inode (sb, src->i_ino, &src_bh);
+      if (!src_data)
+        {
+          dummyfs_put_block (dst_bh);
+          goto unlock_chains;
+        }
+    }
+
+  ret = dummyfs_copy_data (sb, src_data, pos_in, dst_bh, dst_data, pos_out,
+                           len);
+  if (ret > 0)
+    {
+      if (dst_data->i_size > dst->i_size)
+        i_size_write (dst, dst_data->i_size);
+      dst->i_ctime = dst->i_mtime = current_time (dst);
+      mark_inode_dirty (dst);
+    }
+
+  if (src_bh)
+    dummyfs_put_block (src_bh);
+  dummyfs_put_block (dst_bh);
+unlock_chains:
+  if (src != dst)
+    up_read (&DUMMYFS_I (src)->i_chain_sem);
+  up_write (&DUMMYFS_I (dst)->i_chain_sem);
+  dummyfs_journal_stop (&handle);
+
+  // Drop whatever the destination had cached of what was copied over
+  if (ret > 0)
+    truncate_pagecache_range (dst, pos_out, pos_out + ret - 1);
+unlock:
+  unlock_two_nondirectories (src, dst);
 
-  vfree (data); // Free the data from memory
+  log_info (FNM, "done copy file range -> %zd", ret);
 
-  log_info (FNM, "done file read");
-  return size;
+  return ret;
 }
 
 /*
- * Remove a listing from a directory (and remove the corresponding
- * inode from disk, if the listing was the last reference to it).
+ * Move a file's position, finding data and holes for SEEK_DATA and
+ * SEEK_HOLE (anything else is left to the generic code).
+ *
+ * Returns the new position.
+ */
+loff_t
+dummyfs_file_llseek (struct file *filp, loff_t offset, int whence)
+{
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct inode *inode = filp->f_path.dentry->d_inode;
+  loff_t pos;
+
+  if (whence != SEEK_DATA && whence != SEEK_HOLE)
+    return generic_file_llseek (filp, offset, whence);
+
+  // Dirty pages have no blocks yet, so get them written out first
+  pos = filemap_write_and_wait (inode->i_mapping);
+  if (pos)
+    return pos;
+
+  inode_lock_shared (inode);
+  down_read (&DUMMYFS_I (inode)->i_chain_sem);
+  file_data = dummyfs_get_inode (inode->i_sb, inode->i_ino, &bh);
+  if (!file_data)
+    {
+      up_read (&DUMMYFS_I (inode)->i_chain_sem);
+      inode_unlock_shared (inode);
+      return -EIO;
+    }
+  pos = dummyfs_seek_data (inode->i_sb, file_data, offset,
+                           whence == SEEK_HOLE);
+  dummyfs_put_block (bh);
+  up_read (&DUMMYFS_I (inode)->i_chain_sem);
+  inode_unlock_shared (inode);
+
+  log_info (FNM, "seek %s from %Ld -> %Ld",
+            (whence == SEEK_DATA) ? "data" : "hole", offset, pos);
+
+  if (pos < 0)
+    return pos;
+  return vfs_setpos (filp, pos, inode->i_sb->s_maxbytes);
+}
+
+/*
+ * Remove a listing from a directory, taking a link off the inode it names.
+ * An inode whose last link this was stays on disk for as long as it's
+ * still open or mapped, and is only freed once it's evicted (see
+ * dummyfs_evict_inode).
  *
  * Returns 0 on success.
  */
@@ -259,21 +1335,33 @@ dummyfs_unlink (struct inode *dir, struct dentry *dentry)
 {
 
   int num_listings, k, l;
-  struct dummyfs_inode dir_data;
-  unsigned long file_data_index;
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *dir_data;
+  struct dummyfs_inode *file_data;
+  struct buffer_head *bh;
+  struct buffer_head *file_bh;
   struct inode *inode;
   unsigned char *listings;
   struct dummyfs_dir_listing *listing, *last_listing;
+  int err = 0;
 
   log_info (FNM, "unlink -> %s", dentry->d_name.name);
 
+  inode = dentry->d_inode;
+  dummyfs_journal_start (dir->i_sb, &handle);
+
   // Retrieve the parent directory's inode metadata and listings
-  dummyfs_read_inode (dir->i_sb, dir->i_ino, &dir_data);
+  dir_data = dummyfs_get_inode (dir->i_sb, dir->i_ino, &bh);
+  if (!dir_data)
+    {
+      err = -EIO;
+      goto out;
+    }
   num_listings
-      = dir_data.i_size
+      = dir_data->i_size
         / sizeof (struct dummyfs_dir_listing); // Get an upper bounds for the
                                                // later linear search
-  listings = dummyfs_map_data (dir->i_sb, &dir_data, 0);
+  listings = dummyfs_map_data (dir->i_sb, dir_data, 0);
 
   // Find the listing in the parent directory's data and delete it
   // Search through the parent directory's listings for the one we're trying to
@@ -315,13 +1403,12 @@ dummyfs_unlink (struct inode *dir, struct dentry *dentry)
 
   // Write out the truncated directory listings to disk (and shrink the
   // directory's size)
-  dummyfs_write_data (dir->i_sb, &dir_data, listings,
-                      (num_listings * sizeof (struct dummyfs_dir_listing)));
-  dir_data.i_size = dir_data.i_size - sizeof (struct dummyfs_dir_listing);
-  dummyfs_write_inode (dir->i_sb, dir->i_ino, &dir_data);
+  dummyfs_write_data (dir->i_sb, bh, dir_data, listings,
+                      ((num_listings - 1)
+                       * sizeof (struct dummyfs_dir_listing)));
+  dummyfs_cache_listings (dir, listings, dir_data->i_size);
 
-  // Retrieve the VFS inode so we can check how many links it has left
-  inode = dentry->d_inode;
+  // Check the VFS inode so we can see how many links it has left
   if (!inode)
     {
       log_info (FNM,
@@ -329,18 +1416,18 @@ dummyfs_unlink (struct inode *dir, struct dentry *dentry)
       log_info (
           FNM,
           "may have orphaned inode in VFS/on disk that can't be accessed");
-      return -EACCES;
+      dummyfs_put_block (bh);
+      err = -EACCES;
+      goto out;
     }
 
-  // Remove inode and data blocks from superblock if the last link is gone
-  if (inode->i_nlink == 1)
+  // Take the link off the inode on disk
+  file_data = dummyfs_get_inode (dir->i_sb, inode->i_ino, &file_bh);
+  if (file_data)
     {
-      log_info (FNM, "inode has no links left, emptying out inode on disk");
-      file_data_index = dummyfs_inode_block_index (
-          dir->i_sb, inode->i_ino,
-          BM_UNALLOCATED); // Remove the inode table entry
-      dummyfs_dealloc_data (dir->i_sb,
-                            file_data_index); // Deallocate data blocks
+      file_data->i_links--;
+      dummyfs_dirty_block (dir->i_sb, file_bh);
+      dummyfs_put_block (file_bh);
     }
 
   // Update the VFS file inode
@@ -348,10 +1435,13 @@ dummyfs_unlink (struct inode *dir, struct dentry *dentry)
   mark_inode_dirty (inode);
 
   // Update the VFS directory inode
-  dir->i_size = dir_data.i_size;
+  dir->i_size = dir_data->i_size;
   mark_inode_dirty (dir);
+  dummyfs_put_block (bh);
 
-  return 0;
+out:
+  dummyfs_journal_stop (&handle);
+  return err;
 }
 
 /*
@@ -363,14 +1453,15 @@ dummyfs_unlink (struct inode *dir, struct dentry *dentry)
 int
 dummyfs_rmdir (struct inode *dir, struct dentry *dentry)
 {
-  struct dummyfs_inode dir_data;
+  struct dummyfs_inode_meta stat;
   struct inode *del = dentry->d_inode;
   int num_dirs;
 
   log_info (FNM, "rmdir -> %s", dentry->d_name.name);
 
-  dummyfs_read_inode (dir->i_sb, del->i_ino, &dir_data);
-  num_dirs = dir_data.i_size / sizeof (struct dummyfs_dir_listing);
+  if (dummyfs_stat_inode (dir->i_sb, del->i_ino, &stat))
+    return -EIO;
+  num_dirs = stat.i_size / sizeof (struct dummyfs_dir_listing);
   if (num_dirs == 0)
     {
       dummyfs_unlink (dir, dentry);
@@ -395,7 +1486,7 @@ int
 dummyfs_readdir (struct file *filp, struct dir_context *ctx)
 {
   struct inode *inode;
-  struct dummyfs_inode dir_data;
+  struct dummyfs_meta *m;
   unsigned char *listings;
   int num_listings;
   struct dummyfs_dir_listing
@@ -404,11 +1495,13 @@ dummyfs_readdir (struct file *filp, struct dir_context *ctx)
 
   log_info (FNM, "readdir");
 
-  // Map the directory's listings into memory
+  // Get the directory's listings
   inode = file_inode (filp);
-  dummyfs_read_inode (inode->i_sb, inode->i_ino, &dir_data);
-  num_listings = dir_data.i_size / sizeof (struct dummyfs_dir_listing);
-  listings = dummyfs_map_data (inode->i_sb, &dir_data, 0);
+  m = dummyfs_get_listings (inode);
+  if (!m)
+    return -EIO;
+  num_listings = m->m_size / sizeof (struct dummyfs_dir_listing);
+  listings = m->m_data;
 
   log_info (FNM, "number of entries -> %d, fpos -> %Ld", num_listings,
             filp->f_pos);
@@ -417,7 +1510,7 @@ dummyfs_readdir (struct file *filp, struct dir_context *ctx)
   error = 0;
   k = 0;
   listing = (struct dummyfs_dir_listing *)listings;
-  while (!error && filp->f_pos < dir_data.i_size && k < num_listings)
+  while (!error && filp->f_pos < m->m_size && k < num_listings)
     {
       log_info (FNM, "adding name -> %s, ino -> %d", listing->l_name,
                 listing->l_ino);
@@ -427,7 +1520,7 @@ dummyfs_readdir (struct file *filp, struct dir_context *ctx)
           if (!dir_emit (ctx, listing->l_name,
                          strnlen (listing->l_name, MAX_NAME_SIZE),
                          listing->l_ino, DT_UNKNOWN))
-            return 0;
+            break;
         }
       ctx->pos
           += sizeof (struct dummyfs_dir_listing); // Move to the next listing
@@ -437,7 +1530,7 @@ dummyfs_readdir (struct file *filp, struct dir_context *ctx)
     }
 
   // update_atime(i);
-  vfree (listings); // Free the listings from memory
+  dummyfs_meta_put (inode->i_sb, m);
   log_info (FNM, "done readdir");
 
   return 0;
@@ -452,11 +1545,14 @@ int
 dummyfs_link (struct dentry *old_dentry, struct inode *dir,
               struct dentry *dentry)
 {
-  struct dummyfs_inode data;
+  struct dummyfs_handle handle;
+  struct dummyfs_inode *data;
+  struct buffer_head *bh;
   int num_listings;
   struct dummyfs_dir_listing *listing;
   struct inode *inode;
   unsigned char *listings;
+  int err = 0;
 
   log_info (FNM, "link -> %s", dentry->d_name.name);
 
@@ -468,13 +1564,17 @@ dummyfs_link (struct dentry *old_dentry, struct inode *dir,
   if (!dir)
     return -1;
 
-  if (!dir)
-    return -1;
+  dummyfs_journal_start (dir->i_sb, &handle);
 
   // Get the directory's listings
-  dummyfs_read_inode (dir->i_sb, dir->i_ino, &data);
-  num_listings = data.i_size / sizeof (struct dummyfs_dir_listing);
-  listings = dummyfs_map_data (dir->i_sb, &data,
+  data = dummyfs_get_inode (dir->i_sb, dir->i_ino, &bh);
+  if (!data)
+    {
+      err = -EIO;
+      goto out;
+    }
+  num_listings = data->i_size / sizeof (struct dummyfs_dir_listing);
+  listings = dummyfs_map_data (dir->i_sb, data,
                                sizeof (struct dummyfs_dir_listing));
   listing
       = (struct dummyfs_dir_listing *)(listings
@@ -486,19 +1586,26 @@ dummyfs_link (struct dentry *old_dentry, struct inode *dir,
   strncpy (listing->l_name, dentry->d_name.name, dentry->d_name.len);
   listing->l_name[dentry->d_name.len] = '\0';
   listing->l_ino = inode->i_ino;
-  dummyfs_write_data (dir->i_sb, &data, listings,
+  dummyfs_write_data (dir->i_sb, bh, data, listings,
                       (num_listings + 1)
                           * sizeof (struct dummyfs_dir_listing));
-  dir->i_size = data.i_size;
+  dir->i_size = data->i_size;
+  dummyfs_cache_listings (dir, listings, data->i_size);
+  dummyfs_put_block (bh);
 
   // Update the VFS parent directory
   mark_inode_dirty (dir);
-  vfree (listings);
 
   // Increment the inode block's links field
-  dummyfs_read_inode (dir->i_sb, inode->i_ino, &data);
-  data.i_links++;
-  dummyfs_write_inode (dir->i_sb, inode->i_ino, &data);
+  data = dummyfs_get_inode (dir->i_sb, inode->i_ino, &bh);
+  if (!data)
+    {
+      err = -EIO;
+      goto out;
+    }
+  data->i_links++;
+  dummyfs_dirty_block (dir->i_sb, bh);
+  dummyfs_put_block (bh);
 
   // Update the VFS inode and couple it to the new dentry
   inode_inc_link_count (inode);
@@ -506,7 +1613,10 @@ dummyfs_link (struct dentry *old_dentry, struct inode *dir,
   d_instantiate (dentry, inode);
 
   log_info (FNM, "link created -> %ld", inode->i_ino);
-  return 0;
+
+out:
+  dummyfs_journal_stop (&handle);
+  return err;
 }
 
 /*
@@ -520,17 +1630,20 @@ struct dentry *
 dummyfs_lookup (struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
   int num_listings, k;
-  struct dummyfs_inode dir_data;
+  struct dummyfs_meta *m;
   struct inode *inode = NULL;
   unsigned char *listings;
   struct dummyfs_dir_listing *listing;
+  unsigned long ino;
 
   log_info (FNM, "lookup in dir with ino -> %lu", dir->i_ino);
 
-  // Map the directory's listings to memory
-  dummyfs_read_inode (dir->i_sb, dir->i_ino, &dir_data);
-  num_listings = dir_data.i_size / sizeof (struct dummyfs_dir_listing);
-  listings = dummyfs_map_data (dir->i_sb, &dir_data, 0);
+  // Get the directory's listings
+  m = dummyfs_get_listings (dir);
+  if (!m)
+    return ERR_PTR (-EIO);
+  num_listings = m->m_size / sizeof (struct dummyfs_dir_listing);
+  listings = m->m_data;
 
   /*
    * Loop through listings until a match is found between the name in the
@@ -545,12 +1658,13 @@ dummyfs_lookup (struct inode *dir, struct dentry *dentry, unsigned int flags)
           && strncmp (listing->l_name, dentry->d_name.name, dentry->d_name.len)
                  == 0)
         {
+          ino = listing->l_ino;
+          dummyfs_meta_put (dir->i_sb, m);
 
-          inode = dummyfs_iget (
-              dir->i_sb,
-              listing->l_ino); // Create a VFS inode from the disk data
-          if (!inode)
-            return ERR_PTR (-EACCES);
+          inode = dummyfs_iget (dir->i_sb,
+                                ino); // Create a VFS inode from the disk data
+          if (IS_ERR (inode))
+            return ERR_CAST (inode);
 
           d_add (dentry, inode);
           return NULL;
@@ -558,7 +1672,7 @@ dummyfs_lookup (struct inode *dir, struct dentry *dentry, unsigned int flags)
     }
 
   d_add (dentry, inode);
-  vfree (listings); // Free the listings from memory
+  dummyfs_meta_put (dir->i_sb, m);
 
   log_info (FNM, "done lookup");
 
@@ -599,7 +1713,7 @@ struct inode *
 dummyfs_iget (struct super_block *sb, unsigned long ino)
 {
   struct inode *inode;
-  struct dummyfs_inode v_inode;
+  struct dummyfs_inode_meta v_inode;
 
   log_info (FNM, "iget, ino -> %lu", ino);
   log_info (FNM, "iget, super -> %p", sb);
@@ -610,11 +1724,17 @@ dummyfs_iget (struct super_block *sb, unsigned long ino)
   if (!(inode->i_state & I_NEW))
     return inode;
 
-  // Read the inode block in
-  dummyfs_read_inode (inode->i_sb, inode->i_ino, &v_inode);
+  // Get the on-disk inode's fields
+  if (dummyfs_stat_inode (sb, inode->i_ino, &v_inode))
+    {
+      iget_failed (inode);
+      return ERR_PTR (-EIO);
+    }
 
   // Populate the VFS inode's fields
   inode->i_size = v_inode.i_size;
+  set_nlink (inode, v_inode.i_links);
+  DUMMYFS_I (inode)->i_flags = v_inode.i_flags;
   // inode->i_uid = (kuid_t) v_inode.i_uid;
   // inode->i_gid = (kgid_t) v_inode.i_gid;
   inode->i_ctime = inode->i_mtime = inode->i_atime = current_time (inode);
@@ -631,12 +1751,207 @@ dummyfs_iget (struct super_block *sb, unsigned long ino)
       inode->i_mode = v_inode.i_mode | S_IFREG;
       inode->i_op = &dummyfs_file_inode_operations;
       inode->i_fop = &dummyfs_file_operations;
+      inode->i_mapping->a_ops = &dummyfs_file_aops;
     }
 
   unlock_new_inode (inode);
   return inode;
 }
 
+enum
+{
+  Opt_meta_cache,
+  Opt_compress,
+  Opt_discard,
+  Opt_err
+};
+
+static const match_table_t tokens = {
+  { Opt_meta_cache, "meta_cache=%u" },
+  { Opt_compress, "compress" },
+  { Opt_discard, "discard" },
+  { Opt_err, NULL },
+};
+
+/*
+ * Parse the mount options:
+ *
+ *   meta_cache=<KiB>  Memory cap of the metadata cache (see cache.h)
+ *   compress          Compress every new file (see compress.c)
+ *   discard           Discard blocks as they're freed (see alloc.c)
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_parse_options (char *options, size_t *meta_cache, int *compress,
+                       int *discard)
+{
+  substring_t args[MAX_OPT_ARGS];
+  char *p;
+  int option;
+
+  if (!options)
+    return 0;
+
+  while ((p = strsep (&options, ",")) != NULL)
+    {
+      if (!*p)
+        continue;
+
+      switch (match_token (p, tokens, args))
+        {
+        case Opt_meta_cache:
+          if (match_int (&args[0], &option) || option < 0)
+            return -EINVAL;
+          *meta_cache = (size_t)option << 10;
+          break;
+        case Opt_compress:
+          *compress = true;
+          break;
+        case Opt_discard:
+          *discard = true;
+          break;
+        default:
+          pr_err ("dummyfs: unknown mount option \"%s\"\n", p);
+          return -EINVAL;
+        }
+    }
+
+  return 0;
+}
+
+/*
+ * Read the geometry of the device from the first inode table (which
+ * doubles as the superblock) and derive the sizes that depend on it.
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_read_super (struct super_block *s, struct dummyfs_sb_info *sbi)
+{
+  struct dummyfs_inode_table *table;
+  struct buffer_head *bh;
+  unsigned int blocksize_bits;
+  unsigned long blocksize;
+  sector_t bitmap;
+  sector_t bitmap_blocks;
+  sector_t journal;
+  sector_t journal_blocks;
+  unsigned long inode_size;
+
+  /*
+   * The block size isn't known until we've read it from the device, but
+   * the header of the first inode table always fits in the smallest
+   * block size dummyfs supports, so read it in at that size first.
+   */
+  if (!sb_min_blocksize (s, MIN_BLOCKSIZE))
+    {
+      log_info (FNM, "unable to set the initial block size");
+      return -EINVAL;
+    }
+  bh = sb_bread (s, TABLE_BLOCK_INDEX);
+  if (!bh)
+    {
+      log_info (FNM, "unable to read the first inode table");
+      return -EIO;
+    }
+  table = (struct dummyfs_inode_table *)bh->b_data;
+  if (table->t_magic != DUMMYFS_MAGIC || table->t_version != DUMMYFS_VERSION)
+    {
+      log_info (FNM, "not a dummyfs device (or an old format)");
+      brelse (bh);
+      return -EINVAL;
+    }
+  blocksize_bits = table->t_blocksize_bits;
+  sbi->s_numblocks = table->t_numblocks;
+  bitmap = table->t_bitmap;
+  bitmap_blocks = table->t_bitmap_blocks;
+  journal = table->t_journal;
+  journal_blocks = table->t_journal_blocks;
+  inode_size = table->t_inode_size;
+  brelse (bh);
+
+  if (blocksize_bits < MIN_BLOCKSIZE_BITS
+      || blocksize_bits > MAX_BLOCKSIZE_BITS)
+    {
+      log_info (FNM, "unsupported block size (2^%u)", blocksize_bits);
+      return -EINVAL;
+    }
+  blocksize = 1UL << blocksize_bits;
+
+  if (bdev_logical_block_size (s->s_bdev) > blocksize)
+    {
+      log_info (FNM, "device blocks are too large");
+      return -EINVAL;
+    }
+
+  /*
+   * This fails if the block size is larger than a page, which the
+   * buffer cache can't handle on most kernels.
+   */
+  if (!sb_set_blocksize (s, blocksize))
+    {
+      log_info (FNM, "block size %lu not supported by this kernel",
+                blocksize);
+      return -EINVAL;
+    }
+
+  sbi->s_max_block_data_size = MAX_BLOCK_DATA_SIZE (blocksize);
+  sbi->s_max_table_size = MAX_TABLE_SIZE (blocksize);
+  sbi->s_max_inode_data_size = MAX_INODE_DATA_SIZE (blocksize);
+
+  // Inodes in groups hold a whole number of pointers, and at least two fit
+  if (inode_size
+      && (inode_size < INODE_HEADER_SIZE || inode_size % sizeof (__u64)
+          || INODES_PER_GROUP (blocksize, inode_size) < 2))
+    {
+      log_info (FNM, "bad inode size %lu", inode_size);
+      return -EINVAL;
+    }
+  if (inode_size)
+    sbi->s_max_inode_data_size = inode_size - INODE_HEADER_SIZE;
+  sbi->s_inode_size = inode_size;
+
+  // A data block's place in its file is a 32 bit b_index
+  s->s_maxbytes = sbi->s_max_inode_data_size
+                  + ((loff_t)1 << 32) * sbi->s_max_block_data_size;
+
+  // The allocation bitmap has to cover the whole device
+  sbi->s_bitmap_bits = BITMAP_BITS_PER_BLOCK (blocksize);
+  if (bitmap <= ROOT_DIR_BLOCK_INDEX
+      || bitmap_blocks < DIV_ROUND_UP (sbi->s_numblocks, sbi->s_bitmap_bits)
+      || bitmap + bitmap_blocks >= sbi->s_numblocks)
+    {
+      log_info (FNM, "bad allocation bitmap (%llu+%llu)", bitmap,
+                bitmap_blocks);
+      return -EINVAL;
+    }
+  sbi->s_bitmap = bitmap;
+  sbi->s_bitmap_blocks = bitmap_blocks;
+
+  // The journal (if there is one) comes right after the bitmap
+  if (journal != bitmap + bitmap_blocks
+      || (journal_blocks && journal_blocks < MIN_JOURNAL_BLOCKS)
+      || journal + journal_blocks >= sbi->s_numblocks)
+    {
+      log_info (FNM, "bad journal (%llu+%llu)", journal, journal_blocks);
+      return -EINVAL;
+    }
+  sbi->s_journal = journal;
+  sbi->s_journal_blocks = journal_blocks;
+  sbi->s_alloc_hint = journal + journal_blocks;
+  mutex_init (&sbi->s_alloc_lock);
+  mutex_init (&sbi->s_pack_lock);
+  mutex_init (&sbi->s_group_lock);
+  mutex_init (&sbi->s_share_lock);
+  INIT_LIST_HEAD (&sbi->s_freed);
+  INIT_LIST_HEAD (&sbi->s_committing);
+
+  log_info (FNM, "block size %lu, %llu blocks", blocksize, sbi->s_numblocks);
+
+  return 0;
+}
+
 /*
  * Create a VFS superblock from on-disk dummyfs data.
  * This is a pretty simple function that just makes the root directory a
@@ -647,22 +1962,55 @@ dummyfs_iget (struct super_block *sb, unsigned long ino)
 int
 dummyfs_fill_super (struct super_block *s, void *data, int silent)
 {
+  struct dummyfs_sb_info *sbi;
+  struct dummyfs_inode_meta root;
   struct inode *i;
-  struct dummyfs_inode inode;
-  // struct dummyfs_inode_table table;
-  int hblock;
-  // int *numblocks = malloc(sizeof(int));
+  size_t meta_cache = DEFAULT_META_CACHE_KB << 10;
+  int err;
 
   log_info (FNM, "fill super");
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
-  s->s_flags = MS_NOSUID | MS_NOEXEC;
-#else
-  s->s_flags = ST_NOSUID | SB_NOEXEC;
-#endif
+  s->s_flags = SB_NOSUID | SB_NOEXEC;
   s->s_op = &dummyfs_ops;
+  s->s_magic = DUMMYFS_MAGIC;
+
+  sbi = kzalloc (sizeof (struct dummyfs_sb_info), GFP_KERNEL);
+  if (!sbi)
+    return -ENOMEM;
+  s->s_fs_info = sbi;
+
+  err = dummyfs_parse_options (data, &meta_cache, &sbi->s_compress,
+                               &sbi->s_discard);
+  if (err)
+    goto out_free;
+  if (sbi->s_discard && !blk_queue_discard (bdev_get_queue (s->s_bdev)))
+    {
+      pr_warn ("dummyfs: the device doesn't support discard\n");
+      sbi->s_discard = false;
+    }
+
+  err = dummyfs_read_super (s, sbi);
+  if (err)
+    goto out_free;
+
+  err = dummyfs_journal_load (s);
+  if (err)
+    goto out_free;
+
+  err = dummyfs_count_free (s);
+  if (err)
+    goto out_free;
+
+  err = dummyfs_meta_init (s, meta_cache);
+  if (err)
+    goto out_free;
 
   i = new_inode (s);
+  if (!i)
+    {
+      err = -ENOMEM;
+      goto out_free;
+    }
 
   i->i_sb = s;
   i->i_ino = 0;
@@ -672,20 +2020,25 @@ dummyfs_fill_super (struct super_block *s, void *data, int silent)
   i->i_fop = &dummyfs_dir_operations;
   log_info (FNM, "inode number -> %lu, at -> %p", i->i_ino, i);
 
-  hblock = bdev_logical_block_size (s->s_bdev);
-  if (hblock > BLOCKSIZE)
+  s->s_root = d_make_root (i);
+  if (!s->s_root)
     {
-      log_info (FNM, "device blocks are too small");
-      return -1;
+      err = -ENOMEM;
+      goto out_free;
     }
 
-  set_blocksize (s->s_bdev, BLOCKSIZE);
-  s->s_blocksize = BLOCKSIZE;
-  s->s_blocksize_bits = BLOCKSIZE_BITS;
-  s->s_root = d_make_root (i);
-
-  dummyfs_readblock (s, ROOT_DIR_BLOCK_INDEX, (struct dummyfs_block *)&inode);
-  i->i_size = inode.i_size;
+  // From here on, dummyfs_put_super tears everything down on an error
+  if (dummyfs_stat_inode (s, i->i_ino, &root))
+    return -EIO;
+  i->i_size = root.i_size;
+  DUMMYFS_I (i)->i_flags = root.i_flags;
 
   return 0;
+
+out_free:
+  dummyfs_journal_destroy (s);
+  dummyfs_meta_destroy (s);
+  s->s_fs_info = NULL;
+  kfree (sbi);
+  return err;
 }
@@ -11,8 +11,28 @@
 
 struct inode *dummyfs_iget (struct super_block *, unsigned long);
 struct dentry *dummyfs_lookup (struct inode *, struct dentry *, unsigned int);
-ssize_t dummyfs_file_write (struct file *, const char *, size_t, loff_t *);
-ssize_t dummyfs_file_read (struct file *, char *, size_t, loff_t *);
+int dummyfs_readpage (struct file *, struct page *);
+int dummyfs_writepage (struct page *, struct writeback_control *);
+int dummyfs_writepages (struct address_space *, struct writeback_control *);
+int dummyfs_write_begin (struct file *, struct address_space *, loff_t,
+                         unsigned, unsigned, struct page **, void **);
+int dummyfs_write_end (struct file *, struct address_space *, loff_t,
+                       unsigned, unsigned, struct page *, void *);
+ssize_t dummyfs_direct_IO (struct kiocb *, struct iov_iter *);
+ssize_t dummyfs_copy_file_range (struct file *, loff_t, struct file *, loff_t,
+                                 size_t, unsigned int);
+loff_t dummyfs_remap_file_range (struct file *, loff_t, struct file *, loff_t,
+                                 loff_t, unsigned int);
+ssize_t dummyfs_file_read_iter (struct kiocb *, struct iov_iter *);
+ssize_t dummyfs_file_write_iter (struct kiocb *, struct iov_iter *);
+loff_t dummyfs_file_llseek (struct file *, loff_t, int);
+int dummyfs_file_open (struct inode *, struct file *);
+int dummyfs_file_release (struct inode *, struct file *);
+long dummyfs_fallocate (struct file *, int, loff_t, loff_t);
+int dummyfs_fsync (struct file *, loff_t, loff_t, int);
+int dummyfs_setattr (struct dentry *, struct iattr *);
+int dummyfs_fiemap (struct inode *, struct fiemap_extent_info *, u64, u64);
+long dummyfs_ioctl (struct file *, unsigned int, unsigned long);
 int dummyfs_create (struct inode *, struct dentry *, umode_t, unsigned short);
 int dummyfs_unlink (struct inode *, struct dentry *);
 int dummyfs_rmdir (struct inode *, struct dentry *);
@@ -0,0 +1,637 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/crc32c.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "journal.h"
+#include "logging.h"
+#include "mod.h"
+
+#define FNM "journal"
+
+/*
+ * Metadata changes are made to blocks in the buffer cache as before, but
+ * rather than each changed block being written back in place on its own,
+ * it's added to the running transaction. Committing a transaction copies
+ * its blocks (in between operations, so no operation is caught halfway)
+ * and writes the copies to the log in one go. The blocks stay pinned in
+ * the buffer cache, and are only written back in place (from their last
+ * committed copies) when the log fills up, so that the log can be started
+ * over.
+ *
+ * File data isn't journaled: it's written in place before the transaction
+ * that links it into its file commits, so a committed transaction never
+ * points at data that isn't on the disk.
+ */
+
+// The first block of the log (after the journal's superblock)
+static sector_t
+dummyfs_log_start (struct dummyfs_sb_info *sbi)
+{
+  return sbi->s_journal + 1;
+}
+
+static sector_t
+dummyfs_log_end (struct dummyfs_sb_info *sbi)
+{
+  return sbi->s_journal + sbi->s_journal_blocks;
+}
+
+/*
+ * Write blocks from memory (block-sized kmalloc buffers) to the device,
+ * either to consecutive blocks from start or (if where is given) to the
+ * blocks listed in where. They're all submitted under one plug and then
+ * waited on together, and the first one carries the given request flags.
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_log_write (struct super_block *sb, sector_t start, sector_t *where,
+                   void **data, unsigned long nr, unsigned int flags)
+{
+  struct blk_plug plug;
+  struct bio *bio = NULL;
+  struct bio *prev;
+  unsigned long k;
+  int err;
+
+  if (!nr)
+    return 0;
+
+  blk_start_plug (&plug);
+  for (k = 0; k < nr; k++)
+    {
+      prev = bio;
+      bio = bio_alloc (GFP_NOFS, 1);
+      bio_set_dev (bio, sb->s_bdev);
+      bio->bi_iter.bi_sector = (where ? where[k] : start + k)
+                               << (sb->s_blocksize_bits - 9);
+      bio->bi_opf = REQ_OP_WRITE | REQ_SYNC | (k ? 0 : flags);
+      bio_add_page (bio, virt_to_page (data[k]), sb->s_blocksize,
+                    offset_in_page (data[k]));
+
+      // Waiting on the last write waits on every write chained to it
+      if (prev)
+        {
+          bio_chain (prev, bio);
+          submit_bio (prev);
+        }
+    }
+  err = submit_bio_wait (bio);
+  bio_put (bio);
+  blk_finish_plug (&plug);
+
+  return err;
+}
+
+/*
+ * Start the log over, from transaction seq. Whatever was written in place
+ * before this is flushed to the disk before the journal's superblock is.
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_log_reset (struct super_block *sb, u64 seq)
+{
+  struct dummyfs_journal_block *super;
+  sector_t where = DUMMYFS_SB (sb)->s_journal;
+  int err;
+
+  super = kzalloc (sb->s_blocksize, GFP_NOFS | __GFP_NOFAIL);
+  super->b_mode = BM_JOURNAL;
+  super->j_kind = JK_SUPER;
+  super->b_next = BLOCK_UNALLOCATED;
+  super->j_seq = seq;
+  err = dummyfs_log_write (sb, 0, &where, (void **)&super, 1,
+                           REQ_PREFLUSH | REQ_FUA);
+  kfree (super);
+
+  return err;
+}
+
+/*
+ * Write every block the journal holds back in place (as it was last
+ * committed), then start the log over from transaction seq, with the
+ * commit mutex held. If anything fails, the log is left as it is (and
+ * still covers everything it did).
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_journal_checkpoint (struct dummyfs_journal *j, u64 seq)
+{
+  struct super_block *sb = j->j_sb;
+  struct dummyfs_journal_entry *e;
+  unsigned long index;
+  unsigned long nr = 0;
+  sector_t *where;
+  void **data;
+  int err = 0;
+
+  log_info (FNM, "checkpoint, log starts over at %llu", seq);
+
+  where = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (sector_t),
+                         GFP_NOFS | __GFP_NOFAIL);
+  data = kmalloc_array (MAX_BATCH_BLOCKS, sizeof (void *),
+                        GFP_NOFS | __GFP_NOFAIL);
+  xa_for_each (&j->j_held, index, e)
+  {
+    where[nr] = index;
+    data[nr++] = e->e_copy;
+    if (nr == MAX_BATCH_BLOCKS)
+      {
+        if (!err)
+          err = dummyfs_log_write (sb, 0, where, data, nr, 0);
+        nr = 0;
+      }
+  }
+  if (!err)
+    err = dummyfs_log_write (sb, 0, where, data, nr, 0);
+  kfree (where);
+  kfree (data);
+  if (!err)
+    err = dummyfs_log_reset (sb, seq);
+  if (err)
+    {
+      log_info (FNM, "checkpoint failed (%d)", err);
+      return err;
+    }
+
+  xa_for_each (&j->j_held, index, e)
+  {
+    xa_erase (&j->j_held, index);
+    if (!buffer_running (e->e_bh))
+      clear_buffer_journaled (e->e_bh);
+    brelse (e->e_bh);
+    kfree (e->e_copy);
+    kfree (e);
+  }
+  j->j_head = dummyfs_log_start (DUMMYFS_SB (sb));
+
+  return 0;
+}
+
+/*
+ * Commit the running transaction (and so everything done before now) to
+ * the disk. Its descriptors, copies of its blocks, and its commit block
+ * go to the log as one sequential write, followed by one flush. The
+ * write starts with a flush of its own, so the file data its operations
+ * wrote in place is on the disk before anything committed points at it.
+ * Operations carry on joining the next transaction while the log is being
+ * written, and whoever commits next commits all of them together.
+ *
+ * If the transaction doesn't fit in what's left of the log, what the log
+ * already holds is written back in place first, to make room. One too
+ * big for the whole log is written straight back in place (so it isn't
+ * atomic).
+ *
+ * Returns 0 on success (including if there was nothing to commit).
+ */
+int
+dummyfs_journal_commit (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_journal *j = sbi->s_log;
+  struct dummyfs_journal_block **descs = NULL;
+  struct dummyfs_journal_block *desc = NULL;
+  struct dummyfs_journal_entry *e;
+  struct buffer_head **bhs;
+  struct buffer_head *bh;
+  unsigned long per_desc = MAX_JOURNAL_DESC_SIZE (sb->s_blocksize);
+  unsigned long nr;
+  unsigned long ndesc;
+  unsigned long need;
+  unsigned long n = 0;
+  unsigned long k;
+  void **data = NULL;
+  u64 seq;
+  u32 crc = ~0;
+  int err = 0;
+
+  if (!j)
+    return 0;
+
+  down_read (&j->j_sem);
+  seq = j->j_seq;
+  up_read (&j->j_sem);
+
+  mutex_lock (&j->j_commit_mutex);
+  if (j->j_committed >= seq)
+    {
+      // Committed while we were waiting for the mutex
+      mutex_unlock (&j->j_commit_mutex);
+      return 0;
+    }
+
+  // Close the running transaction, once there are no operations in it
+  down_write (&j->j_sem);
+  bhs = j->j_running;
+  nr = j->j_nr_running;
+  j->j_running = NULL;
+  j->j_nr_running = 0;
+  j->j_max_running = 0;
+  seq = j->j_seq++;
+  dummyfs_freed_take (sb);
+
+  ndesc = DIV_ROUND_UP (nr, per_desc);
+  need = nr + ndesc + 1;
+  if (nr && j->j_head + need > dummyfs_log_end (sbi))
+    err = dummyfs_journal_checkpoint (j, seq);
+  if (err)
+    {
+      // Leave the transaction running, for a later commit to try again
+      j->j_running = bhs;
+      j->j_nr_running = nr;
+      j->j_max_running = nr;
+      j->j_seq = seq;
+      bhs = NULL;
+      nr = 0;
+    }
+
+  for (k = 0; k < nr; k++)
+    {
+      bh = bhs[k];
+      e = xa_load (&j->j_held, bh->b_blocknr);
+      if (e)
+        {
+          brelse (bh); // Pinned by its entry from an earlier commit
+        }
+      else
+        {
+          e = kmalloc (sizeof (struct dummyfs_journal_entry),
+                       GFP_NOFS | __GFP_NOFAIL);
+          e->e_bh = bh;
+          e->e_copy = kmalloc (sb->s_blocksize, GFP_NOFS | __GFP_NOFAIL);
+          xa_store (&j->j_held, bh->b_blocknr, e, GFP_NOFS | __GFP_NOFAIL);
+        }
+      memcpy (e->e_copy, bh->b_data, sb->s_blocksize);
+      clear_buffer_running (bh);
+    }
+  up_write (&j->j_sem);
+
+  if (err || !nr)
+    goto out;
+
+  log_info (FNM, "committing %llu (%lu blocks)", seq, nr);
+
+  if (need >= sbi->s_journal_blocks)
+    {
+      log_info (FNM, "%llu is too big for the log", seq);
+      err = dummyfs_journal_checkpoint (j, seq + 1);
+      goto out;
+    }
+
+  // Lay the transaction out as it goes in the log, checksumming it
+  descs = kmalloc_array (ndesc + 1, sizeof (struct dummyfs_journal_block *),
+                         GFP_NOFS | __GFP_NOFAIL);
+  data = kmalloc_array (need, sizeof (void *), GFP_NOFS | __GFP_NOFAIL);
+  for (k = 0; k <= ndesc; k++)
+    {
+      descs[k] = kzalloc (sb->s_blocksize, GFP_NOFS | __GFP_NOFAIL);
+      descs[k]->b_mode = BM_JOURNAL;
+      descs[k]->j_kind = (k < ndesc) ? JK_DESC : JK_COMMIT;
+      descs[k]->b_next = BLOCK_UNALLOCATED;
+      descs[k]->j_seq = seq;
+    }
+  for (k = 0; k < nr; k++)
+    {
+      if (k % per_desc == 0)
+        {
+          desc = descs[k / per_desc];
+          desc->j_count = MIN (per_desc, nr - k);
+          data[n++] = desc;
+        }
+      e = xa_load (&j->j_held, bhs[k]->b_blocknr);
+      desc->j_blocks[k % per_desc] = bhs[k]->b_blocknr;
+      data[n++] = e->e_copy;
+    }
+  for (k = 0; k < n; k++)
+    crc = crc32c (crc, data[k], sb->s_blocksize);
+  descs[ndesc]->j_crc = crc;
+  data[n++] = descs[ndesc];
+
+  err = dummyfs_log_write (sb, j->j_head, NULL, data, n, REQ_PREFLUSH);
+  if (!err)
+    err = blkdev_issue_flush (sb->s_bdev, GFP_NOFS);
+  if (!err)
+    j->j_head += n;
+
+  for (k = 0; k <= ndesc; k++)
+    kfree (descs[k]);
+  kfree (descs);
+  kfree (data);
+
+out:
+  if (!err)
+    j->j_committed = seq;
+  else
+    log_info (FNM, "commit of %llu failed (%d)", seq, err);
+  mutex_unlock (&j->j_commit_mutex);
+  kfree (bhs);
+
+  // Blocks freed in the transaction are free on disk now
+  dummyfs_freed_done (sb, !err);
+
+  return err;
+}
+
+static void
+dummyfs_journal_work (struct work_struct *work)
+{
+  struct dummyfs_journal *j = container_of (
+      to_delayed_work (work), struct dummyfs_journal, j_commit_work);
+
+  dummyfs_journal_commit (j->j_sb);
+}
+
+/*
+ * Start an operation that changes metadata (see struct dummyfs_handle).
+ * Does nothing on a mount without a journal.
+ */
+void
+dummyfs_journal_start (struct super_block *sb, struct dummyfs_handle *h)
+{
+  h->h_journal = DUMMYFS_SB (sb)->s_log;
+  if (!h->h_journal)
+    return;
+
+  // Reclaim can't come back into the filesystem while a handle is held
+  h->h_nofs = memalloc_nofs_save ();
+  down_read (&h->h_journal->j_sem);
+}
+
+/*
+ * Finish an operation started with dummyfs_journal_start. Its changes are
+ * committed with the rest of the running transaction, which is left open
+ * a while for other operations to join.
+ */
+void
+dummyfs_journal_stop (struct dummyfs_handle *h)
+{
+  struct dummyfs_journal *j = h->h_journal;
+
+  if (!j)
+    return;
+
+  up_read (&j->j_sem);
+  memalloc_nofs_restore (h->h_nofs);
+
+  // Doesn't put off a commit that's already due
+  schedule_delayed_work (&j->j_commit_work, JOURNAL_COMMIT_INTERVAL);
+}
+
+/*
+ * Add a changed block to the running transaction (with a handle held), to
+ * be committed to the log rather than written back in place. Writeback
+ * leaves the block alone from now on, and it's only written back in place
+ * from a committed copy.
+ */
+void
+dummyfs_journal_dirty (struct super_block *sb, struct buffer_head *bh)
+{
+  struct dummyfs_journal *j = DUMMYFS_SB (sb)->s_log;
+  unsigned long nr;
+
+  clear_buffer_dirty (bh);
+  set_buffer_journaled (bh);
+  if (test_set_buffer_running (bh))
+    return; // Already in the transaction
+
+  get_bh (bh);
+  mutex_lock (&j->j_list_lock);
+  if (j->j_nr_running == j->j_max_running)
+    {
+      j->j_max_running = MAX (2 * j->j_max_running, 16UL);
+      j->j_running = krealloc (
+          j->j_running, j->j_max_running * sizeof (struct buffer_head *),
+          GFP_NOFS | __GFP_NOFAIL);
+    }
+  j->j_running[j->j_nr_running++] = bh;
+  nr = j->j_nr_running;
+  mutex_unlock (&j->j_list_lock);
+
+  // Commit early rather than let the transaction outgrow the log
+  if (nr >= DUMMYFS_SB (sb)->s_journal_blocks / 4)
+    mod_delayed_work (system_wq, &j->j_commit_work, 0);
+}
+
+/*
+ * Replay the transaction seq from the log at pos, if it was committed:
+ * check the checksum in its commit block, then copy its blocks back in
+ * place (through the buffer cache, for the caller to write out).
+ *
+ * Returns the number of log blocks the transaction takes up, or 0 if
+ * there's no committed transaction seq at pos.
+ */
+static unsigned long
+dummyfs_journal_replay_one (struct super_block *sb, sector_t pos, u64 seq)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_journal_block *jb;
+  struct buffer_head *bh;
+  struct buffer_head *copy_bh;
+  struct buffer_head *home_bh;
+  unsigned long per_desc = MAX_JOURNAL_DESC_SIZE (sb->s_blocksize);
+  unsigned long count;
+  unsigned long k;
+  sector_t end = dummyfs_log_end (sbi);
+  sector_t p;
+  void *copy;
+  void *home;
+  u32 crc = ~0;
+  int committed = false;
+
+  // Follow the descriptors to the commit block, checksumming as we go
+  for (p = pos; p < end && !committed; p += 1 + count)
+    {
+      jb = dummyfs_get_block (sb, p, &bh);
+      if (!jb)
+        return 0;
+      if (!BM_IS_JOURNAL (jb->b_mode) || jb->j_seq != seq)
+        {
+          dummyfs_put_block (bh);
+          return 0;
+        }
+      if (jb->j_kind == JK_COMMIT)
+        {
+          committed = (p > pos && jb->j_crc == crc);
+          dummyfs_put_block (bh);
+          if (!committed)
+            return 0;
+          count = 0;
+          continue;
+        }
+      count = jb->j_count;
+      if (jb->j_kind != JK_DESC || !count || count > per_desc
+          || p + 1 + count >= end)
+        {
+          dummyfs_put_block (bh);
+          return 0;
+        }
+      crc = crc32c (crc, jb, sb->s_blocksize);
+      dummyfs_put_block (bh);
+
+      dummyfs_read_blocks (sb, p + 1, count);
+      for (k = 0; k < count; k++)
+        {
+          copy = dummyfs_get_block (sb, p + 1 + k, &copy_bh);
+          if (!copy)
+            return 0;
+          crc = crc32c (crc, copy, sb->s_blocksize);
+          dummyfs_put_block (copy_bh);
+        }
+    }
+  if (!committed)
+    return 0;
+
+  log_info (FNM, "replaying %llu", seq);
+
+  // The end of the transaction is just past its commit block
+  end = p;
+  for (p = pos; p + 1 < end; p += 1 + count)
+    {
+      jb = dummyfs_get_block (sb, p, &bh);
+      if (!jb)
+        return 0;
+      count = jb->j_count;
+      for (k = 0; k < count; k++)
+        {
+          if (jb->j_blocks[k] >= sbi->s_numblocks)
+            continue;
+          copy = dummyfs_get_block (sb, p + 1 + k, &copy_bh);
+          if (!copy)
+            continue;
+          home = dummyfs_get_new_block (sb, jb->j_blocks[k], &home_bh);
+          if (home)
+            {
+              memcpy (home, copy, sb->s_blocksize);
+              mark_buffer_dirty (home_bh);
+              dummyfs_put_block (home_bh);
+            }
+          dummyfs_put_block (copy_bh);
+        }
+      dummyfs_put_block (bh);
+    }
+
+  return end - pos;
+}
+
+/*
+ * Set up the journal of a mount, if the device has one. Any transactions
+ * committed to the log but not written back in place before the device
+ * was last unmounted are replayed first, and the log started over.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_journal_load (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_journal_block *super;
+  struct dummyfs_journal *j;
+  struct buffer_head *bh;
+  unsigned long n;
+  sector_t pos;
+  u64 seq;
+  int err;
+
+  if (!sbi->s_journal_blocks)
+    {
+      log_info (FNM, "no journal");
+      return 0;
+    }
+
+  super = dummyfs_get_block (sb, sbi->s_journal, &bh);
+  if (!super)
+    return -EIO;
+  if (!BM_IS_JOURNAL (super->b_mode) || super->j_kind != JK_SUPER)
+    {
+      log_info (FNM, "bad journal superblock");
+      dummyfs_put_block (bh);
+      return -EINVAL;
+    }
+  seq = super->j_seq;
+  dummyfs_put_block (bh);
+
+  pos = dummyfs_log_start (sbi);
+  while ((n = dummyfs_journal_replay_one (sb, pos, seq)))
+    {
+      pos += n;
+      seq++;
+    }
+  if (pos != dummyfs_log_start (sbi))
+    {
+      log_info (FNM, "replayed the log up to %llu", seq - 1);
+      err = sync_blockdev (sb->s_bdev);
+      if (!err)
+        err = dummyfs_log_reset (sb, seq);
+      if (err)
+        return err;
+    }
+
+  j = kzalloc (sizeof (struct dummyfs_journal), GFP_KERNEL);
+  if (!j)
+    return -ENOMEM;
+  j->j_sb = sb;
+  init_rwsem (&j->j_sem);
+  mutex_init (&j->j_commit_mutex);
+  mutex_init (&j->j_list_lock);
+  xa_init (&j->j_held);
+  j->j_seq = seq;
+  j->j_committed = seq - 1;
+  j->j_head = dummyfs_log_start (sbi);
+  INIT_DELAYED_WORK (&j->j_commit_work, dummyfs_journal_work);
+  sbi->s_log = j;
+
+  log_info (FNM, "journal of %lu blocks at %llu, from %llu",
+            sbi->s_journal_blocks, sbi->s_journal, seq);
+
+  return 0;
+}
+
+/*
+ * Tear down the journal of a mount, committing what's left and writing
+ * everything back in place, so the log is empty. Anything that can't be
+ * written back is left for the log to replay on the next mount.
+ */
+void
+dummyfs_journal_destroy (struct super_block *sb)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_journal *j;
+  struct dummyfs_journal_entry *e;
+  unsigned long index;
+
+  if (!sbi || !sbi->s_log)
+    return;
+  j = sbi->s_log;
+
+  cancel_delayed_work_sync (&j->j_commit_work);
+  dummyfs_journal_commit (sb);
+  mutex_lock (&j->j_commit_mutex);
+  dummyfs_journal_checkpoint (j, j->j_seq);
+  mutex_unlock (&j->j_commit_mutex);
+
+  xa_for_each (&j->j_held, index, e)
+  {
+    clear_buffer_journaled (e->e_bh);
+    brelse (e->e_bh);
+    kfree (e->e_copy);
+    kfree (e);
+  }
+  xa_destroy (&j->j_held);
+  dummyfs_freed_destroy (sb);
+  kfree (j->j_running);
+  kfree (j);
+  sbi->s_log = NULL;
+}
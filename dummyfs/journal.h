@@ -0,0 +1,79 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#ifndef JOURNAL
+#define JOURNAL
+
+#include <linux/buffer_head.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+
+#include "mod.h"
+
+/*
+ * Changes to metadata blocks are gathered up into a running transaction
+ * and committed to the journal together (along with whatever other
+ * operations joined the same transaction), rather than each block being
+ * written out in place as it changes. A transaction is committed once
+ * it's been open for JOURNAL_COMMIT_INTERVAL, once it grows past a
+ * quarter of the log, or when someone needs it on disk (fsync or sync).
+ */
+#define JOURNAL_COMMIT_INTERVAL (5 * HZ)
+
+enum dummyfs_bh_state_bits
+{
+  BH_Journaled = BH_PrivateStart, // Held by the journal until checkpointed
+  BH_Running,                     // Changed in the running transaction
+};
+
+BUFFER_FNS (Journaled, journaled)
+BUFFER_FNS (Running, running)
+TAS_BUFFER_FNS (Running, running)
+
+// A block committed to the log, but not yet written back in place
+struct dummyfs_journal_entry
+{
+  struct buffer_head *e_bh;
+  void *e_copy; // Its contents as last committed
+};
+
+/*
+ * Operations that change metadata hold a handle (the journal's j_sem,
+ * shared) from start to finish, so a transaction is only ever closed
+ * between operations, never halfway through one. Handles are taken after
+ * the inode lock and any page locks, but before i_chain_sem, and nothing
+ * holding one waits on a page.
+ */
+struct dummyfs_handle
+{
+  struct dummyfs_journal *h_journal;
+  unsigned int h_nofs;
+};
+
+struct dummyfs_journal
+{
+  struct super_block *j_sb;
+  struct rw_semaphore j_sem;   // Shared by handles, exclusive to close
+  struct mutex j_commit_mutex; // Serialises commits and checkpoints
+  struct mutex j_list_lock;    // Guards the running transaction's list
+  struct buffer_head **j_running;
+  unsigned long j_nr_running;
+  unsigned long j_max_running;
+  struct xarray j_held; // Entries by block index, until checkpointed
+  u64 j_seq;            // Sequence number of the running transaction
+  u64 j_committed;      // Last transaction that made it to the disk
+  sector_t j_head;      // Where the next transaction goes in the log
+  struct delayed_work j_commit_work;
+};
+
+int dummyfs_journal_load (struct super_block *);
+void dummyfs_journal_destroy (struct super_block *);
+void dummyfs_journal_start (struct super_block *, struct dummyfs_handle *);
+void dummyfs_journal_stop (struct dummyfs_handle *);
+void dummyfs_journal_dirty (struct super_block *, struct buffer_head *);
+int dummyfs_journal_commit (struct super_block *);
+
+#endif
@@ -6,10 +6,13 @@
 
 #include <linux/blkdev.h>
 #include <linux/module.h>
+#include <linux/slab.h>
 #include <linux/statfs.h>
 
 #include "block.h"
+#include "cache.h"
 #include "inode.h"
+#include "journal.h"
 #include "logging.h"
 #include "mod.h"
 
@@ -17,36 +20,155 @@
 
 MODULE_LICENSE ("GPL");
 
+static struct kmem_cache *dummyfs_inode_cachep;
+
+static struct inode *
+dummyfs_alloc_inode (struct super_block *sb)
+{
+  struct dummyfs_inode_info *di;
+
+  di = kmem_cache_alloc (dummyfs_inode_cachep, GFP_KERNEL);
+  if (!di)
+    return NULL;
+  di->i_flags = 0;
+  return &di->vfs_inode;
+}
+
+static void
+dummyfs_free_inode (struct inode *inode)
+{
+  kmem_cache_free (dummyfs_inode_cachep, DUMMYFS_I (inode));
+}
+
+static void
+dummyfs_inode_init_once (void *obj)
+{
+  struct dummyfs_inode_info *di = obj;
+
+  init_rwsem (&di->i_chain_sem);
+  inode_init_once (&di->vfs_inode);
+}
+
+/*
+ * Let go of an inode no longer in use. If its last link has gone, it's
+ * freed on disk (with its data) now that nothing can reach it any more.
+ * Its pages are dropped before the handle is taken, since dropping them
+ * may wait on their writeback (which needs a handle of its own).
+ */
+static void
+dummyfs_evict_inode (struct inode *inode)
+{
+  struct dummyfs_handle handle;
+
+  truncate_inode_pages_final (inode->i_mapping);
+  if (!inode->i_nlink && !is_bad_inode (inode))
+    {
+      log_info (FNM, "inode %lu has no links left, freeing it on disk",
+                inode->i_ino);
+      dummyfs_journal_start (inode->i_sb, &handle);
+      dummyfs_remove_inode (inode->i_sb, inode->i_ino);
+      dummyfs_journal_stop (&handle);
+    }
+  clear_inode (inode);
+}
+
 static void
 dummyfs_put_super (struct super_block *sb)
 {
   log_info (FNM, "put_super");
+
+  dummyfs_journal_destroy (sb);
+  dummyfs_meta_destroy (sb);
+  kfree (sb->s_fs_info);
+  sb->s_fs_info = NULL;
   return;
 }
 
+/*
+ * Everything but the journal is written out as it changes, so all a sync
+ * has left to do is commit whatever is in the running transaction.
+ */
+static int
+dummyfs_sync_fs (struct super_block *sb, int wait)
+{
+  log_info (FNM, "sync_fs, wait -> %d", wait);
+
+  if (!wait)
+    return 0;
+  return dummyfs_journal_commit (sb);
+}
+
+/*
+ * Report the space and inodes left. The inode tables grow as they fill,
+ * so each free block also counts as room for one more inode.
+ *
+ * Returns 0 on success.
+ */
 static int
 dummyfs_statfs (struct dentry *dentry, struct kstatfs *buf)
 {
+  struct super_block *sb = dentry->d_sb;
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  unsigned long slots;
+  unsigned long used;
+  int err;
+
   log_info (FNM, "statfs");
 
+  err = dummyfs_count_inodes (sb, &slots, &used);
+  if (err)
+    return err;
+
+  buf->f_type = DUMMYFS_MAGIC;
+  buf->f_bsize = sb->s_blocksize;
+  buf->f_blocks = sbi->s_numblocks;
+  mutex_lock (&sbi->s_alloc_lock);
+  buf->f_bfree = sbi->s_free_blocks;
+  mutex_unlock (&sbi->s_alloc_lock);
+  buf->f_bavail = buf->f_bfree;
+  buf->f_ffree = slots - used + buf->f_bfree;
+  buf->f_files = used + buf->f_ffree;
   buf->f_namelen = MAX_NAME_SIZE;
   return 0;
 }
 
 struct file_operations dummyfs_file_operations = {
-  .read = dummyfs_file_read,
-  .write = dummyfs_file_write,
+  .llseek = dummyfs_file_llseek,
+  .open = dummyfs_file_open,
+  .release = dummyfs_file_release,
+  .read_iter = dummyfs_file_read_iter,
+  .write_iter = dummyfs_file_write_iter,
+  .mmap = generic_file_mmap,
+  .fsync = dummyfs_fsync,
+  .splice_read = generic_file_splice_read,
+  .splice_write = iter_file_splice_write,
+  .copy_file_range = dummyfs_copy_file_range,
+  .remap_file_range = dummyfs_remap_file_range,
+  .fallocate = dummyfs_fallocate,
+  .unlocked_ioctl = dummyfs_ioctl,
+};
+
+struct address_space_operations dummyfs_file_aops = {
+  .readpage = dummyfs_readpage,
+  .writepage = dummyfs_writepage,
+  .writepages = dummyfs_writepages,
+  .set_page_dirty = __set_page_dirty_nobuffers,
+  .write_begin = dummyfs_write_begin,
+  .write_end = dummyfs_write_end,
+  .direct_IO = dummyfs_direct_IO,
 };
 
 struct inode_operations dummyfs_file_inode_operations = {
-  //       truncate: dummyfs_truncate,
+  .setattr = dummyfs_setattr,
+  .fiemap = dummyfs_fiemap,
 };
 
 struct file_operations dummyfs_dir_operations = {
   .llseek = generic_file_llseek,
   .read = generic_read_dir,
   .iterate = dummyfs_readdir,
-  .fsync = generic_file_fsync,
+  .fsync = dummyfs_fsync,
+  .unlocked_ioctl = dummyfs_ioctl,
 };
 
 struct inode_operations dummyfs_dir_inode_operations = {
@@ -59,7 +181,11 @@ struct inode_operations dummyfs_dir_inode_operations = {
 };
 
 struct super_operations dummyfs_ops = {
+  .alloc_inode = dummyfs_alloc_inode,
+  .free_inode = dummyfs_free_inode,
+  .evict_inode = dummyfs_evict_inode,
   .statfs = dummyfs_statfs,
+  .sync_fs = dummyfs_sync_fs,
   .put_super = dummyfs_put_super,
 };
 
@@ -250,14 +376,25 @@ dummyfs_init (void)
 
   log_info (FNM, "registering dummyfs");
 
+  dummyfs_inode_cachep = kmem_cache_create (
+      "dummyfs_inode_cache", sizeof (struct dummyfs_inode_info), 0,
+      SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+      dummyfs_inode_init_once);
+  if (!dummyfs_inode_cachep)
+    return -ENOMEM;
+
   rc = register_filesystem (&dumdbfs_type);
 
   if (rc != 0)
     goto out;
 
   rc = register_filesystem (&dummyfs_type);
+  if (rc != 0)
+    unregister_filesystem (&dumdbfs_type);
 
 out:
+  if (rc != 0)
+    kmem_cache_destroy (dummyfs_inode_cachep);
   return rc;
 }
 
@@ -267,6 +404,10 @@ dummyfs_exit (void)
   log_info (FNM, "unregistering dummyfs");
   unregister_filesystem (&dumdbfs_type);
   unregister_filesystem (&dummyfs_type);
+
+  // Inodes are freed after an RCU grace period, so wait for the last ones
+  rcu_barrier ();
+  kmem_cache_destroy (dummyfs_inode_cachep);
 }
 
 module_init (dummyfs_init);
@@ -7,40 +7,82 @@
 #ifndef MOD
 #define MOD
 
-#define BLOCKSIZE 512
-#define BLOCKSIZE_BITS 8
+#define MIN_BLOCKSIZE_BITS 9  // 512 bytes
+#define MAX_BLOCKSIZE_BITS 16 // 64 KiB
+#define DEFAULT_BLOCKSIZE_BITS MIN_BLOCKSIZE_BITS
+#define MIN_BLOCKSIZE (1 << MIN_BLOCKSIZE_BITS)
 #define MAX_NAME_SIZE 40
 
-#define BLOCK_HEADER_SIZE (sizeof (__u8))
-#define BLOCK_TRAILER_SIZE (sizeof (__u32))
-#define TABLE_HEADER_SIZE (3 * sizeof (__u8) + sizeof (__u32))
-#define INODE_HEADER_SIZE                                                     \
-  (2 * sizeof (__u8) + 3 * sizeof (__u16) + 2 * sizeof (__u32))
-#define MAX_BLOCK_DATA_SIZE                                                   \
-  (BLOCKSIZE - BLOCK_HEADER_SIZE - BLOCK_TRAILER_SIZE)
-#define MAX_TABLE_SIZE                                                        \
-  ((BLOCKSIZE - BLOCK_HEADER_SIZE - TABLE_HEADER_SIZE - BLOCK_TRAILER_SIZE)   \
-   / (sizeof (__u32)))
-#define MAX_INODE_DATA_SIZE                                                   \
-  ((BLOCKSIZE - BLOCK_HEADER_SIZE - INODE_HEADER_SIZE - BLOCK_TRAILER_SIZE)   \
-   - 8)
+/*
+ * Every block starts with a fixed-size header (the block mode and the
+ * index of the next block in its linked list), so the space left for
+ * data depends on the block size the device was formatted with. These
+ * are worked out once at mount time (see struct dummyfs_sb_info).
+ */
+#define BLOCK_HEADER_SIZE (sizeof (struct dummyfs_block))
+#define TABLE_HEADER_SIZE (sizeof (struct dummyfs_inode_table))
+#define INODE_HEADER_SIZE (sizeof (struct dummyfs_inode))
+#define MAX_BLOCK_DATA_SIZE(bs) ((bs)-BLOCK_HEADER_SIZE)
+#define MAX_TABLE_SIZE(bs) (((bs)-TABLE_HEADER_SIZE) / sizeof (__u64))
+#define MAX_INODE_DATA_SIZE(bs) ((bs)-INODE_HEADER_SIZE)
+
+/*
+ * A device can instead be formatted with a fixed inode size, in which
+ * case every inode block is a group of inodes that size (see struct
+ * dummyfs_inode_group), each with whatever room is left after its header
+ * for inline data (possibly none).
+ */
+#define GROUP_HEADER_SIZE (sizeof (struct dummyfs_inode_group))
+#define INODES_PER_GROUP(bs, size) (((bs)-GROUP_HEADER_SIZE) / (size))
+#define GROUP_INODE(group, size, k)                                           \
+  ((struct dummyfs_inode *)((char *)(group) + GROUP_HEADER_SIZE              \
+                            + (k) * (size)))
 
 #define TABLE_BLOCK_INDEX 0
 #define ROOT_DIR_BLOCK_INDEX 1
+#define BITMAP_BLOCK_INDEX 2
+
+/*
+ * Which blocks are in use is tracked by an allocation bitmap: a run of
+ * BM_BITMAP blocks (starting at BITMAP_BLOCK_INDEX) whose data holds one
+ * bit per block on the device, in little-endian bit order, set for
+ * blocks that are in use.
+ */
+#define BITMAP_BITS_PER_BLOCK(bs) (MAX_BLOCK_DATA_SIZE (bs) * 8)
+
+/*
+ * The journal (see struct dummyfs_journal_block) is a run of blocks right
+ * after the allocation bitmap. A device can be formatted without one, in
+ * which case changed blocks are written straight back in place.
+ */
+#define MIN_JOURNAL_BLOCKS 4
 
 #define BM_EMPTY 0x01
 #define BM_TABLE 0x02
 #define BM_INODE 0x04
 #define BM_DATA 0x08
+#define BM_BITMAP 0x10
 #define BM_UNALLOCATED 0xff
 #define BM_RESERVED 0x20
+#define BM_JOURNAL 0x40
+#define BM_PACKED 0x80
 
 #define BM_IS_EMPTY(a) (BM_EMPTY & a)
 #define BM_IS_TABLE(a) (BM_TABLE & a)
 #define BM_IS_INODE(a) (BM_INODE & a)
 #define BM_IS_DATA(a) (BM_DATA & a)
-#define BM_IS_UNALLOCATED(a) ((BM_UNALLOCATED & a) == BM_UNALLOCATED)
+#define BM_IS_BITMAP(a) (BM_BITMAP & a)
 #define BM_IS_RESERVED(a) (BM_RESERVED & a)
+#define BM_IS_JOURNAL(a) (BM_JOURNAL & a)
+#define BM_IS_PACKED(a) (BM_PACKED & a)
+
+/*
+ * Block pointers are 64 bits wide, and a pointer with every bit set marks
+ * the end of a linked list (or an unused inode table entry). Any other
+ * value, including one ending in 0xff, is a real block index.
+ */
+#define BLOCK_UNALLOCATED (~(__u64)0)
+#define BLOCK_IS_UNALLOCATED(a) ((a) == BLOCK_UNALLOCATED)
 
 #define IM_REG 0x1
 #define IM_DIR 0x2
@@ -48,54 +90,273 @@
 #define IM_IS_REG(a) (IM_REG & a)
 #define IM_IS_DIR(a) (IM_DIR & a)
 
+// Inode flags (i_flags)
+#define IF_COMPRESSED 0x1 // Data is written in compressed clusters
+#define IF_SHARED 0x2     // Blocks may be shared with a clone
+
+#define IF_IS_COMPRESSED(a) (IF_COMPRESSED & a)
+#define IF_IS_SHARED(a) (IF_SHARED & a)
+
+// Data block flags (b_flags)
+#define BF_COMPRESSED 0x1 // First block of a compressed cluster
+
+#define BF_IS_COMPRESSED(a) (BF_COMPRESSED & a)
+
+/*
+ * A compressed file's data past its inline data is split into clusters of
+ * CLUSTER_BLOCKS data blocks' worth each, which are compressed (or not)
+ * as a whole. See compress.c.
+ */
+#define CLUSTER_BLOCKS(bs) MAX (4, 16384 / (bs))
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 #define true 1
 #define false 0
 
+#define DUMMYFS_MAGIC 0x19920341
+#define DUMMYFS_VERSION 10
 #define DUMDBFS_MAGIC 0x19920342
 #define TMPSIZE 20
 
+#include <linux/ioctl.h>
 #include <linux/types.h>
 
+/*
+ * Move a regular file's data blocks into a single run of free blocks, in
+ * order, so that reading it through is one sequential sweep of the device
+ * (see utils/defrag.dummyfs.c). Returns the number of blocks moved.
+ */
+#define DUMMYFS_IOC_DEFRAG _IO ('D', 1)
+
+/*
+ * The b_mode and b_next fields sit at the same offset in every kind of
+ * block, so any block can be treated as a struct dummyfs_block when
+ * following a linked list.
+ *
+ * b_index is only used by data blocks: it's the position of the block in
+ * its file, whose data it holds from i_data's worth of bytes plus b_index
+ * blocks' worth of bytes onwards. A file's data blocks are linked in
+ * order of b_index, and anything the blocks don't cover (a gap in the
+ * list, or the end of the file past the last block) reads as zeros.
+ * b_flags is also only used by data blocks, as is b_refs: the number of
+ * pointers to the block (from inodes or other blocks) beyond the first.
+ * Clones share the tail of a list of blocks (see dummyfs_clone_data), so
+ * a block with b_refs set belongs to every file whose list reaches it,
+ * as does everything after it.
+ */
 struct dummyfs_block
 {
   __u8 b_mode;
-  unsigned char b_data[MAX_BLOCK_DATA_SIZE];
-  __u32 b_next;
+  __u8 b_flags;
+  __u16 b_refs;
+  __u32 b_index;
+  __u64 b_next;
+  unsigned char b_data[];
 };
 
+/*
+ * The first inode table (at TABLE_BLOCK_INDEX) doubles as the
+ * superblock, so it also records the geometry of the device, where the
+ * allocation bitmap and the journal are, and how inodes are laid out.
+ *
+ * Each table entry is the block holding that inode, which is the inode
+ * itself unless the device has a fixed inode size (t_inode_size), in
+ * which case it's the group the inode is in.
+ */
 struct dummyfs_inode_table
 {
   __u8 b_mode;
-  __u8 t_padding[3];
-  __u32 t_numblocks;
-  __u32 t_table[MAX_TABLE_SIZE];
-  __u32 b_next;
+  __u8 t_blocksize_bits;
+  __u8 t_version;
+  __u8 t_padding;
+  __u32 t_magic;
+  __u64 b_next;
+  __u64 t_numblocks;
+  __u64 t_bitmap;
+  __u64 t_bitmap_blocks;
+  __u64 t_journal;
+  __u64 t_journal_blocks; // 0 if the device has no journal
+  __u32 t_inode_size;     // 0 for a block per inode
+  __u32 t_padding2;
+  __u64 t_table[];
+};
+
+#define JK_SUPER 1
+#define JK_DESC 2
+#define JK_COMMIT 3
+
+/*
+ * The first block of the journal (JK_SUPER) gives the sequence number of
+ * the first transaction in the log, which takes up the rest of the
+ * journal. Transactions are written one after another from the start of
+ * the log, each as one or more descriptors (JK_DESC) listing where the
+ * blocks copied after them belong, and then a commit block (JK_COMMIT)
+ * holding a checksum of the lot. Only transactions with a good commit
+ * block, numbered one after another from j_seq, are replayed on mount.
+ * Once every block in the log has been written back in place, the log is
+ * started over from the beginning under a new j_seq.
+ */
+struct dummyfs_journal_block
+{
+  __u8 b_mode;
+  __u8 j_kind;
+  __u8 j_padding[2];
+  __u32 j_count; // Blocks listed in a descriptor
+  __u64 b_next;
+  __u64 j_seq;
+  __u32 j_crc; // crc32c of a transaction's descriptors and copies
+  __u32 j_padding2;
+  __u64 j_blocks[];
 };
 
+#define MAX_JOURNAL_DESC_SIZE(bs)                                             \
+  (((bs)-sizeof (struct dummyfs_journal_block)) / sizeof (__u64))
+
+/*
+ * i_tail is the last data block at or before the end of the file (or
+ * BLOCK_UNALLOCATED if there's none), and i_tail_index is its b_index.
+ * Together they let appends go straight to the end of the file without
+ * walking the linked list of data blocks. Any blocks after the tail were
+ * preallocated past the end of the file.
+ *
+ * Everything in a file's blocks past the end of the file is kept zeroed,
+ * so a file can grow without having to write anything but its inode.
+ *
+ * A small file can instead keep what doesn't fit inline packed into a
+ * shared block: i_pack is then the BM_PACKED block holding it, and
+ * i_pack_slot its slot there (see struct dummyfs_packed_block). A packed
+ * file has no data blocks of its own.
+ */
 struct dummyfs_inode
 {
   __u8 b_mode;
-  __u32 i_ino;
   __u8 i_kind;
+  __u8 i_links;
+  __u8 i_flags;
+  __u32 i_ino;
+  __u64 b_next;
   __u16 i_mode;
   __u16 i_uid;
   __u16 i_gid;
-  __u8 i_links;
-  __u32 i_size;
-  unsigned char i_data[MAX_INODE_DATA_SIZE];
-  __u32 b_next;
+  __u16 i_padding2;
+  __u64 i_size;
+  __u64 i_tail;
+  __u32 i_tail_index;
+  __u32 i_pack_slot;
+  __u64 i_pack;
+  unsigned char i_data[];
+};
+
+/*
+ * An inode group packs several fixed-size inodes into one block, placed
+ * near the directory they were created in, so looking at a directory's
+ * inodes reads a block per group rather than a block per inode. Each
+ * inode in the group keeps its own b_next (the first block of its data),
+ * and a free place in the group is all zeros. The group's own b_next is
+ * unused.
+ */
+struct dummyfs_inode_group
+{
+  __u8 b_mode;
+  __u8 g_padding;
+  __u16 g_used; // Inodes in the group
+  __u32 g_padding2;
+  __u64 b_next;
+  unsigned char g_inodes[];
+};
+
+/*
+ * A packed block holds the ends of several small files (all of whatever
+ * doesn't fit inline, up to MAX_PACK_SIZE bytes). The slot table grows
+ * from the front of the block and the fragments are packed in from the
+ * back; a slot with no length is free. Files refer to their fragment by
+ * slot, so fragments can be moved around within the block (to gather up
+ * the free space between them) without touching the files.
+ */
+struct dummyfs_pack_slot
+{
+  __u32 s_ino; // Owner of the fragment
+  __u16 s_off; // Where the fragment starts in the block
+  __u16 s_len;
+};
+
+struct dummyfs_packed_block
+{
+  __u8 b_mode;
+  __u8 p_padding;
+  __u16 p_slots; // Slots in the table, in use or not
+  __u32 p_padding2;
+  __u64 b_next;
+  struct dummyfs_pack_slot p_slot[];
 };
 
+#define PACKED_HEADER_SIZE (sizeof (struct dummyfs_packed_block))
+#define MAX_PACK_SIZE(bs) (MAX_BLOCK_DATA_SIZE (bs) / 2)
+
 struct dummyfs_dir_listing
 {
   char l_name[MAX_NAME_SIZE + 1];
   __u32 l_ino;
 };
 
+#ifdef __KERNEL__
+struct dummyfs_meta_cache;
+struct dummyfs_journal;
+
+struct dummyfs_sb_info
+{
+  sector_t s_numblocks;
+  unsigned long s_max_block_data_size;
+  unsigned long s_max_table_size;
+  unsigned long s_max_inode_data_size;
+  atomic64_t s_chain_gen; // Bumped whenever a linked list of blocks is freed
+  struct dummyfs_meta_cache *s_meta; // Decoded metadata (see cache.h)
+  sector_t s_bitmap;                 // First block of the allocation bitmap
+  unsigned long s_bitmap_blocks;
+  unsigned long s_bitmap_bits; // Blocks covered by each bitmap block
+  sector_t s_alloc_hint;       // Where the next allocation search starts
+  sector_t s_free_blocks;      // Blocks clear in the bitmap
+  struct mutex s_alloc_lock;
+  sector_t s_journal; // First block of the journal
+  unsigned long s_journal_blocks;
+  struct dummyfs_journal *s_log; // NULL without a journal (see journal.h)
+  sector_t s_pack_hint; // Packed block to try first, or 0 for none
+  struct mutex s_pack_lock;
+  unsigned long s_inode_size; // 0 for a block per inode
+  int s_compress; // New files are compressed (see compress.c)
+  sector_t s_group_hint; // Inode group to try first, or 0 for none
+  struct mutex s_group_lock;
+  struct mutex s_share_lock;     // Taken to change b_refs
+  int s_discard;                 // Discard blocks as they're freed
+  struct list_head s_freed;      // Runs freed since the last commit (alloc.c)
+  struct list_head s_committing; // Runs freed in the commit under way
+};
+
+#define DUMMYFS_SB(sb) ((struct dummyfs_sb_info *)(sb)->s_fs_info)
+
+/*
+ * The in-memory side of a dummyfs inode. Page writeback changes a file's
+ * linked list of data blocks (and its size and tail on disk) without
+ * holding the inode lock, so i_chain_sem guards those instead. It's taken
+ * after the inode lock and after any page locks, and nothing that can
+ * fault on user memory or wait on a page is done while holding it.
+ */
+struct dummyfs_inode_info
+{
+  struct rw_semaphore i_chain_sem;
+  unsigned int i_flags; // i_flags of the inode on disk
+  struct inode vfs_inode;
+};
+
+#define DUMMYFS_I(inode)                                                      \
+  container_of (inode, struct dummyfs_inode_info, vfs_inode)
+#endif
+
 extern struct inode_operations dummyfs_file_inode_operations;
 extern struct file_operations dummyfs_file_operations;
+extern struct address_space_operations dummyfs_file_aops;
 extern struct inode_operations dummyfs_dir_inode_operations;
 extern struct file_operations dummyfs_dir_operations;
 extern struct super_operations dummyfs_ops;
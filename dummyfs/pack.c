@@ -0,0 +1,577 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "logging.h"
+#include "mod.h"
+#include "pack.h"
+
+#define FNM "pack"
+
+/*
+ * Whatever doesn't fit inline in a small file is packed in with the ends
+ * of other small files (see struct dummyfs_packed_block), rather than
+ * each getting a nearly empty data block of its own. A tree of small
+ * files then takes far fewer blocks, and reading them mostly hits packed
+ * blocks that are already cached. All changes to packed blocks on a mount
+ * are serialised by s_pack_lock, which is taken after i_chain_sem and
+ * before s_alloc_lock.
+ */
+
+// Bytes taken up by the fragments in a packed block
+static unsigned long
+dummyfs_pack_used (struct dummyfs_packed_block *p)
+{
+  unsigned long used = 0;
+  int k;
+
+  for (k = 0; k < p->p_slots; k++)
+    used += p->p_slot[k].s_len;
+  return used;
+}
+
+// The first free slot in a packed block (p_slots if there's none)
+static int
+dummyfs_pack_free_slot (struct dummyfs_packed_block *p)
+{
+  int k;
+
+  for (k = 0; k < p->p_slots; k++)
+    if (!p->p_slot[k].s_len)
+      break;
+  return k;
+}
+
+/*
+ * Work out the biggest fragment that would fit in a packed block, once
+ * the free space between its fragments is gathered up.
+ */
+static unsigned long
+dummyfs_pack_room (struct super_block *sb, struct dummyfs_packed_block *p)
+{
+  unsigned long slots = p->p_slots;
+  unsigned long taken;
+
+  if (dummyfs_pack_free_slot (p) == p->p_slots)
+    {
+      if (p->p_slots == MAX_PACK_SLOTS)
+        return 0;
+      slots++;
+    }
+  taken = PACKED_HEADER_SIZE + slots * sizeof (struct dummyfs_pack_slot)
+          + dummyfs_pack_used (p);
+
+  return (taken < sb->s_blocksize) ? sb->s_blocksize - taken : 0;
+}
+
+// Find the fragment of a packed file, checking it really is the file's
+static struct dummyfs_pack_slot *
+dummyfs_pack_slot (struct dummyfs_packed_block *p,
+                   struct dummyfs_inode *inode)
+{
+  if (!BM_IS_PACKED (p->b_mode) || inode->i_pack_slot >= p->p_slots
+      || p->p_slot[inode->i_pack_slot].s_ino != inode->i_ino)
+    {
+      log_info (FNM, "inode %u has no fragment in %llu", inode->i_ino,
+                inode->i_pack);
+      return NULL;
+    }
+  return &p->p_slot[inode->i_pack_slot];
+}
+
+/*
+ * Move the fragments in a packed block to the back of it, one after
+ * another, so that all of its free space is in one piece. The fragments
+ * are moved from the back of the block down, so each one only ever moves
+ * over itself or over space that's already free.
+ *
+ * Returns where the fragments now start.
+ */
+static unsigned long
+dummyfs_pack_gather (struct super_block *sb, struct dummyfs_packed_block *p)
+{
+  unsigned long end = sb->s_blocksize;
+  unsigned long limit = sb->s_blocksize;
+  int best;
+  int k;
+
+  while (true)
+    {
+      // The fragment starting furthest back, of those not moved yet
+      best = -1;
+      for (k = 0; k < p->p_slots; k++)
+        if (p->p_slot[k].s_len && p->p_slot[k].s_off < limit
+            && (best < 0 || p->p_slot[k].s_off > p->p_slot[best].s_off))
+          best = k;
+      if (best < 0)
+        break;
+
+      limit = p->p_slot[best].s_off;
+      end -= p->p_slot[best].s_len;
+      memmove ((char *)p + end, (char *)p + p->p_slot[best].s_off,
+               p->p_slot[best].s_len);
+      p->p_slot[best].s_off = end;
+    }
+
+  return end;
+}
+
+/*
+ * Add a fragment to a packed block with room for it (see
+ * dummyfs_pack_room), gathering up the block's free space first if
+ * there's no gap big enough for it.
+ *
+ * Returns the slot it went into.
+ */
+static u32
+dummyfs_pack_add (struct super_block *sb, struct dummyfs_packed_block *p,
+                  u32 ino, const char *data, unsigned long len)
+{
+  unsigned long table;
+  unsigned long start = sb->s_blocksize;
+  int slot = dummyfs_pack_free_slot (p);
+  int k;
+
+  table = PACKED_HEADER_SIZE
+          + MAX (p->p_slots, slot + 1) * sizeof (struct dummyfs_pack_slot);
+  for (k = 0; k < p->p_slots; k++)
+    if (p->p_slot[k].s_len)
+      start = MIN (start, (unsigned long)p->p_slot[k].s_off);
+  if (start < table + len)
+    start = dummyfs_pack_gather (sb, p);
+
+  start -= len;
+  memcpy ((char *)p + start, data, len);
+  p->p_slot[slot].s_ino = ino;
+  p->p_slot[slot].s_off = start;
+  p->p_slot[slot].s_len = len;
+  if (slot == p->p_slots)
+    p->p_slots++;
+
+  return slot;
+}
+
+// Free a slot in a packed block, shrinking the slot table if it can
+static void
+dummyfs_pack_del (struct dummyfs_packed_block *p, u32 slot)
+{
+  p->p_slot[slot].s_ino = 0;
+  p->p_slot[slot].s_len = 0;
+  while (p->p_slots && !p->p_slot[p->p_slots - 1].s_len)
+    p->p_slots--;
+}
+
+/*
+ * Take a file's fragment out of its packed block, and give the block back
+ * once there's nothing left in it (with s_pack_lock held). Without a
+ * journal, an emptied block is marked as such on the device, the same as
+ * any other block that's freed.
+ */
+static void
+dummyfs_pack_drop (struct super_block *sb, struct dummyfs_inode *inode)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct buffer_head *bh;
+  sector_t index = inode->i_pack;
+
+  p = dummyfs_get_block (sb, index, &bh);
+  if (p && dummyfs_pack_slot (p, inode))
+    dummyfs_pack_del (p, inode->i_pack_slot);
+  inode->i_pack = BLOCK_UNALLOCATED;
+  inode->i_pack_slot = 0;
+  if (!p)
+    return;
+
+  if (p->p_slots)
+    {
+      dummyfs_dirty_block (sb, bh);
+      dummyfs_put_block (bh);
+      if (!sbi->s_pack_hint)
+        sbi->s_pack_hint = index; // There's room here now
+      return;
+    }
+
+  log_info (FNM, "packed block %llu is empty", index);
+  if (sbi->s_pack_hint == index)
+    sbi->s_pack_hint = 0;
+  dummyfs_put_block (bh);
+  dummyfs_free_blocks (sb, index, 1);
+}
+
+/*
+ * Store a file's fragment (replacing any it has already). It stays in the
+ * same packed block if there's room there, or goes into the packed block
+ * that was used last, or failing that, a new one (with s_pack_lock held).
+ *
+ * Returns 0 on success.
+ */
+static int
+dummyfs_pack_store (struct super_block *sb, struct dummyfs_inode *inode,
+                    const char *data, unsigned long len)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot saved;
+  struct buffer_head *bh;
+  sector_t index = inode->i_pack;
+  u16 slots;
+  u32 slot;
+
+  if (!BLOCK_IS_UNALLOCATED (index))
+    {
+      p = dummyfs_get_block (sb, index, &bh);
+      if (!p)
+        return -EIO;
+      if (!dummyfs_pack_slot (p, inode))
+        {
+          dummyfs_put_block (bh);
+          return -EIO;
+        }
+
+      // Try swapping the old fragment for the new one in place
+      saved = p->p_slot[inode->i_pack_slot];
+      slots = p->p_slots;
+      dummyfs_pack_del (p, inode->i_pack_slot);
+      if (dummyfs_pack_room (sb, p) >= len)
+        {
+          inode->i_pack_slot = dummyfs_pack_add (sb, p, inode->i_ino, data,
+                                                 len);
+          dummyfs_dirty_block (sb, bh);
+          dummyfs_put_block (bh);
+          return 0;
+        }
+      p->p_slot[inode->i_pack_slot] = saved;
+      p->p_slots = slots;
+      dummyfs_put_block (bh);
+    }
+
+  // Otherwise, anywhere with room will do
+  index = sbi->s_pack_hint;
+  p = NULL;
+  if (index && index != inode->i_pack)
+    {
+      p = dummyfs_get_block (sb, index, &bh);
+      if (p && (!BM_IS_PACKED (p->b_mode) || dummyfs_pack_room (sb, p) < len))
+        {
+          dummyfs_put_block (bh);
+          p = NULL;
+        }
+    }
+  if (!p)
+    {
+      index = dummyfs_empty_block (sb);
+      if (!index)
+        return -ENOSPC;
+      p = dummyfs_get_new_block (sb, index, &bh);
+      if (!p)
+        {
+          dummyfs_free_blocks (sb, index, 1);
+          return -ENOMEM;
+        }
+      p->b_mode = BM_PACKED;
+      p->b_next = BLOCK_UNALLOCATED;
+      log_info (FNM, "new packed block %llu", index);
+    }
+
+  slot = dummyfs_pack_add (sb, p, inode->i_ino, data, len);
+  dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
+  sbi->s_pack_hint = index;
+
+  // The new fragment is on disk, so the old one can go
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    dummyfs_pack_drop (sb, inode);
+  inode->i_pack = index;
+  inode->i_pack_slot = slot;
+
+  return 0;
+}
+
+/*
+ * Check whether a file could have what doesn't fit inline packed, once
+ * it's end bytes long: it can't have any data blocks of its own, and no
+ * more than MAX_PACK_SIZE bytes can be outside of the inode.
+ */
+int
+dummyfs_pack_fits (struct super_block *sb, struct dummyfs_inode *inode,
+                   loff_t end)
+{
+  unsigned long inline_size = DUMMYFS_SB (sb)->s_max_inode_data_size;
+
+  end = MAX (end, (loff_t)inode->i_size);
+  return BLOCK_IS_UNALLOCATED (inode->b_next) && end > inline_size
+         && end - inline_size <= MAX_PACK_SIZE (sb->s_blocksize);
+}
+
+/*
+ * Read part of a packed file's fragment into an iov_iter, starting off
+ * bytes past the inline data. Anything past the end of the fragment reads
+ * as zeros.
+ *
+ * Returns the amount read, or a negative error.
+ */
+ssize_t
+dummyfs_pack_read (struct super_block *sb, struct dummyfs_inode *inode,
+                   loff_t off, size_t count, struct iov_iter *to)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct buffer_head *bh;
+  size_t done = 0;
+  size_t n = 0;
+  int err = 0;
+
+  mutex_lock (&sbi->s_pack_lock);
+  p = dummyfs_get_block (sb, inode->i_pack, &bh);
+  if (!p)
+    {
+      err = -EIO;
+      goto out;
+    }
+  slot = dummyfs_pack_slot (p, inode);
+  if (!slot)
+    {
+      dummyfs_put_block (bh);
+      err = -EIO;
+      goto out;
+    }
+  if (off < slot->s_len)
+    {
+      n = MIN (count, (size_t)(slot->s_len - off));
+      done = copy_to_iter ((char *)p + slot->s_off + off, n, to);
+    }
+  dummyfs_put_block (bh);
+
+out:
+  mutex_unlock (&sbi->s_pack_lock);
+
+  if (!err && done == n && count > n)
+    done += iov_iter_zero (count - n, to);
+  if (!err && done != count)
+    err = -EFAULT;
+
+  return done ? done : err;
+}
+
+/*
+ * Find where a packed file's fragment is on the device (for FIEMAP).
+ *
+ * Returns the byte address of the fragment (with its length in *len), or
+ * 0 if it can't be found.
+ */
+u64
+dummyfs_pack_locate (struct super_block *sb, struct dummyfs_inode *inode,
+                     size_t *len)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct buffer_head *bh;
+  u64 where = 0;
+
+  mutex_lock (&sbi->s_pack_lock);
+  p = dummyfs_get_block (sb, inode->i_pack, &bh);
+  if (p)
+    {
+      slot = dummyfs_pack_slot (p, inode);
+      if (slot)
+        {
+          where = ((u64)inode->i_pack << sb->s_blocksize_bits) + slot->s_off;
+          *len = slot->s_len;
+        }
+      dummyfs_put_block (bh);
+    }
+  mutex_unlock (&sbi->s_pack_lock);
+
+  return where;
+}
+
+/*
+ * Write data from an iov_iter into a small file's fragment, starting off
+ * bytes past the inline data, packing the file for the first time if it
+ * hasn't been yet. The caller checks that the file still fits (see
+ * dummyfs_pack_fits) and writes out the inode afterwards.
+ *
+ * Returns the amount written, or a negative error.
+ */
+ssize_t
+dummyfs_pack_write (struct super_block *sb, struct dummyfs_inode *inode,
+                    loff_t off, struct iov_iter *from)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct buffer_head *bh;
+  unsigned long len = 0;
+  size_t copied;
+  char *buf;
+  int err;
+
+  log_info (FNM, "writing fragment of inode %u (%lld+%zu)", inode->i_ino,
+            off, iov_iter_count (from));
+
+  buf = kzalloc (MAX_PACK_SIZE (sb->s_blocksize), GFP_NOFS);
+  if (!buf)
+    return -ENOMEM;
+
+  mutex_lock (&sbi->s_pack_lock);
+
+  // Start from the fragment as it is
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    {
+      p = dummyfs_get_block (sb, inode->i_pack, &bh);
+      slot = p ? dummyfs_pack_slot (p, inode) : NULL;
+      if (!slot)
+        {
+          if (p)
+            dummyfs_put_block (bh);
+          err = -EIO;
+          goto out;
+        }
+      len = slot->s_len;
+      memcpy (buf, (char *)p + slot->s_off, len);
+      dummyfs_put_block (bh);
+    }
+
+  copied = copy_from_iter (buf + off, iov_iter_count (from), from);
+  if (!copied)
+    {
+      err = -EFAULT;
+      goto out;
+    }
+  len = MAX (len, (unsigned long)(off + copied));
+  err = dummyfs_pack_store (sb, inode, buf, len);
+
+out:
+  mutex_unlock (&sbi->s_pack_lock);
+  kfree (buf);
+
+  return err ? err : copied;
+}
+
+/*
+ * Cut a packed file's fragment down to len bytes, dropping it altogether
+ * if len is 0.
+ *
+ * Returns 0 on success.
+ */
+int
+dummyfs_pack_truncate (struct super_block *sb, struct dummyfs_inode *inode,
+                       unsigned long len)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct buffer_head *bh;
+  int err = 0;
+
+  if (BLOCK_IS_UNALLOCATED (inode->i_pack))
+    return 0;
+
+  mutex_lock (&sbi->s_pack_lock);
+  if (!len)
+    {
+      dummyfs_pack_drop (sb, inode);
+      goto out;
+    }
+
+  p = dummyfs_get_block (sb, inode->i_pack, &bh);
+  if (!p)
+    {
+      err = -EIO;
+      goto out;
+    }
+  slot = dummyfs_pack_slot (p, inode);
+  if (!slot)
+    {
+      err = -EIO;
+    }
+  else if (len < slot->s_len)
+    {
+      slot->s_len = len;
+      dummyfs_dirty_block (sb, bh);
+    }
+  dummyfs_put_block (bh);
+
+out:
+  mutex_unlock (&sbi->s_pack_lock);
+
+  return err;
+}
+
+/*
+ * Move a packed file's fragment out into a data block of its own, for
+ * when the file outgrows packing (or is about to have blocks of its own
+ * some other way). The data block is written out before the file points
+ * at it, and the inode is written out after.
+ *
+ * Returns 0 on success (including if the file wasn't packed).
+ */
+int
+dummyfs_unpack_data (struct super_block *sb, struct buffer_head *inode_bh,
+                     struct dummyfs_inode *inode)
+{
+  struct dummyfs_sb_info *sbi = DUMMYFS_SB (sb);
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct dummyfs_block *block;
+  struct buffer_head *pack_bh;
+  struct buffer_head *bh;
+  unsigned long got;
+  sector_t index;
+
+  if (BLOCK_IS_UNALLOCATED (inode->i_pack))
+    return 0;
+
+  log_info (FNM, "unpacking inode %u", inode->i_ino);
+
+  index = dummyfs_alloc_blocks (sb, inode_bh->b_blocknr + 1, 1, &got);
+  if (!index)
+    return -ENOSPC;
+  block = dummyfs_get_new_block (sb, index, &bh);
+  if (!block)
+    {
+      dummyfs_free_blocks (sb, index, 1);
+      return -ENOMEM;
+    }
+  block->b_mode = BM_DATA;
+  block->b_index = 0;
+  block->b_next = BLOCK_UNALLOCATED;
+
+  mutex_lock (&sbi->s_pack_lock);
+  p = dummyfs_get_block (sb, inode->i_pack, &pack_bh);
+  slot = p ? dummyfs_pack_slot (p, inode) : NULL;
+  if (!slot)
+    {
+      if (p)
+        dummyfs_put_block (pack_bh);
+      mutex_unlock (&sbi->s_pack_lock);
+      dummyfs_put_block (bh);
+      dummyfs_free_blocks (sb, index, 1);
+      return -EIO;
+    }
+  memcpy (block->b_data, (char *)p + slot->s_off, slot->s_len);
+  dummyfs_put_block (pack_bh);
+
+  dummyfs_dirty_block (sb, bh);
+  dummyfs_put_block (bh);
+  inode->b_next = index;
+  inode->i_tail = index;
+  inode->i_tail_index = 0;
+  dummyfs_pack_drop (sb, inode);
+  mutex_unlock (&sbi->s_pack_lock);
+
+  dummyfs_dirty_block (sb, inode_bh);
+
+  return 0;
+}
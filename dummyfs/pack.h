@@ -0,0 +1,27 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#ifndef PACK
+#define PACK
+
+#include <linux/uio.h>
+
+#include "mod.h"
+
+// The most fragments a packed block takes
+#define MAX_PACK_SLOTS 64
+
+int dummyfs_pack_fits (struct super_block *, struct dummyfs_inode *, loff_t);
+ssize_t dummyfs_pack_read (struct super_block *, struct dummyfs_inode *,
+                           loff_t, size_t, struct iov_iter *);
+u64 dummyfs_pack_locate (struct super_block *, struct dummyfs_inode *,
+                         size_t *);
+ssize_t dummyfs_pack_write (struct super_block *, struct dummyfs_inode *,
+                            loff_t, struct iov_iter *);
+int dummyfs_pack_truncate (struct super_block *, struct dummyfs_inode *,
+                           unsigned long);
+int dummyfs_unpack_data (struct super_block *, struct buffer_head *,
+                         struct dummyfs_inode *);
+
+#endif
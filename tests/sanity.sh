@@ -6,6 +6,8 @@ ROOT_DIR=$PWD
 KMOD_LOC=$ROOT_DIR/dummyfs.ko
 MKFS_LOC=$ROOT_DIR/utils/mkfs.dummyfs
 TRUN_LOC=$ROOT_DIR/utils/truncate
+DFRG_LOC=$ROOT_DIR/utils/defrag.dummyfs
+FSCK_LOC=$ROOT_DIR/utils/fsck.dummyfs
 
 
 install_kmod() {
@@ -48,6 +50,17 @@ write_read_files() {
 }
 
 
+append_files() {
+  for i in $(seq 1 200); do
+    echo "line $i of a log that outgrows the inline data" >> file1
+  done
+  wc -l file1
+  tail -n 2 file1
+  rm file1
+  ls
+}
+
+
 test_dumdbfs() {
   echo "start - test dumdbfs"
   cat $ROOT_DIR/debugmountpoint/counter
@@ -79,6 +92,88 @@ truncate_files() {
 }
 
 
+sparse_files() {
+  echo "start" > file1
+  dd if=/dev/zero of=file1 bs=1 count=0 seek=8192
+  echo "end" | dd of=file1 bs=1 seek=20000 conv=notrunc
+  ls -ls file1
+  tail -c 4 file1
+  rm file1
+  ls
+}
+
+
+defrag_files() {
+  for i in 1 2 3 4
+  do
+    head -c 600 /dev/urandom >> file1
+    sync
+    head -c 600 /dev/urandom >> file2
+    sync
+  done
+  md5sum file1 file2 > $ROOT_DIR/sums
+  $DFRG_LOC file1 file2
+  md5sum -c $ROOT_DIR/sums
+  rm $ROOT_DIR/sums
+  rm file1
+  rm file2
+  ls
+}
+
+
+compress_files() {
+  touch file1
+  chattr +c file1
+  lsattr file1
+  yes "a line that compresses well" | head -c 40000 > $ROOT_DIR/expect
+  cp $ROOT_DIR/expect file1
+  sync
+  for f in $ROOT_DIR/expect file1
+  do
+    echo "part of a cluster" | dd of=$f bs=1 seek=20000 conv=notrunc
+    $TRUN_LOC $f 25000
+  done
+  sync
+  echo 3 | sudo tee /proc/sys/vm/drop_caches
+  [ "$(md5sum < file1)" == "$(md5sum < $ROOT_DIR/expect)" ]
+  rm $ROOT_DIR/expect
+  rm file1
+  ls
+}
+
+
+clone_files() {
+  head -c 4000 /dev/urandom > file1
+  cp --reflink=always file1 file2
+  md5sum file1 > $ROOT_DIR/sums
+  echo "changed in the middle" | dd of=file2 bs=1 seek=2000 conv=notrunc
+  md5sum file2 >> $ROOT_DIR/sums
+  sync
+  echo 3 | sudo tee /proc/sys/vm/drop_caches
+  md5sum -c $ROOT_DIR/sums
+  rm file1
+  echo 3 | sudo tee /proc/sys/vm/drop_caches
+  tail -n 1 $ROOT_DIR/sums | md5sum -c
+  rm $ROOT_DIR/sums
+  # Left shared, for check_fs to look over
+  cp --reflink=always file2 file3
+  ls
+}
+
+
+trim_fs() {
+  head -c 4096 /dev/urandom > file1
+  sync
+  rm file1
+  sudo fstrim -v $ROOT_DIR/testmountpoint
+}
+
+
+check_fs() {
+  $FSCK_LOC test.img
+}
+
+
 umount_dir() {
   cd $ROOT_DIR
   sudo umount testmountpoint
@@ -110,8 +205,16 @@ else
   mk_clean_fs
   mk_dir_and_mount
   write_read_files
+  append_files
+  truncate_files
+  sparse_files
+  defrag_files
+  compress_files
+  clone_files
+  trim_fs
   test_dumdbfs
   umount_dir
+  check_fs
   remove_kmod
   clean
 fi
@@ -0,0 +1,55 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../dummyfs/mod.h"
+
+/*
+ * Defragment files on a mounted dummyfs: each file's data blocks are
+ * moved into one run of free blocks, in order, while the file stays in
+ * use.
+ */
+int
+main (int argc, char *argv[])
+{
+  int i, fd, rc = 0;
+  long moved;
+
+  if (argc < 2)
+    {
+      printf ("usage : defrag.dummyfs <name>...\n");
+      return 1;
+    }
+
+  for (i = 1; i < argc; i++)
+    {
+      fd = open (argv[i], O_RDWR);
+      if (fd < 0)
+        {
+          perror (argv[i]);
+          rc = 1;
+          continue;
+        }
+
+      moved = ioctl (fd, DUMMYFS_IOC_DEFRAG);
+      if (moved < 0)
+        {
+          perror (argv[i]);
+          rc = 1;
+        }
+      else if (moved)
+        printf ("%s: moved %ld blocks\n", argv[i], moved);
+      else
+        printf ("%s: already in one run\n", argv[i]);
+
+      close (fd);
+    }
+
+  return rc;
+}
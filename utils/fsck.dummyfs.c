@@ -0,0 +1,1356 @@
+/* Timothy Day, 2022
+ * (based on the simplistic RAM filesystem McCreath 2001)
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "../dummyfs/mod.h"
+
+/*
+ * Check an unmounted dummyfs device, and with -y repair what's wrong with
+ * it. The device is mapped whole, and only the blocks something points to
+ * are ever looked at, so the time taken goes with the space in use rather
+ * than the size of the device. The checks go:
+ *
+ *  1. The superblock, the allocation bitmap's blocks, and the journal.
+ *     Transactions committed to the log but not yet written back are
+ *     replayed (with -y) or else read in place of the blocks they cover,
+ *     so everything after is checked as the next mount would see it.
+ *  2. The list of inode tables, and then every inode they point to (in
+ *     parallel), reading in the listings of each directory.
+ *  3. The directory listings (each must name an inode that's there), the
+ *     inodes reachable from the root directory (anything else is an
+ *     orphan, and is freed), the link counts, and the inode groups.
+ *  4. Every file's list of data blocks, walked in parallel. Each block is
+ *     claimed by the first file to reach it, so the blocks shared between
+ *     clones are only walked once, and each pointer to a block someone
+ *     else claimed is counted against the block's b_refs. A list is cut
+ *     short where it stops making sense.
+ *  5. The shared blocks, the packed blocks, and then the allocation
+ *     bitmap, against the blocks found to be in use.
+ *
+ * Blocks that two files' lists run into by accident are kept as blocks
+ * shared between them, the way a clone would have it, so neither file
+ * loses data and the next write to either gets a copy of its own.
+ *
+ * Exits with 0 if nothing was wrong, 2 if everything wrong was repaired,
+ * or 4 if problems were left (and 1 if the device couldn't be checked).
+ */
+
+#define INODE_BATCH 64 // Inodes handed to a worker at a time
+#define MAX_THREADS 64
+
+/*
+ * Who each block belongs to: nothing, the filesystem's own metadata, the
+ * packed fragments of small files, or (for a data block) the inode whose
+ * list of blocks reached it first.
+ */
+#define OWN_NONE 0
+#define OWN_META 0xffffffffU
+#define OWN_PACKED 0xfffffffeU
+#define OWN_INODE(ino) ((__u32)(ino) + 1)
+#define MAX_INODES 0xfffffff0UL
+#define NO_INO 0xffffffffU
+
+// How a block's bit in the allocation bitmap compares with its use
+#define BITMAP_OK 0
+#define BITMAP_LEAKED 1 // Marked in use, but isn't
+#define BITMAP_LOST 2   // In use, but marked free
+
+char *device_name;
+int device;
+int repair;   // Fix what's found (-y)
+int nthreads; // Workers for the parallel passes (-j)
+
+unsigned char *image; // The whole device, mapped
+size_t image_size;
+unsigned long blocksize;
+unsigned long long numblocks;
+unsigned long long first_free; // The first block past the journal
+unsigned long inode_size;      // 0 for a block per inode
+unsigned long inline_size;     // Data held in an inode
+unsigned long max_data;        // Data held in a data block
+unsigned long table_size;      // Entries in an inode table
+unsigned long long bitmap_start;
+unsigned long long bitmap_blocks;
+unsigned long bitmap_bits;
+unsigned long long journal_start;
+unsigned long long journal_blocks;
+
+__u32 *owner;
+unsigned char *refmap; // The blocks found to be in use, like the bitmap
+
+unsigned long problems;
+unsigned long repaired;
+
+/*
+ * Blocks committed to the journal but not written back in place: where
+ * each belongs, and the log block holding its latest copy. Sorted by
+ * where they belong, and only used without -y.
+ */
+struct fsck_remap
+{
+  __u64 r_home;
+  __u64 r_copy;
+};
+
+struct fsck_remap *overlay;
+unsigned long overlay_count;
+unsigned long overlay_size;
+
+struct fsck_inode
+{
+  struct dummyfs_inode *f_inode; // NULL if there's no (good) inode
+  __u64 *f_entry;                // Its entry in the inode table
+  unsigned char *f_listings;     // A directory's listings, read in
+  __u32 f_links;                 // Listings found for it
+  int f_reached;                 // Reachable from the root directory
+  int f_reported;                // Already said it should be shared
+};
+
+struct fsck_inode *inodes;
+unsigned long ninodes;
+
+struct dummyfs_inode_table **tables;
+unsigned long ntables;
+
+// A pointer to a block, and the inode whose list it's in (if that matters)
+struct fsck_ref
+{
+  __u64 r_block;
+  __u32 r_ino;
+};
+
+struct fsck_refs
+{
+  struct fsck_ref *r_list;
+  unsigned long r_count;
+  unsigned long r_size;
+};
+
+struct fsck_worker
+{
+  pthread_t w_thread;
+  void (*w_fn) (struct fsck_worker *, unsigned long);
+  struct fsck_refs w_shared; // Blocks with b_refs, or reached twice
+  struct fsck_refs w_packed; // Packed blocks first reached by this worker
+};
+
+struct fsck_worker workers[MAX_THREADS];
+unsigned long next_ino; // The next inode to hand out to a worker
+
+__u32 crc_table[256];
+
+static void
+die (char *mess)
+{
+  fprintf (stderr, "Exit : %s\n", mess);
+  exit (1);
+}
+
+static void
+usage (void)
+{
+  die ("Usage : fsck.dummyfs [-y] [-j threads] <device name>");
+}
+
+// Say what's wrong, and whether it's been put right
+static void
+problem (int fixed, const char *fmt, ...)
+{
+  char line[256];
+  va_list ap;
+
+  va_start (ap, fmt);
+  vsnprintf (line, sizeof (line), fmt, ap);
+  va_end (ap);
+  printf ("%s%s\n", line, fixed ? " (fixed)" : "");
+  __atomic_add_fetch (&problems, 1, __ATOMIC_RELAXED);
+  if (fixed)
+    __atomic_add_fetch (&repaired, 1, __ATOMIC_RELAXED);
+}
+
+static void
+refs_add (struct fsck_refs *refs, __u64 block, __u32 ino)
+{
+  if (refs->r_count == refs->r_size)
+    {
+      refs->r_size = MAX (64UL, refs->r_size * 2);
+      refs->r_list
+          = realloc (refs->r_list, refs->r_size * sizeof (struct fsck_ref));
+      if (!refs->r_list)
+        die ("out of memory");
+    }
+  refs->r_list[refs->r_count].r_block = block;
+  refs->r_list[refs->r_count++].r_ino = ino;
+}
+
+static int
+remap_order (const void *a, const void *b)
+{
+  const struct fsck_remap *x = a, *y = b;
+
+  if (x->r_home != y->r_home)
+    return (x->r_home < y->r_home) ? -1 : 1;
+  if (x->r_copy != y->r_copy)
+    return (x->r_copy < y->r_copy) ? -1 : 1;
+  return 0;
+}
+
+static int
+remap_find (const void *a, const void *b)
+{
+  const struct fsck_remap *x = a, *y = b;
+
+  if (x->r_home != y->r_home)
+    return (x->r_home < y->r_home) ? -1 : 1;
+  return 0;
+}
+
+static int
+ref_order (const void *a, const void *b)
+{
+  const struct fsck_ref *x = a, *y = b;
+
+  if (x->r_block != y->r_block)
+    return (x->r_block < y->r_block) ? -1 : 1;
+  return 0;
+}
+
+// A block as the next mount would see it
+static void *
+block_at (unsigned long long index)
+{
+  struct fsck_remap key = { index, 0 };
+  struct fsck_remap *r;
+
+  if (overlay_count)
+    {
+      r = bsearch (&key, overlay, overlay_count, sizeof (struct fsck_remap),
+                   remap_find);
+      if (r)
+        index = r->r_copy;
+    }
+  return image + index * blocksize;
+}
+
+/*
+ * Claim a block for who, if nothing else has yet. Otherwise, whoever has
+ * it is left in *was.
+ *
+ * Returns true if the block was claimed.
+ */
+static int
+claim (unsigned long long index, __u32 who, __u32 *was)
+{
+  __u32 expected = OWN_NONE;
+
+  if (__atomic_compare_exchange_n (&owner[index], &expected, who, 0,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+      __atomic_fetch_or (&refmap[index / 8], 1 << (index % 8),
+                         __ATOMIC_RELAXED);
+      return true;
+    }
+  if (was)
+    *was = expected;
+  return false;
+}
+
+// Give a block back (only while nothing else is running)
+static void
+unclaim (unsigned long long index)
+{
+  owner[index] = OWN_NONE;
+  refmap[index / 8] &= ~(1 << (index % 8));
+}
+
+// Can a file's blocks (or an inode) be here?
+static int
+block_ok (unsigned long long index)
+{
+  return index >= first_free && index < numblocks;
+}
+
+// The kernel's crc32c (without the usual inversions)
+static __u32
+crc32c (__u32 crc, const unsigned char *p, unsigned long len)
+{
+  while (len--)
+    crc = (crc >> 8) ^ crc_table[(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+static void
+crc32c_init (void)
+{
+  __u32 crc;
+  int k, b;
+
+  for (k = 0; k < 256; k++)
+    {
+      crc = k;
+      for (b = 0; b < 8; b++)
+        crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+      crc_table[k] = crc;
+    }
+}
+
+/*
+ * Check the superblock (the first inode table) and work out the geometry
+ * of the device from it. Nothing can be checked without it.
+ */
+static void
+check_super (void)
+{
+  struct dummyfs_inode_table *table = (struct dummyfs_inode_table *)image;
+
+  if (table->t_magic != DUMMYFS_MAGIC || table->t_version != DUMMYFS_VERSION)
+    die ("not a dummyfs device");
+  if (table->t_blocksize_bits < MIN_BLOCKSIZE_BITS
+      || table->t_blocksize_bits > MAX_BLOCKSIZE_BITS)
+    die ("bad block size");
+  blocksize = 1UL << table->t_blocksize_bits;
+  numblocks = table->t_numblocks;
+  if (numblocks > image_size / blocksize)
+    die ("device is smaller than the filesystem on it");
+
+  bitmap_bits = BITMAP_BITS_PER_BLOCK (blocksize);
+  bitmap_start = table->t_bitmap;
+  bitmap_blocks = table->t_bitmap_blocks;
+  if (bitmap_start != BITMAP_BLOCK_INDEX
+      || bitmap_blocks != (numblocks + bitmap_bits - 1) / bitmap_bits)
+    die ("bad allocation bitmap geometry");
+
+  journal_start = table->t_journal;
+  journal_blocks = table->t_journal_blocks;
+  if (journal_start != bitmap_start + bitmap_blocks
+      || (journal_blocks && journal_blocks < MIN_JOURNAL_BLOCKS))
+    die ("bad journal geometry");
+  first_free = journal_start + journal_blocks;
+  if (first_free >= numblocks)
+    die ("bad journal geometry");
+
+  inode_size = table->t_inode_size;
+  if (inode_size
+      && (inode_size < INODE_HEADER_SIZE || inode_size % sizeof (__u64)
+          || INODES_PER_GROUP (blocksize, inode_size) < 2))
+    die ("bad inode size");
+  inline_size = inode_size ? inode_size - INODE_HEADER_SIZE
+                           : MAX_INODE_DATA_SIZE (blocksize);
+  max_data = MAX_BLOCK_DATA_SIZE (blocksize);
+  table_size = MAX_TABLE_SIZE (blocksize);
+
+  printf ("Device has %llu blocks of %lu bytes\n", numblocks, blocksize);
+
+  owner = calloc (numblocks, sizeof (__u32));
+  refmap = calloc ((numblocks + 7) / 8, 1);
+  if (!owner || !refmap)
+    die ("out of memory");
+
+  // The metadata up to the end of the journal is read in one sweep
+  madvise (image, first_free * blocksize, MADV_WILLNEED);
+}
+
+/*
+ * Check the transaction seq at pos in the log (as replaying it would):
+ * its descriptors must lead to a commit block with the right checksum.
+ *
+ * Returns the number of log blocks it takes up, or 0 if there's no
+ * committed transaction seq at pos.
+ */
+static unsigned long long
+journal_transaction (unsigned long long pos, __u64 seq)
+{
+  struct dummyfs_journal_block *jb;
+  unsigned long long end = journal_start + journal_blocks;
+  unsigned long long p;
+  unsigned long per_desc = MAX_JOURNAL_DESC_SIZE (blocksize);
+  unsigned long count;
+  __u32 crc = ~0;
+
+  for (p = pos; p < end; p += 1 + count)
+    {
+      jb = (struct dummyfs_journal_block *)(image + p * blocksize);
+      if (!BM_IS_JOURNAL (jb->b_mode) || jb->j_seq != seq)
+        return 0;
+      if (jb->j_kind == JK_COMMIT)
+        return (p > pos && jb->j_crc == crc) ? p + 1 - pos : 0;
+      count = jb->j_count;
+      if (jb->j_kind != JK_DESC || !count || count > per_desc
+          || p + 1 + count >= end)
+        return 0;
+      crc = crc32c (crc, (unsigned char *)jb, blocksize);
+      crc = crc32c (crc, image + (p + 1) * blocksize, count * blocksize);
+    }
+  return 0;
+}
+
+// Note where the blocks of a committed transaction belong
+static void
+journal_remap (unsigned long long pos, unsigned long long len)
+{
+  struct dummyfs_journal_block *jb;
+  unsigned long long p;
+  unsigned long count;
+  unsigned long k;
+
+  for (p = pos; p + 1 < pos + len; p += 1 + count)
+    {
+      jb = (struct dummyfs_journal_block *)(image + p * blocksize);
+      count = jb->j_count;
+      for (k = 0; k < count; k++)
+        {
+          if (jb->j_blocks[k] >= numblocks)
+            continue;
+          if (overlay_count == overlay_size)
+            {
+              overlay_size = MAX (64UL, overlay_size * 2);
+              overlay = realloc (overlay,
+                                 overlay_size * sizeof (struct fsck_remap));
+              if (!overlay)
+                die ("out of memory");
+            }
+          overlay[overlay_count].r_home = jb->j_blocks[k];
+          overlay[overlay_count++].r_copy = p + 1 + k;
+        }
+    }
+}
+
+// Start the log over, from transaction seq
+static void
+journal_reset (__u64 seq)
+{
+  struct dummyfs_journal_block *super;
+
+  super = (struct dummyfs_journal_block *)(image + journal_start * blocksize);
+  memset (super, 0, blocksize);
+  super->b_mode = BM_JOURNAL;
+  super->j_kind = JK_SUPER;
+  super->b_next = BLOCK_UNALLOCATED;
+  super->j_seq = seq;
+}
+
+/*
+ * Claim the allocation bitmap and the journal, and deal with whatever the
+ * journal holds: committed transactions are replayed with -y, and read
+ * in place of the blocks they cover otherwise.
+ */
+static void
+check_journal (void)
+{
+  struct dummyfs_journal_block *super;
+  struct dummyfs_journal_block *jb;
+  struct dummyfs_block *block;
+  unsigned long long end = journal_start + journal_blocks;
+  unsigned long long pos;
+  unsigned long long len;
+  unsigned long long p;
+  unsigned long transactions = 0;
+  unsigned long k;
+  __u64 seq;
+
+  for (p = bitmap_start; p < bitmap_start + bitmap_blocks; p++)
+    {
+      claim (p, OWN_META, NULL);
+      block = (struct dummyfs_block *)(image + p * blocksize);
+      if (block->b_mode != BM_BITMAP)
+        {
+          problem (repair, "bitmap block %llu isn't marked as one", p);
+          if (repair)
+            block->b_mode = BM_BITMAP;
+        }
+    }
+
+  if (!journal_blocks)
+    return;
+  for (p = journal_start; p < end; p++)
+    claim (p, OWN_META, NULL);
+
+  // Without a good superblock, the log starts over past what it holds
+  super = (struct dummyfs_journal_block *)(image + journal_start * blocksize);
+  if (super->b_mode != BM_JOURNAL || super->j_kind != JK_SUPER)
+    {
+      seq = 0;
+      for (p = journal_start + 1; p < end; p++)
+        {
+          jb = (struct dummyfs_journal_block *)(image + p * blocksize);
+          if (jb->b_mode == BM_JOURNAL && jb->j_seq > seq)
+            seq = jb->j_seq;
+        }
+      problem (repair, "journal superblock is bad");
+      if (repair)
+        journal_reset (seq + 1);
+      return;
+    }
+
+  seq = super->j_seq;
+  pos = journal_start + 1;
+  while ((len = journal_transaction (pos, seq)))
+    {
+      journal_remap (pos, len);
+      pos += len;
+      seq++;
+      transactions++;
+    }
+  if (!transactions)
+    return;
+
+  // Later copies of a block win
+  qsort (overlay, overlay_count, sizeof (struct fsck_remap), remap_order);
+  for (p = k = 0; p < overlay_count; p++)
+    {
+      if (k && overlay[k - 1].r_home == overlay[p].r_home)
+        k--;
+      overlay[k++] = overlay[p];
+    }
+  overlay_count = k;
+
+  if (!repair)
+    {
+      printf ("Journal holds %lu transactions to replay, checking as if "
+              "they were\n",
+              transactions);
+      return;
+    }
+  for (p = 0; p < overlay_count; p++)
+    memcpy (image + overlay[p].r_home * blocksize,
+            image + overlay[p].r_copy * blocksize, blocksize);
+  overlay_count = 0;
+  journal_reset (seq);
+  printf ("Replayed %lu transactions from the journal\n", transactions);
+}
+
+// Follow the list of inode tables, which says how many inodes there are
+static void
+check_tables (void)
+{
+  struct dummyfs_inode_table *table;
+  unsigned long long index = TABLE_BLOCK_INDEX;
+  unsigned long size = 0;
+  unsigned long ino;
+  __u64 *prev = NULL;
+
+  claim (TABLE_BLOCK_INDEX, OWN_META, NULL);
+  for (;;)
+    {
+      if (prev
+          && (!block_ok (index)
+              || ((struct dummyfs_block *)block_at (index))->b_mode
+                     != BM_TABLE
+              || !claim (index, OWN_META, NULL)))
+        {
+          problem (repair, "inode table %lu (block %llu) is bad", ntables,
+                   index);
+          if (repair)
+            *prev = BLOCK_UNALLOCATED;
+          break;
+        }
+      table = block_at (index);
+      if (!prev && table->b_mode != BM_TABLE)
+        {
+          problem (repair, "first inode table isn't marked as one");
+          if (repair)
+            table->b_mode = BM_TABLE;
+        }
+      if (ntables == size)
+        {
+          size = MAX (16UL, size * 2);
+          tables = realloc (tables, size * sizeof (table));
+          if (!tables)
+            die ("out of memory");
+        }
+      tables[ntables++] = table;
+      prev = &table->b_next;
+      index = table->b_next;
+      if (BLOCK_IS_UNALLOCATED (index))
+        break;
+    }
+
+  if (ntables > MAX_INODES / table_size)
+    die ("too many inode tables");
+  ninodes = ntables * table_size;
+  inodes = calloc (ninodes, sizeof (struct fsck_inode));
+  if (!inodes)
+    die ("out of memory");
+  for (ino = 0; ino < ninodes; ino++)
+    inodes[ino].f_entry = &tables[ino / table_size]->t_table[ino % table_size];
+}
+
+// A packed file's fragment, if it has a good one
+static unsigned char *
+pack_fragment (struct dummyfs_inode *inode, unsigned long *len)
+{
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  unsigned long table_end;
+
+  if (!block_ok (inode->i_pack))
+    return NULL;
+  p = block_at (inode->i_pack);
+  table_end
+      = PACKED_HEADER_SIZE + p->p_slots * sizeof (struct dummyfs_pack_slot);
+  if (p->b_mode != BM_PACKED || inode->i_pack_slot >= p->p_slots
+      || table_end > blocksize)
+    return NULL;
+  slot = &p->p_slot[inode->i_pack_slot];
+  if (slot->s_ino != inode->i_ino || !slot->s_len || slot->s_off < table_end
+      || slot->s_off + slot->s_len > blocksize)
+    return NULL;
+  *len = slot->s_len;
+  return (unsigned char *)p + slot->s_off;
+}
+
+/*
+ * Go through the pieces of a file's data (up to size) that are on the
+ * disk, in order: its inline data, its packed fragment, then its data
+ * blocks. The list of data blocks is only followed while it makes sense
+ * (in range, data blocks, b_index going up), so this is safe to use on a
+ * damaged file.
+ */
+static void
+file_pieces (struct dummyfs_inode *inode, unsigned long long size,
+             void (*fn) (unsigned char *, unsigned long long, unsigned long,
+                         void *),
+             void *arg)
+{
+  struct dummyfs_block *block;
+  unsigned char *fragment;
+  unsigned long long index = inode->b_next;
+  unsigned long long off;
+  unsigned long len;
+  long long last = -1;
+
+  fn (inode->i_data, 0, MIN (inline_size, size), arg);
+  if (size <= inline_size)
+    return;
+  fragment = pack_fragment (inode, &len);
+  if (fragment)
+    fn (fragment, inline_size, MIN (len, size - inline_size), arg);
+
+  while (block_ok (index))
+    {
+      block = block_at (index);
+      if (block->b_mode != BM_DATA || (long long)block->b_index <= last)
+        break;
+      off = inline_size + (unsigned long long)block->b_index * max_data;
+      if (off >= size)
+        break;
+      fn (block->b_data, off, MIN (max_data, size - off), arg);
+      last = block->b_index;
+      index = block->b_next;
+    }
+}
+
+static void
+copy_out (unsigned char *data, unsigned long long off, unsigned long len,
+          void *arg)
+{
+  memcpy ((unsigned char *)arg + off, data, len);
+}
+
+static void
+copy_in (unsigned char *data, unsigned long long off, unsigned long len,
+         void *arg)
+{
+  memcpy (data, (unsigned char *)arg + off, len);
+}
+
+// The last data block of a file at or before the end of the file
+static void
+find_tail (struct dummyfs_inode *inode, __u64 *tail, __u32 *tail_index)
+{
+  struct dummyfs_block *block;
+  unsigned long long index = inode->b_next;
+  long long last = -1;
+
+  *tail = BLOCK_UNALLOCATED;
+  *tail_index = 0;
+  if (inode->i_size <= inline_size)
+    return;
+  while (block_ok (index))
+    {
+      block = block_at (index);
+      if (block->b_mode != BM_DATA || (long long)block->b_index <= last
+          || block->b_index > (inode->i_size - inline_size - 1) / max_data)
+        break;
+      *tail = index;
+      *tail_index = block->b_index;
+      last = block->b_index;
+      index = block->b_next;
+    }
+}
+
+static int
+listing_ok (struct dummyfs_dir_listing *listing)
+{
+  return listing->l_name[0]
+         && memchr (listing->l_name, 0, MAX_NAME_SIZE + 1)
+         && listing->l_ino && listing->l_ino < ninodes;
+}
+
+/*
+ * Find an inode from its table entry, and read in its listings if it's a
+ * directory.
+ */
+static void
+find_inode (struct fsck_worker *w, unsigned long ino)
+{
+  struct fsck_inode *fi = &inodes[ino];
+  struct dummyfs_inode *inode = NULL;
+  struct dummyfs_inode *candidate;
+  unsigned long long index = *fi->f_entry;
+  unsigned long long size;
+  unsigned long k;
+
+  if (BLOCK_IS_UNALLOCATED (index))
+    return;
+  if (block_ok (index) || index == ROOT_DIR_BLOCK_INDEX)
+    {
+      candidate = block_at (index);
+      if (!inode_size)
+        inode = candidate;
+      else if (candidate->b_mode == BM_INODE)
+        for (k = 0; k < INODES_PER_GROUP (blocksize, inode_size); k++)
+          if (GROUP_INODE (candidate, inode_size, k)->b_mode == BM_INODE
+              && GROUP_INODE (candidate, inode_size, k)->i_ino == ino)
+            inode = GROUP_INODE (candidate, inode_size, k);
+    }
+  if (!inode || inode->b_mode != BM_INODE || inode->i_ino != ino
+      || (inode->i_kind != IM_REG && inode->i_kind != IM_DIR)
+      || (!ino && inode->i_kind != IM_DIR))
+    return;
+
+  if (inode->i_kind == IM_DIR)
+    {
+      if (inode->i_size > inline_size + numblocks * max_data)
+        return;
+      size = inode->i_size
+             - inode->i_size % sizeof (struct dummyfs_dir_listing);
+      fi->f_listings = calloc (size + 1, 1);
+      if (!fi->f_listings)
+        die ("out of memory");
+      file_pieces (inode, size, copy_out, fi->f_listings);
+    }
+  fi->f_inode = inode;
+}
+
+/*
+ * Free an inode (with -y). Its blocks are left to be freed along with
+ * every other block nothing uses.
+ */
+static void
+drop_inode (unsigned long ino)
+{
+  struct fsck_inode *fi = &inodes[ino];
+  struct dummyfs_inode_group *group;
+
+  if (!repair)
+    return;
+  if (inode_size)
+    {
+      group = block_at (*fi->f_entry);
+      memset (fi->f_inode, 0, inode_size);
+      group->g_used--;
+    }
+  *fi->f_entry = BLOCK_UNALLOCATED;
+  fi->f_inode = NULL;
+}
+
+// Write out what's left of a directory's listings
+static void
+rewrite_dir (struct dummyfs_inode *inode, unsigned char *listings,
+             unsigned long long size)
+{
+  unsigned long long old
+      = inode->i_size - inode->i_size % sizeof (struct dummyfs_dir_listing);
+
+  memset (listings + size, 0, old - size);
+  file_pieces (inode, old, copy_in, listings);
+  inode->i_size = size;
+  find_tail (inode, &inode->i_tail, &inode->i_tail_index);
+}
+
+/*
+ * Check the listings of every directory, count the links to each inode
+ * from the directories reachable from the root, and free the inodes that
+ * can't be reached.
+ */
+static void
+check_dirs (void)
+{
+  struct dummyfs_dir_listing *listing;
+  struct fsck_inode *fi;
+  unsigned long *queue;
+  unsigned long head = 0;
+  unsigned long tail = 0;
+  unsigned long count;
+  unsigned long kept;
+  unsigned long ino;
+  unsigned long k;
+  unsigned int want;
+
+  for (ino = 0; ino < ninodes; ino++)
+    {
+      fi = &inodes[ino];
+      if (fi->f_inode || BLOCK_IS_UNALLOCATED (*fi->f_entry))
+        continue;
+      problem (repair, "inode %lu: table entry points at block %llu, which "
+               "doesn't hold it",
+               ino, *fi->f_entry);
+      if (repair)
+        *fi->f_entry = BLOCK_UNALLOCATED;
+    }
+  if (!inodes[0].f_inode)
+    die ("root directory is damaged");
+
+  for (ino = 0; ino < ninodes; ino++)
+    {
+      fi = &inodes[ino];
+      if (!fi->f_listings)
+        continue;
+      count = fi->f_inode->i_size / sizeof (struct dummyfs_dir_listing);
+      for (k = kept = 0; k < count; k++)
+        {
+          listing = (struct dummyfs_dir_listing *)fi->f_listings + k;
+          if (listing_ok (listing) && inodes[listing->l_ino].f_inode)
+            {
+              if (kept != k)
+                memcpy ((struct dummyfs_dir_listing *)fi->f_listings + kept,
+                        listing, sizeof (struct dummyfs_dir_listing));
+              kept++;
+              continue;
+            }
+          problem (repair, "directory %lu: entry \"%.40s\" (inode %u) is bad",
+                   ino, listing->l_name, listing->l_ino);
+        }
+      if (kept != count && repair)
+        rewrite_dir (fi->f_inode, fi->f_listings,
+                     kept * sizeof (struct dummyfs_dir_listing));
+    }
+
+  // Go through the directories from the root, counting links as we go
+  queue = malloc (ninodes * sizeof (unsigned long));
+  if (!queue)
+    die ("out of memory");
+  inodes[0].f_reached = true;
+  queue[tail++] = 0;
+  while (head != tail)
+    {
+      fi = &inodes[queue[head++]];
+      if (!fi->f_listings)
+        continue;
+      count = fi->f_inode->i_size / sizeof (struct dummyfs_dir_listing);
+      for (k = 0; k < count; k++)
+        {
+          listing = (struct dummyfs_dir_listing *)fi->f_listings + k;
+          if (!listing_ok (listing) || !inodes[listing->l_ino].f_inode)
+            continue;
+          inodes[listing->l_ino].f_links++;
+          if (!inodes[listing->l_ino].f_reached)
+            {
+              inodes[listing->l_ino].f_reached = true;
+              queue[tail++] = listing->l_ino;
+            }
+        }
+    }
+  free (queue);
+
+  for (ino = 0; ino < ninodes; ino++)
+    {
+      fi = &inodes[ino];
+      if (!fi->f_inode)
+        continue;
+      if (!fi->f_reached)
+        {
+          problem (repair, "inode %lu isn't in any directory", ino);
+          drop_inode (ino);
+          continue;
+        }
+      want = ino ? MIN (fi->f_links, 255U) : 1;
+      if (fi->f_inode->i_links != want)
+        {
+          problem (repair, "inode %lu has %u links, but is listed %u times",
+                   ino, fi->f_inode->i_links, want);
+          if (repair)
+            fi->f_inode->i_links = want;
+        }
+    }
+}
+
+/*
+ * Claim the blocks holding the inodes, and check the inode groups: every
+ * inode in a group must be the one its table entry is looking for, and
+ * g_used must count them.
+ */
+static void
+check_groups (void)
+{
+  struct dummyfs_inode_group *group;
+  struct dummyfs_inode *inode;
+  unsigned long long *groups;
+  unsigned long long index;
+  unsigned long ngroups = 0;
+  unsigned long used;
+  unsigned long ino;
+  unsigned long g;
+  unsigned long k;
+
+  groups = malloc (ninodes * sizeof (unsigned long long));
+  if (!groups)
+    die ("out of memory");
+  for (ino = 0; ino < ninodes; ino++)
+    if (inodes[ino].f_inode && claim (*inodes[ino].f_entry, OWN_META, NULL))
+      groups[ngroups++] = *inodes[ino].f_entry;
+
+  for (g = 0; inode_size && g < ngroups; g++)
+    {
+      index = groups[g];
+      group = block_at (index);
+      for (k = used = 0; k < INODES_PER_GROUP (blocksize, inode_size); k++)
+        {
+          inode = GROUP_INODE (group, inode_size, k);
+          if (inode->b_mode != BM_INODE)
+            continue;
+          if (inode->i_ino < ninodes && inodes[inode->i_ino].f_inode == inode)
+            {
+              used++;
+              continue;
+            }
+          problem (repair, "inode group %llu: inode %u isn't in the inode "
+                   "table",
+                   index, inode->i_ino);
+          if (repair)
+            memset (inode, 0, inode_size);
+          else
+            used++;
+        }
+      if (group->g_used != used)
+        {
+          problem (repair, "inode group %llu holds %lu inodes, not %u",
+                   index, used, group->g_used);
+          if (repair)
+            group->g_used = used;
+        }
+    }
+  free (groups);
+}
+
+/*
+ * Walk a file's list of data blocks, claiming each block the first time
+ * any file reaches it. On reaching a block some other file already has,
+ * the pointer to it is noted (to check against its b_refs later), and the
+ * rest of the list is only followed as far as the end of the file, to
+ * find its tail. A list is cut short where it stops making sense.
+ */
+static void
+walk_inode (struct fsck_worker *w, unsigned long ino)
+{
+  struct dummyfs_inode *inode = inodes[ino].f_inode;
+  struct dummyfs_block *block;
+  unsigned char *fragment;
+  unsigned long long index;
+  unsigned long len;
+  long long last_ord = -1;
+  long long prev_ord = -1;
+  __u64 *prev;
+  __u64 tail = BLOCK_UNALLOCATED;
+  __u32 tail_index = 0;
+  __u32 was;
+  int claiming = true;
+  int tail_ok;
+
+  if (!inode)
+    return;
+  if (inode->i_size > inline_size)
+    last_ord = (inode->i_size - inline_size - 1) / max_data;
+
+  // A compressed cluster's blocks take the first places in the cluster
+  if (IF_IS_COMPRESSED (inode->i_flags) && last_ord >= 0)
+    last_ord = (last_ord / CLUSTER_BLOCKS (blocksize) + 1)
+                   * CLUSTER_BLOCKS (blocksize)
+               - 1;
+
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    {
+      fragment = pack_fragment (inode, &len);
+      was = OWN_PACKED;
+      if (fragment && claim (inode->i_pack, OWN_PACKED, &was))
+        refs_add (&w->w_packed, inode->i_pack, ino);
+      else if (!fragment || was != OWN_PACKED)
+        {
+          problem (repair, "inode %lu: packed fragment in block %llu is bad",
+                   ino, inode->i_pack);
+          if (repair)
+            {
+              inode->i_pack = BLOCK_UNALLOCATED;
+              inode->i_pack_slot = 0;
+            }
+        }
+    }
+
+  tail_ok = BLOCK_IS_UNALLOCATED (inode->i_tail);
+  prev = &inode->b_next;
+  for (index = *prev; !BLOCK_IS_UNALLOCATED (index); index = *prev)
+    {
+      block = block_ok (index) ? block_at (index) : NULL;
+      was = OWN_NONE;
+      if (!block || block->b_mode != BM_DATA
+          || (long long)block->b_index <= prev_ord
+          || (claiming && !claim (index, OWN_INODE (ino), &was)
+              && (was == OWN_META || was == OWN_PACKED)))
+        {
+          if (claiming)
+            {
+              problem (repair, "inode %lu: list of data blocks is broken at "
+                       "block %llu",
+                       ino, index);
+              if (repair)
+                *prev = BLOCK_UNALLOCATED;
+            }
+          break;
+        }
+      if (was != OWN_NONE)
+        {
+          refs_add (&w->w_shared, index, ino);
+          claiming = false;
+        }
+      else if (claiming && block->b_refs)
+        refs_add (&w->w_shared, index, NO_INO);
+
+      if ((long long)block->b_index <= last_ord)
+        {
+          tail = index;
+          tail_index = block->b_index;
+          if (index == inode->i_tail && tail_index == inode->i_tail_index)
+            tail_ok = true;
+        }
+      else if (!claiming)
+        break;
+      prev_ord = block->b_index;
+      prev = &block->b_next;
+    }
+
+  if (!tail_ok)
+    {
+      problem (repair, "inode %lu: tail block %llu isn't one of its blocks",
+               ino, inode->i_tail);
+      if (repair)
+        {
+          inode->i_tail = tail;
+          inode->i_tail_index = tail_index;
+        }
+    }
+}
+
+static void *
+worker_run (void *arg)
+{
+  struct fsck_worker *w = arg;
+  unsigned long ino;
+  unsigned long end;
+
+  for (;;)
+    {
+      ino = __atomic_fetch_add (&next_ino, INODE_BATCH, __ATOMIC_RELAXED);
+      if (ino >= ninodes)
+        break;
+      end = MIN (ino + INODE_BATCH, ninodes);
+      for (; ino < end; ino++)
+        w->w_fn (w, ino);
+    }
+  return NULL;
+}
+
+// Run fn on every inode, spread over the workers
+static void
+run_workers (void (*fn) (struct fsck_worker *, unsigned long))
+{
+  int k;
+
+  next_ino = 0;
+  for (k = 0; k < nthreads; k++)
+    {
+      workers[k].w_fn = fn;
+      if (pthread_create (&workers[k].w_thread, NULL, worker_run,
+                          &workers[k]))
+        die ("unable to start a thread");
+    }
+  for (k = 0; k < nthreads; k++)
+    pthread_join (workers[k].w_thread, NULL);
+}
+
+// Make sure a file sharing blocks is marked as doing so
+static void
+check_shared_inode (unsigned long ino, unsigned long long index)
+{
+  struct fsck_inode *fi = &inodes[ino];
+
+  if (IF_IS_SHARED (fi->f_inode->i_flags) || fi->f_reported)
+    return;
+  problem (repair, "inode %lu shares block %llu, but isn't marked shared",
+           ino, index);
+  fi->f_reported = true;
+  if (repair)
+    fi->f_inode->i_flags |= IF_SHARED;
+}
+
+/*
+ * Check that each block reached more than once (or claiming to be) has
+ * as many pointers to it as its b_refs says, and that every file reaching
+ * it is marked as sharing its blocks.
+ */
+static void
+check_shared (void)
+{
+  struct fsck_refs all = { NULL, 0, 0 };
+  struct fsck_ref *r;
+  struct dummyfs_block *block;
+  unsigned long long index;
+  unsigned long pointers;
+  unsigned long k;
+  unsigned long j;
+  int w;
+
+  for (w = 0; w < nthreads; w++)
+    for (k = 0; k < workers[w].w_shared.r_count; k++)
+      refs_add (&all, workers[w].w_shared.r_list[k].r_block,
+                workers[w].w_shared.r_list[k].r_ino);
+  qsort (all.r_list, all.r_count, sizeof (struct fsck_ref), ref_order);
+
+  for (k = 0; k < all.r_count; k = j)
+    {
+      index = all.r_list[k].r_block;
+      pointers = 1;
+      for (j = k; j < all.r_count && all.r_list[j].r_block == index; j++)
+        if (all.r_list[j].r_ino != NO_INO)
+          pointers++;
+      block = block_at (index);
+      if (block->b_refs != pointers - 1)
+        {
+          problem (repair, "block %llu has %lu pointers to it, but b_refs "
+                   "is %u",
+                   index, pointers, block->b_refs);
+          if (repair)
+            block->b_refs = MIN (pointers - 1, 0xffffUL);
+        }
+      if (pointers == 1)
+        continue;
+      check_shared_inode (owner[index] - 1, index);
+      for (r = &all.r_list[k]; r < &all.r_list[j]; r++)
+        if (r->r_ino != NO_INO)
+          check_shared_inode (r->r_ino, index);
+    }
+  free (all.r_list);
+}
+
+/*
+ * Check the slots of the packed blocks in use: each fragment must belong
+ * to the file it says it does. A packed block left with no fragments is
+ * freed.
+ */
+static void
+check_packed (void)
+{
+  struct dummyfs_packed_block *p;
+  struct dummyfs_pack_slot *slot;
+  struct dummyfs_inode *inode;
+  unsigned long long index;
+  unsigned long used;
+  unsigned long k;
+  unsigned long j;
+  int w;
+
+  for (w = 0; w < nthreads; w++)
+    for (j = 0; j < workers[w].w_packed.r_count; j++)
+      {
+        index = workers[w].w_packed.r_list[j].r_block;
+        p = block_at (index);
+        for (k = used = 0; k < p->p_slots; k++)
+          {
+            slot = &p->p_slot[k];
+            if (!slot->s_len)
+              continue;
+            inode = (slot->s_ino < ninodes) ? inodes[slot->s_ino].f_inode
+                                            : NULL;
+            if (inode && inode->i_pack == index && inode->i_pack_slot == k)
+              {
+                used++;
+                continue;
+              }
+            problem (repair, "packed block %llu: slot %lu holds a fragment "
+                     "of inode %u, which isn't there",
+                     index, k, slot->s_ino);
+            if (repair)
+              slot->s_len = 0;
+          }
+        if (!repair)
+          continue;
+        while (p->p_slots && !p->p_slot[p->p_slots - 1].s_len)
+          p->p_slots--;
+        if (!used)
+          unclaim (index);
+      }
+}
+
+// Report a run of blocks the bitmap has wrong
+static void
+bitmap_run (int kind, unsigned long long start, unsigned long long end)
+{
+  char range[64];
+
+  if (end - start == 1)
+    snprintf (range, sizeof (range), "block %llu is", start);
+  else
+    snprintf (range, sizeof (range), "blocks %llu-%llu are", start, end - 1);
+  if (kind == BITMAP_LEAKED)
+    problem (repair, "%s marked in use, but nothing uses them", range);
+  else
+    problem (repair, "%s in use, but marked free", range);
+}
+
+// Note how a block's bit compares, reporting each run of wrong ones
+static void
+bitmap_note (int kind, unsigned long long index)
+{
+  static unsigned long long run_start;
+  static int run_kind;
+
+  if (kind == run_kind)
+    return;
+  if (run_kind)
+    bitmap_run (run_kind, run_start, index);
+  run_kind = kind;
+  run_start = index;
+}
+
+/*
+ * Compare the allocation bitmap with the blocks found to be in use, a
+ * byte at a time, fixing it up with -y.
+ */
+static void
+check_bitmap (void)
+{
+  struct dummyfs_block *block;
+  unsigned long long first;
+  unsigned long long b;
+  unsigned long k;
+  unsigned char disk;
+  unsigned char found;
+  unsigned char mask;
+  int bit;
+
+  for (b = 0; b < bitmap_blocks; b++)
+    {
+      block = block_at (bitmap_start + b);
+      for (k = 0; k < bitmap_bits / 8; k++)
+        {
+          first = b * bitmap_bits + k * 8;
+          if (first >= numblocks)
+            break;
+          disk = block->b_data[k];
+          found = refmap[first / 8];
+          mask = (numblocks - first < 8) ? (1 << (numblocks - first)) - 1
+                                          : 0xff;
+          if (!((disk ^ found) & mask))
+            {
+              bitmap_note (BITMAP_OK, first);
+              continue;
+            }
+          for (bit = 0; bit < 8 && first + bit < numblocks; bit++)
+            {
+              if (!(((disk ^ found) >> bit) & 1))
+                bitmap_note (BITMAP_OK, first + bit);
+              else if ((disk >> bit) & 1)
+                bitmap_note (BITMAP_LEAKED, first + bit);
+              else
+                bitmap_note (BITMAP_LOST, first + bit);
+            }
+          if (repair)
+            block->b_data[k] = (found & mask) | (disk & ~mask);
+        }
+    }
+  bitmap_note (BITMAP_OK, numblocks);
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned long long used = 0;
+  unsigned long long k;
+  unsigned long files = 0;
+  int opt;
+
+  nthreads = sysconf (_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt (argc, argv, "ynj:")) != -1)
+    {
+      switch (opt)
+        {
+        case 'y':
+          repair = true;
+          break;
+        case 'n':
+          repair = false;
+          break;
+        case 'j':
+          nthreads = atoi (optarg);
+          break;
+        default:
+          usage ();
+        }
+    }
+  if (argc - optind != 1)
+    usage ();
+  nthreads = MAX (1, MIN (nthreads, MAX_THREADS));
+
+  // A block device that's mounted can't be opened exclusively
+  device_name = argv[optind];
+  device = open (device_name, (repair ? O_RDWR : O_RDONLY) | O_EXCL);
+  if (device < 0)
+    die ("unable to open device (is it mounted?)");
+  image_size = lseek (device, 0, SEEK_END);
+  if (image_size < MIN_BLOCKSIZE)
+    die ("device is too small");
+  image = mmap (NULL, image_size, PROT_READ | (repair ? PROT_WRITE : 0),
+                MAP_SHARED, device, 0);
+  if (image == MAP_FAILED)
+    die ("unable to map the device");
+
+  crc32c_init ();
+  check_super ();
+  check_journal ();
+  check_tables ();
+  run_workers (find_inode);
+  check_dirs ();
+  check_groups ();
+  run_workers (walk_inode);
+  check_shared ();
+  check_packed ();
+  check_bitmap ();
+
+  for (k = 0; k < ninodes; k++)
+    files += !!inodes[k].f_inode;
+  for (k = 0; k < (numblocks + 7) / 8; k++)
+    used += __builtin_popcount (refmap[k]);
+  printf ("%lu inodes, %llu of %llu blocks in use\n", files, used,
+          numblocks);
+
+  if (repair && (msync (image, image_size, MS_SYNC) || fsync (device)))
+    die ("unable to write out repairs");
+  munmap (image, image_size);
+  close (device);
+
+  if (!problems)
+    return 0;
+  printf ("%lu problems found, %lu repaired\n", problems, repaired);
+  return (repaired == problems) ? 2 : 4;
+}
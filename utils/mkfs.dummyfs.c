@@ -4,14 +4,24 @@
  * (based on the simplistic RAM filesystem McCreath 2001)
  */
 
+#define _GNU_SOURCE
+
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "../dummyfs/mod.h"
 
+#define WRITE_CHUNK (1UL << 20) // Bytes of metadata written at a time
+
 char *device_name;
 int device;
 
@@ -25,95 +35,253 @@ die (char *mess)
 static void
 usage (void)
 {
-  die ("Usage : mkfs.dummyfs <device name>)");
+  die ("Usage : mkfs.dummyfs [-b <block size>] [-j <journal blocks>] "
+       "[-I <inode size>] [-d] <device name>)");
+}
+
+/*
+ * Tell the device that the free space after the metadata is unused (-d),
+ * so thin-provisioned or flash storage can reclaim it. A file holding an
+ * image gets holes punched in it instead.
+ */
+static void
+discard_free (unsigned long long start, unsigned long long len)
+{
+  struct stat st;
+  uint64_t range[2] = { start, len };
+  int err;
+
+  if (!len)
+    return;
+  if (fstat (device, &st))
+    die ("unable to stat device");
+
+  if (S_ISBLK (st.st_mode))
+    err = ioctl (device, BLKDISCARD, &range);
+  else
+    err = fallocate (device, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     start, len);
+  if (err)
+    perror ("discard failed (carrying on)");
+  else
+    printf ("discarded %llu bytes\n", len);
 }
 
 int
 main (int argc, char **argv)
 {
+  unsigned long blocksize = 1UL << DEFAULT_BLOCKSIZE_BITS;
+  long long journal_blocks = -1; // Pick a size to suit the device
+  unsigned long inode_size = 0;  // A block per inode
+  int discard = false;
+  int blocksize_bits;
+  int opt;
 
-  if (argc != 2)
+  while ((opt = getopt (argc, argv, "b:j:I:d")) != -1)
+    {
+      switch (opt)
+        {
+        case 'b':
+          blocksize = strtoul (optarg, NULL, 0);
+          break;
+        case 'j':
+          journal_blocks = strtoll (optarg, NULL, 0);
+          if (journal_blocks < 0)
+            usage ();
+          break;
+        case 'I':
+          inode_size = strtoul (optarg, NULL, 0);
+          break;
+        case 'd':
+          discard = true;
+          break;
+        default:
+          usage ();
+        }
+    }
+  if (argc - optind != 1)
     usage ();
 
+  // The block size has to be a power of two the kernel module can handle
+  for (blocksize_bits = MIN_BLOCKSIZE_BITS;
+       blocksize_bits <= MAX_BLOCKSIZE_BITS; blocksize_bits++)
+    if (blocksize == 1UL << blocksize_bits)
+      break;
+  if (blocksize_bits > MAX_BLOCKSIZE_BITS)
+    die ("block size must be a power of two from 512 to 65536");
+
+  // Inodes in groups hold a whole number of pointers, and at least two fit
+  if (inode_size
+      && (inode_size < INODE_HEADER_SIZE || inode_size % sizeof (__u64)
+          || INODES_PER_GROUP (blocksize, inode_size) < 2))
+    die ("inode size must be a multiple of 8, at least 56, and fit twice "
+         "in a block");
+
   // open the device for reading and writing
-  device_name = argv[1];
+  device_name = argv[optind];
   device = open (device_name, O_RDWR);
+  if (device < 0)
+    die ("unable to open device");
 
-  off_t pos = 0;
-  struct dummyfs_block block;
+  off_t pos;
+  char *chunk;
+  struct dummyfs_block *block;
   struct dummyfs_inode_table *table;
+  struct dummyfs_inode_group *group;
   struct dummyfs_inode *inode;
-  unsigned long numblocks
-      = (unsigned long)(lseek (device, 0L, SEEK_END) / BLOCKSIZE);
-  int i;
+  struct dummyfs_journal_block *journal_block;
+  unsigned long long numblocks
+      = (unsigned long long)(lseek (device, 0L, SEEK_END) / blocksize);
+  unsigned long long bitmap_bits = BITMAP_BITS_PER_BLOCK (blocksize);
+  unsigned long long bitmap_blocks
+      = (numblocks + bitmap_bits - 1) / bitmap_bits;
+  unsigned long long journal = BITMAP_BLOCK_INDEX + bitmap_blocks;
+  unsigned long long used;
+  unsigned long long i;
+  unsigned long long j;
+  unsigned long chunk_blocks;
+  unsigned long n;
   int k;
 
-  pos = lseek (device, 0L, SEEK_SET);
-  printf ("device has %lu blocks to write\n", numblocks);
-  printf ("inode data size is %lu\n", MAX_INODE_DATA_SIZE);
-  printf ("inode size itself is %lu\n", sizeof (struct dummyfs_inode));
-  printf ("block data size is %lu\n", MAX_BLOCK_DATA_SIZE);
-  printf ("block size itself is %lu\n", sizeof (struct dummyfs_block));
-  printf ("table data size is %lu\n", MAX_TABLE_SIZE);
-  printf ("table size itself is %lu\n", sizeof (struct dummyfs_inode_table));
+  // By default, the journal gets a 32nd of the device (within reason)
+  if (journal_blocks < 0)
+    {
+      journal_blocks = numblocks / 32;
+      if (journal_blocks < 8)
+        journal_blocks = 8;
+      if (journal_blocks > 4096)
+        journal_blocks = 4096;
+    }
+  if (journal_blocks && journal_blocks < MIN_JOURNAL_BLOCKS)
+    die ("a journal needs at least 4 blocks");
+  used = journal + journal_blocks;
+
+  if (numblocks <= used)
+    die ("device is too small");
 
-  // FIXME: We don't check that numblocks <= u32max
+  chunk_blocks = MAX (WRITE_CHUNK / blocksize, 1UL);
+  chunk = malloc (chunk_blocks * blocksize);
+  if (!chunk)
+    die ("unable to allocate a buffer");
 
-  for (i = 0; i < numblocks; i++)
-    { // write each of the blocks
+  printf ("device has %llu blocks\n", numblocks);
+  printf ("block size is %lu\n", blocksize);
+  if (inode_size)
+    printf ("inodes are %lu bytes (%lu per block, %lu bytes of data)\n",
+            inode_size, INODES_PER_GROUP (blocksize, inode_size),
+            inode_size - INODE_HEADER_SIZE);
+  else
+    printf ("inode data size is %lu\n", MAX_INODE_DATA_SIZE (blocksize));
+  printf ("block data size is %lu\n", MAX_BLOCK_DATA_SIZE (blocksize));
+  printf ("table data size is %lu\n", MAX_TABLE_SIZE (blocksize));
+  printf ("allocation bitmap is %llu blocks\n", bitmap_blocks);
+  printf ("journal is %lld blocks\n", journal_blocks);
 
-      printf ("writing %u : ", i);
+  /*
+   * Only the blocks up to the end of the journal are written, a chunk at
+   * a time. Everything after them is free in the bitmap, and is only ever
+   * written once it's been allocated (as a block that starts out zeroed),
+   * so whatever is there now can stay.
+   */
+  for (i = 0; i < used; i++)
+    {
+      block = (struct dummyfs_block *)(chunk + (i % chunk_blocks) * blocksize);
+      memset (block, 0, blocksize);
 
       // Fill out the inode table block
       if (i == TABLE_BLOCK_INDEX)
         {
-          printf ("inode table block\n");
-          table = (struct dummyfs_inode_table *)&block;
-          block.b_mode = BM_TABLE;
+          table = (struct dummyfs_inode_table *)block;
+          block->b_mode = BM_TABLE;
+          table->t_blocksize_bits = blocksize_bits;
+          table->t_version = DUMMYFS_VERSION;
+          table->t_magic = DUMMYFS_MAGIC;
           table->t_numblocks = numblocks;
-          for (k = 0; k < MAX_TABLE_SIZE; k++)
+          table->t_bitmap = BITMAP_BLOCK_INDEX;
+          table->t_bitmap_blocks = bitmap_blocks;
+          table->t_journal = journal;
+          table->t_journal_blocks = journal_blocks;
+          table->t_inode_size = inode_size;
+          for (k = 0; k < MAX_TABLE_SIZE (blocksize); k++)
             {
-              table->t_table[k] = BM_UNALLOCATED;
+              table->t_table[k] = BLOCK_UNALLOCATED;
             }
-          table->b_next = BM_UNALLOCATED;
+          table->b_next = BLOCK_UNALLOCATED;
           table->t_table[0] = ROOT_DIR_BLOCK_INDEX;
         }
 
-      // Fill out the root directory inode block
+      // Fill out the root directory inode block (or the group it starts)
       else if (i == ROOT_DIR_BLOCK_INDEX)
         {
-          printf ("root dir inode block\n");
-          block.b_mode = BM_INODE;
-          inode = (struct dummyfs_inode *)&block;
+          block->b_mode = BM_INODE;
+          inode = (struct dummyfs_inode *)block;
+          if (inode_size)
+            {
+              group = (struct dummyfs_inode_group *)block;
+              group->g_used = 1;
+              group->b_next = BLOCK_UNALLOCATED;
+              inode = GROUP_INODE (group, inode_size, 0);
+              inode->b_mode = BM_INODE;
+            }
           inode->i_ino = 0;
+          inode->i_kind = IM_DIR;
           inode->i_mode = IM_DIR;
           inode->i_links = 1;
           inode->i_size = 0;
-          for (k = 0; k < MAX_INODE_DATA_SIZE; k++)
-            inode->i_data[k] = 0;
-          inode->b_next = BM_UNALLOCATED;
+          inode->i_tail = BLOCK_UNALLOCATED;
+          inode->i_pack = BLOCK_UNALLOCATED;
+          inode->b_next = BLOCK_UNALLOCATED;
         }
 
-      // Fill out empty blocks
-      else
+      /*
+       * Fill out the allocation bitmap, marking the inode table, the root
+       * directory, the bitmap itself and the journal as in use
+       */
+      else if (i < journal)
         {
-          printf ("empty block\n");
-          block.b_mode = BM_EMPTY;
-          for (k = 0; k < MAX_BLOCK_DATA_SIZE; k++)
-            block.b_data[k] = BM_UNALLOCATED;
-          block.b_next = BM_UNALLOCATED;
+          block->b_mode = BM_BITMAP;
+          block->b_next = BLOCK_UNALLOCATED;
+          for (j = (i - BITMAP_BLOCK_INDEX) * bitmap_bits;
+               j < used && j < (i - BITMAP_BLOCK_INDEX + 1) * bitmap_bits;
+               j++)
+            block->b_data[(j % bitmap_bits) / 8] |= 1 << (j % 8);
         }
 
-      // Move the file pointer to the correct block
-      if (pos != lseek (device, pos, SEEK_SET))
-        die ("seek set failed");
+      /*
+       * Start the journal off empty, expecting transaction 1 first (all
+       * of it is written, so nothing left over can pass for a transaction)
+       */
+      else
+        {
+          journal_block = (struct dummyfs_journal_block *)block;
+          journal_block->b_mode = BM_JOURNAL;
+          journal_block->b_next = BLOCK_UNALLOCATED;
+          if (i == journal)
+            {
+              journal_block->j_kind = JK_SUPER;
+              journal_block->j_seq = 1;
+            }
+        }
 
-      // Write the block to the device
-      if (sizeof (struct dummyfs_block) != write (device, &block, BLOCKSIZE))
-        die ("inode write failed");
-      pos += BLOCKSIZE;
+      // Write out each chunk once it's full (or there's no more)
+      if ((i + 1) % chunk_blocks == 0 || i + 1 == used)
+        {
+          n = i % chunk_blocks + 1;
+          pos = (off_t)(i + 1 - n) * blocksize;
+          if ((ssize_t)(n * blocksize)
+              != pwrite (device, chunk, n * blocksize, pos))
+            die ("metadata write failed");
+        }
     }
+  printf ("wrote %llu blocks of metadata\n", used);
+
+  if (discard)
+    discard_free (used * blocksize, (numblocks - used) * blocksize);
+
+  if (fsync (device))
+    die ("sync failed");
 
+  free (chunk);
   close (device);
   return 0;
 }
@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -15,6 +16,9 @@
 char *device_name;
 int device;
 
+// The allocation bitmap, minus the block headers
+unsigned char *bitmap;
+
 static void
 die (char *mess)
 {
@@ -28,6 +32,33 @@ usage (void)
   die ("Usage : view.dummyfs <device name>)");
 }
 
+/*
+ * Freed blocks are left as they were, so only the bitmap can tell whether
+ * a block is in use.
+ */
+static int
+block_used (unsigned long long i)
+{
+  return (bitmap[i / 8] >> (i % 8)) & 1;
+}
+
+static void
+print_inode (char *indent, unsigned long long i, struct dummyfs_inode *inode)
+{
+  printf ("%s%2llu: Inode %u : %s : %llu bytes : next block is %s", indent,
+          i, inode->i_ino, (IM_IS_DIR (inode->i_mode) ? "Dir" : "Reg"),
+          inode->i_size,
+          (BLOCK_IS_UNALLOCATED (inode->b_next) ? "unallocated"
+                                                : "allocated"));
+  if (!BLOCK_IS_UNALLOCATED (inode->i_pack))
+    printf (" : packed in %llu (slot %u)", inode->i_pack, inode->i_pack_slot);
+  if (IF_IS_COMPRESSED (inode->i_flags))
+    printf (" : compressed");
+  if (IF_IS_SHARED (inode->i_flags))
+    printf (" : shared");
+  printf ("\n");
+}
+
 int
 main (int argc, char **argv)
 {
@@ -39,18 +70,59 @@ main (int argc, char **argv)
   device = open (device_name, O_RDONLY);
 
   off_t pos = 0;
-  struct dummyfs_block block;
+  struct dummyfs_block *block;
   struct dummyfs_inode *inode;
   struct dummyfs_inode_table *table;
-  int numblocks;
-  int i;
+  unsigned long blocksize;
+  unsigned long inode_size;
+  unsigned long long numblocks;
+  unsigned long long bitmap_start;
+  unsigned long long bitmap_blocks;
+  unsigned long long i;
+  unsigned long bitmap_bytes;
+  unsigned long k;
 
-  // Get the number of blocks on the filesystem
-  lseek (device, TABLE_BLOCK_INDEX * sizeof (struct dummyfs_block), SEEK_SET);
-  read (device, &block, sizeof (struct dummyfs_block));
-  table = (struct dummyfs_inode_table *)&block;
+  /*
+   * Get the block size and number of blocks on the filesystem (the
+   * header of the first inode table fits in the smallest block size)
+   */
+  block = malloc (MIN_BLOCKSIZE);
+  if (!block)
+    die ("unable to allocate a block");
+  if (MIN_BLOCKSIZE != read (device, block, MIN_BLOCKSIZE))
+    die ("inode table read failed");
+  table = (struct dummyfs_inode_table *)block;
+  if (table->t_magic != DUMMYFS_MAGIC || table->t_version != DUMMYFS_VERSION)
+    die ("not a dummyfs device");
+  blocksize = 1UL << table->t_blocksize_bits;
   numblocks = table->t_numblocks;
-  printf ("Device has %d blocks\n", numblocks);
+  inode_size = table->t_inode_size;
+  bitmap_start = table->t_bitmap;
+  bitmap_blocks = table->t_bitmap_blocks;
+  printf ("Device has %llu blocks of %lu bytes\n", numblocks, blocksize);
+  if (inode_size)
+    printf ("Inodes are %lu bytes, in groups\n", inode_size);
+  free (block);
+
+  block = malloc (blocksize);
+  if (!block)
+    die ("unable to allocate a block");
+
+  bitmap_bytes = BITMAP_BITS_PER_BLOCK (blocksize) / 8;
+  bitmap = malloc (bitmap_blocks * bitmap_bytes);
+  if (!bitmap)
+    die ("unable to allocate the bitmap");
+  for (i = 0; i < bitmap_blocks; i++)
+    {
+      pos = (bitmap_start + i) * blocksize;
+      if (pos != lseek (device, pos, SEEK_SET))
+        die ("seek set failed");
+      if (blocksize != read (device, block, blocksize))
+        die ("bitmap read failed");
+      memcpy (bitmap + i * bitmap_bytes, block->b_data, bitmap_bytes);
+    }
+
+  pos = 0;
   lseek (device, pos, SEEK_SET);
 
   for (i = 0; i < numblocks; i++)
@@ -59,31 +131,59 @@ main (int argc, char **argv)
       if (pos != lseek (device, pos, SEEK_SET))
         die ("seek set failed");
 
-      if (BLOCKSIZE != read (device, &block, BLOCKSIZE))
+      if (blocksize != read (device, block, blocksize))
         die ("inode read failed");
 
-      if (BM_IS_EMPTY (block.b_mode))
-        printf ("%2d: Empty block\n", i);
-      else if (BM_IS_INODE (block.b_mode))
+      if (BM_IS_EMPTY (block->b_mode) || !block_used (i))
+        printf ("%2llu: Empty block\n", i);
+      else if (BM_IS_INODE (block->b_mode) && inode_size)
         {
-          inode = (struct dummyfs_inode *)&block;
-          printf ("%2d: Inode %u : %s : %u bytes : next block is %s\n", i,
-                  inode->i_ino, (IM_IS_DIR (inode->i_mode) ? "Dir" : "Reg"),
-                  inode->i_size,
-                  (BM_IS_UNALLOCATED (inode->b_next) ? "unallocated"
-                                                     : "allocated"));
+          printf ("%2llu: Inode group : %u inodes\n", i,
+                  ((struct dummyfs_inode_group *)block)->g_used);
+          for (k = 0; k < INODES_PER_GROUP (blocksize, inode_size); k++)
+            {
+              inode = GROUP_INODE (block, inode_size, k);
+              if (BM_IS_INODE (inode->b_mode))
+                print_inode ("  ", i, inode);
+            }
         }
+      else if (BM_IS_INODE (block->b_mode))
+        print_inode ("", i, (struct dummyfs_inode *)block);
       else if (i == TABLE_BLOCK_INDEX)
         {
-          table = (struct dummyfs_inode_table *)&block;
-          printf ("%2d : Inode table : %d blocks : next block is %s\n", i,
-                  table->t_numblocks,
-                  (BM_IS_UNALLOCATED (table->b_next) ? "unallocated"
-                                                     : "allocated"));
+          table = (struct dummyfs_inode_table *)block;
+          printf ("%2llu : Inode table : %llu blocks : bitmap at %llu (%llu "
+                  "blocks) : journal at %llu (%llu blocks) : next block is "
+                  "%s\n",
+                  i, table->t_numblocks, table->t_bitmap,
+                  table->t_bitmap_blocks, table->t_journal,
+                  table->t_journal_blocks,
+                  (BLOCK_IS_UNALLOCATED (table->b_next) ? "unallocated"
+                                                        : "allocated"));
+        }
+      else if (BM_IS_DATA (block->b_mode))
+        {
+          printf ("%2llu: Data block %u%s : next block is %s", i,
+                  block->b_index,
+                  (BF_IS_COMPRESSED (block->b_flags) ? " (compressed)" : ""),
+                  (BLOCK_IS_UNALLOCATED (block->b_next) ? "unallocated"
+                                                        : "allocated"));
+          if (block->b_refs)
+            printf (" : shared (%u more)", block->b_refs);
+          printf ("\n");
         }
+      else if (BM_IS_BITMAP (block->b_mode))
+        printf ("%2llu: Allocation bitmap block\n", i);
+      else if (BM_IS_JOURNAL (block->b_mode))
+        printf ("%2llu: Journal block\n", i);
+      else if (BM_IS_PACKED (block->b_mode))
+        printf ("%2llu: Packed block : %u slots\n", i,
+                ((struct dummyfs_packed_block *)block)->p_slots);
 
-      pos += BLOCKSIZE;
+      pos += blocksize;
     }
+  free (bitmap);
+  free (block);
   close (device);
   return 0;
 }